@@ -19,6 +19,7 @@
 #include "astartedevicesdk_p.h"
 
 #include "astarteinterface.h"
+#include "astartesendhandle_p.h"
 
 #include "rapidjson/error/en.h"
 #include "rapidjson/filereadstream.h"
@@ -28,15 +29,25 @@
 #include <QtCore/QDebug>
 #include <QtCore/QDir>
 #include <QtCore/QFileInfo>
+#include <QtCore/QSettings>
+
+#include <limits>
 
 #include "internal/transport.h"
+#include "internal/transportthread.h"
 #include "internal/producerabstractinterface.h"
 
 #include "utils/astartegenericconsumer.h"
 #include "utils/astartegenericproducer.h"
+#include "utils/payloadcompressor.h"
 #include "utils/validateinterfaceoperation.h"
 #include "utils/utils.h"
 
+#define DEFAULT_COMPRESSION_THRESHOLD 256
+
+#define DEFAULT_INBOUND_QUEUE_SIZE 1024
+#define DEFAULT_INBOUND_OVERFLOW_SIZE 4096
+
 using namespace rapidjson;
 
 AstarteDeviceSDK::AstarteDeviceSDK(const QString &configurationPath, const QString &interfacesDir,
@@ -55,6 +66,27 @@ AstarteDeviceSDK::~AstarteDeviceSDK()
 
 void AstarteDeviceSDK::initImpl()
 {
+    bool transportThread;
+    int inboundQueueSize;
+    int inboundOverflowSize;
+    QSettings settings(d->configurationPath, QSettings::IniFormat);
+    settings.beginGroup(QLatin1String("AstarteTransport")); {
+        transportThread = settings.value(QLatin1String("transportThread"), false).toBool();
+        inboundQueueSize = settings.value(QLatin1String("inboundQueueSize"), DEFAULT_INBOUND_QUEUE_SIZE).toInt();
+        // Waves which don't fit in the queue wait on the transport thread, up to this many
+        inboundOverflowSize = settings.value(QLatin1String("inboundOverflowSize"), DEFAULT_INBOUND_OVERFLOW_SIZE).toInt();
+    } settings.endGroup();
+
+    if (transportThread) {
+        // Don't wait for the transport here, we'll be ready once it is
+        d->transportThread = new Astarte::TransportThread(d->configurationPath, d->hardwareId, inboundQueueSize,
+                                                         inboundOverflowSize, this);
+        connect(d->transportThread, SIGNAL(transportReady(bool,QString,QString)),
+                this, SLOT(onTransportThreadReady(bool,QString,QString)));
+        d->transportThread->start();
+        return;
+    }
+
     d->astarteTransport = new Astarte::Transport(d->configurationPath, d->hardwareId, this);
     if (!d->astarteTransport->init()->synchronize()) {
         setInitError("transport", "op->errorMessage()");
@@ -65,6 +97,20 @@ void AstarteDeviceSDK::initImpl()
     setReady();
 }
 
+void AstarteDeviceSDK::onTransportThreadReady(bool ok, const QString &errorName, const QString &errorMessage)
+{
+    if (!ok) {
+        setInitError(errorName, errorMessage);
+        return;
+    }
+
+    // Producers and consumers stay on our thread, their calls reach the transport through the thread's queues
+    d->astarteTransport = d->transportThread->transport();
+    d->loadInterfaces();
+
+    setReady();
+}
+
 void AstarteDeviceSDK::Private::loadInterfaces()
 {
     QHash< QByteArray, AstarteInterface > introspection;
@@ -169,6 +215,7 @@ void AstarteDeviceSDK::Private::createProducer(const AstarteInterface &interface
     QHash<QByteArray, Retention> mappingToRetention;
     QHash<QByteArray, Reliability> mappingToReliability;
     QHash<QByteArray, int> mappingToExpiry;
+    QHash<QByteArray, Util::PayloadCompressor> mappingToCompressor;
 
     for (SizeType i = 0; i < producerObject["mappings"].Size(); i++) {
         rapidjson::Value::ConstObject mappingObj = producerObject["mappings"][i].GetObject();
@@ -194,6 +241,22 @@ void AstarteDeviceSDK::Private::createProducer(const AstarteInterface &interface
                 mappingToExpiry.insert(path, expiry);
             }
         }
+
+        QString compression = mappingObj.HasMember("compression") ? mappingObj["compression"].GetString() : QString();
+        if (compression == QLatin1String("zlib")) {
+            int threshold = mappingObj.HasMember("compression_threshold") ? mappingObj["compression_threshold"].GetInt()
+                                                                          : DEFAULT_COMPRESSION_THRESHOLD;
+            QByteArray dictionary;
+            if (mappingObj.HasMember("compression_dictionary")) {
+                QFile dictionaryFile(QDir(interfacesDir).absoluteFilePath(QString::fromUtf8(mappingObj["compression_dictionary"].GetString())));
+                if (dictionaryFile.open(QIODevice::ReadOnly)) {
+                    dictionary = dictionaryFile.readAll();
+                } else {
+                    qWarning() << "Can't read compression dictionary" << dictionaryFile.fileName() << "for" << path << ", compressing without it";
+                }
+            }
+            mappingToCompressor.insert(path, Util::PayloadCompressor(threshold, dictionary));
+        }
     }
 
     AstarteGenericProducer *producer = new AstarteGenericProducer(interface.interface(), interface.interfaceType(),
@@ -203,6 +266,7 @@ void AstarteDeviceSDK::Private::createProducer(const AstarteInterface &interface
     producer->setMappingToRetention(mappingToRetention);
     producer->setMappingToReliability(mappingToReliability);
     producer->setMappingToExpiry(mappingToExpiry);
+    producer->setMappingToCompressor(mappingToCompressor);
 
     producers.insert(interface.interface(), producer);
     qDebug() << "Producer for interface " << interface.interface() << " successfully initialized";
@@ -262,12 +326,254 @@ bool AstarteDeviceSDK::sendData(const QByteArray &interface, const QByteArray &p
 bool AstarteDeviceSDK::sendData(const QByteArray &interface, const QByteArray &path, const QVariant &value, const QDateTime &timestamp,
                                 const QVariantHash &metadata)
 {
-    if (!d->producers.contains(interface)) {
-        qWarning() << "No producers for interface " << interface;
+    AstarteGenericProducer *producer = d->producer(interface);
+    if (!producer) {
+        return false;
+    }
+
+    return producer->sendData(value, path, timestamp, metadata);
+}
+
+bool AstarteDeviceSDK::sendData(const QByteArray &interface, const QByteArray &path, double value, const QDateTime &timestamp,
+                                const QVariantHash &metadata)
+{
+    AstarteGenericProducer *producer = d->producer(interface);
+    if (!producer) {
+        return false;
+    }
+
+    return producer->sendData(value, path, timestamp, metadata);
+}
+
+bool AstarteDeviceSDK::sendData(const QByteArray &interface, const QByteArray &path, int value, const QDateTime &timestamp,
+                                const QVariantHash &metadata)
+{
+    AstarteGenericProducer *producer = d->producer(interface);
+    if (!producer) {
+        return false;
+    }
+
+    return producer->sendData(value, path, timestamp, metadata);
+}
+
+bool AstarteDeviceSDK::sendData(const QByteArray &interface, const QByteArray &path, qint64 value, const QDateTime &timestamp,
+                                const QVariantHash &metadata)
+{
+    AstarteGenericProducer *producer = d->producer(interface);
+    if (!producer) {
+        return false;
+    }
+
+    return producer->sendData(value, path, timestamp, metadata);
+}
+
+bool AstarteDeviceSDK::sendData(const QByteArray &interface, const QByteArray &path, uint value, const QDateTime &timestamp,
+                                const QVariantHash &metadata)
+{
+    return sendData(interface, path, static_cast<qint64>(value), timestamp, metadata);
+}
+
+bool AstarteDeviceSDK::sendData(const QByteArray &interface, const QByteArray &path, long value, const QDateTime &timestamp,
+                                const QVariantHash &metadata)
+{
+    return sendData(interface, path, static_cast<qint64>(value), timestamp, metadata);
+}
+
+bool AstarteDeviceSDK::sendData(const QByteArray &interface, const QByteArray &path, ulong value, const QDateTime &timestamp,
+                                const QVariantHash &metadata)
+{
+    if (value > quint64(std::numeric_limits<qint64>::max())) {
+        qWarning() << "Value" << value << "does not fit in a longinteger";
+        return false;
+    }
+
+    return sendData(interface, path, static_cast<qint64>(value), timestamp, metadata);
+}
+
+bool AstarteDeviceSDK::sendData(const QByteArray &interface, const QByteArray &path, quint64 value, const QDateTime &timestamp,
+                                const QVariantHash &metadata)
+{
+    if (value > quint64(std::numeric_limits<qint64>::max())) {
+        qWarning() << "Value" << value << "does not fit in a longinteger";
+        return false;
+    }
+
+    return sendData(interface, path, static_cast<qint64>(value), timestamp, metadata);
+}
+
+bool AstarteDeviceSDK::sendData(const QByteArray &interface, const QByteArray &path, bool value, const QDateTime &timestamp,
+                                const QVariantHash &metadata)
+{
+    AstarteGenericProducer *producer = d->producer(interface);
+    if (!producer) {
+        return false;
+    }
+
+    return producer->sendData(value, path, timestamp, metadata);
+}
+
+bool AstarteDeviceSDK::sendData(const QByteArray &interface, const QByteArray &path, const QString &value, const QDateTime &timestamp,
+                                const QVariantHash &metadata)
+{
+    AstarteGenericProducer *producer = d->producer(interface);
+    if (!producer) {
+        return false;
+    }
+
+    return producer->sendData(value, path, timestamp, metadata);
+}
+
+bool AstarteDeviceSDK::sendData(const QByteArray &interface, const QByteArray &path, const char *value, const QDateTime &timestamp,
+                                const QVariantHash &metadata)
+{
+    AstarteGenericProducer *producer = d->producer(interface);
+    if (!producer) {
+        return false;
+    }
+
+    return producer->sendData(QString(value), path, timestamp, metadata);
+}
+
+bool AstarteDeviceSDK::sendData(const QByteArray &interface, const QByteArray &path, const QByteArray &value, const QDateTime &timestamp,
+                                const QVariantHash &metadata)
+{
+    AstarteGenericProducer *producer = d->producer(interface);
+    if (!producer) {
+        return false;
+    }
+
+    return producer->sendData(value, path, timestamp, metadata);
+}
+
+bool AstarteDeviceSDK::sendData(const QByteArray &interface, const QByteArray &path, const QDateTime &value, const QDateTime &timestamp,
+                                const QVariantHash &metadata)
+{
+    AstarteGenericProducer *producer = d->producer(interface);
+    if (!producer) {
+        return false;
+    }
+
+    return producer->sendData(value, path, timestamp, metadata);
+}
+
+AstarteSendHandle AstarteDeviceSDK::sendHandle(const QByteArray &interface, const QByteArray &path) const
+{
+    AstarteGenericProducer *producer = d->producer(interface);
+    if (!producer) {
+        return AstarteSendHandle();
+    }
+
+    return producer->sendHandle(path);
+}
+
+bool AstarteDeviceSDK::sendData(const AstarteSendHandle &handle, double value, const QDateTime &timestamp, const QVariantHash &metadata)
+{
+    if (!handle.isValid()) {
+        qWarning() << "Invalid send handle";
+        return false;
+    }
+
+    return handle.d->producer->sendData(handle, value, timestamp, metadata);
+}
+
+bool AstarteDeviceSDK::sendData(const AstarteSendHandle &handle, int value, const QDateTime &timestamp, const QVariantHash &metadata)
+{
+    if (!handle.isValid()) {
+        qWarning() << "Invalid send handle";
+        return false;
+    }
+
+    return handle.d->producer->sendData(handle, value, timestamp, metadata);
+}
+
+bool AstarteDeviceSDK::sendData(const AstarteSendHandle &handle, qint64 value, const QDateTime &timestamp, const QVariantHash &metadata)
+{
+    if (!handle.isValid()) {
+        qWarning() << "Invalid send handle";
+        return false;
+    }
+
+    return handle.d->producer->sendData(handle, value, timestamp, metadata);
+}
+
+bool AstarteDeviceSDK::sendData(const AstarteSendHandle &handle, uint value, const QDateTime &timestamp, const QVariantHash &metadata)
+{
+    return sendData(handle, static_cast<qint64>(value), timestamp, metadata);
+}
+
+bool AstarteDeviceSDK::sendData(const AstarteSendHandle &handle, long value, const QDateTime &timestamp, const QVariantHash &metadata)
+{
+    return sendData(handle, static_cast<qint64>(value), timestamp, metadata);
+}
+
+bool AstarteDeviceSDK::sendData(const AstarteSendHandle &handle, ulong value, const QDateTime &timestamp, const QVariantHash &metadata)
+{
+    if (value > quint64(std::numeric_limits<qint64>::max())) {
+        qWarning() << "Value" << value << "does not fit in a longinteger";
+        return false;
+    }
+
+    return sendData(handle, static_cast<qint64>(value), timestamp, metadata);
+}
+
+bool AstarteDeviceSDK::sendData(const AstarteSendHandle &handle, quint64 value, const QDateTime &timestamp, const QVariantHash &metadata)
+{
+    if (value > quint64(std::numeric_limits<qint64>::max())) {
+        qWarning() << "Value" << value << "does not fit in a longinteger";
+        return false;
+    }
+
+    return sendData(handle, static_cast<qint64>(value), timestamp, metadata);
+}
+
+bool AstarteDeviceSDK::sendData(const AstarteSendHandle &handle, bool value, const QDateTime &timestamp, const QVariantHash &metadata)
+{
+    if (!handle.isValid()) {
+        qWarning() << "Invalid send handle";
+        return false;
+    }
+
+    return handle.d->producer->sendData(handle, value, timestamp, metadata);
+}
+
+bool AstarteDeviceSDK::sendData(const AstarteSendHandle &handle, const QString &value, const QDateTime &timestamp, const QVariantHash &metadata)
+{
+    if (!handle.isValid()) {
+        qWarning() << "Invalid send handle";
+        return false;
+    }
+
+    return handle.d->producer->sendData(handle, value, timestamp, metadata);
+}
+
+bool AstarteDeviceSDK::sendData(const AstarteSendHandle &handle, const char *value, const QDateTime &timestamp, const QVariantHash &metadata)
+{
+    if (!handle.isValid()) {
+        qWarning() << "Invalid send handle";
+        return false;
+    }
+
+    return handle.d->producer->sendData(handle, QString(value), timestamp, metadata);
+}
+
+bool AstarteDeviceSDK::sendData(const AstarteSendHandle &handle, const QByteArray &value, const QDateTime &timestamp, const QVariantHash &metadata)
+{
+    if (!handle.isValid()) {
+        qWarning() << "Invalid send handle";
+        return false;
+    }
+
+    return handle.d->producer->sendData(handle, value, timestamp, metadata);
+}
+
+bool AstarteDeviceSDK::sendData(const AstarteSendHandle &handle, const QDateTime &value, const QDateTime &timestamp, const QVariantHash &metadata)
+{
+    if (!handle.isValid()) {
+        qWarning() << "Invalid send handle";
         return false;
     }
 
-    return d->producers.value(interface)->sendData(value, path, timestamp, metadata);
+    return handle.d->producer->sendData(handle, value, timestamp, metadata);
 }
 
 bool AstarteDeviceSDK::sendData(const QByteArray &interface, const QVariantHash &value, const QVariantHash &metadata)
@@ -330,12 +636,24 @@ bool AstarteDeviceSDK::sendData(const QByteArray &interface, const QVariantHash
     return d->producers.value(interface)->sendData(normalizedValues, trailingPath.toLatin1(), timestamp, metadata);
 }
 
+AstarteGenericProducer *AstarteDeviceSDK::Private::producer(const QByteArray &interface) const
+{
+    AstarteGenericProducer *producer = producers.value(interface);
+    if (!producer) {
+        qWarning() << "No producers for interface " << interface;
+    }
+
+    return producer;
+}
+
+// Inbound paths are views on the received message, the application gets a copy it can keep
+
 void AstarteDeviceSDK::Private::unsetValue(const QByteArray &interface, const QByteArray &path)
 {
-    Q_EMIT q->unsetReceived(interface, path);
+    Q_EMIT q->unsetReceived(interface, QByteArray(path.constData(), path.length()));
 }
 
 void AstarteDeviceSDK::Private::receiveValue(const QByteArray &interface, const QByteArray &path, const QVariant &value)
 {
-    Q_EMIT q->dataReceived(interface, path, value);
+    Q_EMIT q->dataReceived(interface, QByteArray(path.constData(), path.length()), value);
 }
@@ -25,6 +25,7 @@
 
 #include <utils/hemeraasyncinitobject.h>
 #include <astartedevicesdk_global.h>
+#include <astartesendhandle.h>
 
 typedef QList<QByteArray> QByteArrayList;
 
@@ -43,6 +44,62 @@ public:
     bool sendData(const QByteArray &interface, const QByteArray &path, const QVariant &value, const QVariantHash &metadata);
     bool sendData(const QByteArray &interface, const QByteArray &path, const QVariant &value, const QDateTime &timestamp = QDateTime(),
                   const QVariantHash &metadata = QVariantHash());
+
+    // Typed overloads, they skip the QVariant round trip when value matches the mapping type
+    bool sendData(const QByteArray &interface, const QByteArray &path, double value, const QDateTime &timestamp = QDateTime(),
+                  const QVariantHash &metadata = QVariantHash());
+    bool sendData(const QByteArray &interface, const QByteArray &path, int value, const QDateTime &timestamp = QDateTime(),
+                  const QVariantHash &metadata = QVariantHash());
+    bool sendData(const QByteArray &interface, const QByteArray &path, qint64 value, const QDateTime &timestamp = QDateTime(),
+                  const QVariantHash &metadata = QVariantHash());
+    // The other integer types would be ambiguous between int and qint64, they are sent as qint64
+    bool sendData(const QByteArray &interface, const QByteArray &path, uint value, const QDateTime &timestamp = QDateTime(),
+                  const QVariantHash &metadata = QVariantHash());
+    bool sendData(const QByteArray &interface, const QByteArray &path, long value, const QDateTime &timestamp = QDateTime(),
+                  const QVariantHash &metadata = QVariantHash());
+    bool sendData(const QByteArray &interface, const QByteArray &path, ulong value, const QDateTime &timestamp = QDateTime(),
+                  const QVariantHash &metadata = QVariantHash());
+    bool sendData(const QByteArray &interface, const QByteArray &path, quint64 value, const QDateTime &timestamp = QDateTime(),
+                  const QVariantHash &metadata = QVariantHash());
+    bool sendData(const QByteArray &interface, const QByteArray &path, bool value, const QDateTime &timestamp = QDateTime(),
+                  const QVariantHash &metadata = QVariantHash());
+    bool sendData(const QByteArray &interface, const QByteArray &path, const QString &value, const QDateTime &timestamp = QDateTime(),
+                  const QVariantHash &metadata = QVariantHash());
+    bool sendData(const QByteArray &interface, const QByteArray &path, const char *value, const QDateTime &timestamp = QDateTime(),
+                  const QVariantHash &metadata = QVariantHash());
+    bool sendData(const QByteArray &interface, const QByteArray &path, const QByteArray &value, const QDateTime &timestamp = QDateTime(),
+                  const QVariantHash &metadata = QVariantHash());
+    bool sendData(const QByteArray &interface, const QByteArray &path, const QDateTime &value, const QDateTime &timestamp = QDateTime(),
+                  const QVariantHash &metadata = QVariantHash());
+
+    /// Resolves interface and path once, sending through the returned handle skips the per call lookups
+    AstarteSendHandle sendHandle(const QByteArray &interface, const QByteArray &path) const;
+
+    bool sendData(const AstarteSendHandle &handle, double value, const QDateTime &timestamp = QDateTime(),
+                  const QVariantHash &metadata = QVariantHash());
+    bool sendData(const AstarteSendHandle &handle, int value, const QDateTime &timestamp = QDateTime(),
+                  const QVariantHash &metadata = QVariantHash());
+    bool sendData(const AstarteSendHandle &handle, qint64 value, const QDateTime &timestamp = QDateTime(),
+                  const QVariantHash &metadata = QVariantHash());
+    bool sendData(const AstarteSendHandle &handle, uint value, const QDateTime &timestamp = QDateTime(),
+                  const QVariantHash &metadata = QVariantHash());
+    bool sendData(const AstarteSendHandle &handle, long value, const QDateTime &timestamp = QDateTime(),
+                  const QVariantHash &metadata = QVariantHash());
+    bool sendData(const AstarteSendHandle &handle, ulong value, const QDateTime &timestamp = QDateTime(),
+                  const QVariantHash &metadata = QVariantHash());
+    bool sendData(const AstarteSendHandle &handle, quint64 value, const QDateTime &timestamp = QDateTime(),
+                  const QVariantHash &metadata = QVariantHash());
+    bool sendData(const AstarteSendHandle &handle, bool value, const QDateTime &timestamp = QDateTime(),
+                  const QVariantHash &metadata = QVariantHash());
+    bool sendData(const AstarteSendHandle &handle, const QString &value, const QDateTime &timestamp = QDateTime(),
+                  const QVariantHash &metadata = QVariantHash());
+    bool sendData(const AstarteSendHandle &handle, const char *value, const QDateTime &timestamp = QDateTime(),
+                  const QVariantHash &metadata = QVariantHash());
+    bool sendData(const AstarteSendHandle &handle, const QByteArray &value, const QDateTime &timestamp = QDateTime(),
+                  const QVariantHash &metadata = QVariantHash());
+    bool sendData(const AstarteSendHandle &handle, const QDateTime &value, const QDateTime &timestamp = QDateTime(),
+                  const QVariantHash &metadata = QVariantHash());
+
     bool sendData(const QByteArray &interface, const QVariantHash &value, const QVariantHash &metadata);
     bool sendData(const QByteArray &interface, const QVariantHash &value, const QDateTime &timestamp = QDateTime(),
                   const QVariantHash &metadata = QVariantHash());
@@ -55,6 +112,9 @@ protected Q_SLOTS:
 
     void initImpl();
 
+private Q_SLOTS:
+    void onTransportThreadReady(bool ok, const QString &errorName, const QString &errorMessage);
+
 private:
     class Private;
     Private * const d;
@@ -30,16 +30,22 @@
 
 #include "internal/producerabstractinterface.h"
 
+namespace Astarte {
+class TransportThread;
+}
+
 using namespace rapidjson;
 
 class AstarteDeviceSDK::Private {
 public:
-    Private(AstarteDeviceSDK *q) : q(q) {}
+    Private(AstarteDeviceSDK *q) : q(q), transportThread(0) {}
     ~Private() {}
 
     AstarteDeviceSDK * const q;
 
     Astarte::Transport *astarteTransport;
+    // Only when the transport runs on a thread of its own
+    Astarte::TransportThread *transportThread;
 
     QString configurationPath;
     QString interfacesDir;
@@ -54,6 +60,8 @@ public:
     void createProducer(const AstarteInterface &interface, const rapidjson::Document &producerObject);
     void createConsumer(const AstarteInterface &interface, const rapidjson::Document &consumerObject);
 
+    AstarteGenericProducer *producer(const QByteArray &interface) const;
+
     QVariant::Type typeStringToVariantType(const QString &typeString) const;
     Retention retentionStringToRetention(const QString &retentionString) const;
     Reliability reliabilityStringToReliability(const QString &reliabilityString) const;
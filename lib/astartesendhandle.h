@@ -0,0 +1,59 @@
+/*
+ * Copyright (C) 2017 Ispirata Srl
+ *
+ * This file is part of Astarte.
+ * Astarte is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Astarte is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Astarte.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ASTARTESENDHANDLE_H
+#define ASTARTESENDHANDLE_H
+
+#include <QtCore/QByteArray>
+#include <QtCore/QSharedDataPointer>
+
+#include <astartedevicesdk_global.h>
+
+class AstarteSendHandleData;
+
+/**
+ * An interface path resolved once through AstarteDeviceSDK::sendHandle.
+ *
+ * The handle caches the mapping type, the attributes, the publish QoS and the MQTT topic of the path,
+ * so sending through it only serializes and publishes the value. Copies share the same cache.
+ * A handle is valid as long as the AstarteDeviceSDK which created it.
+ */
+class ASTARTEQT4SDKSHARED_EXPORT AstarteSendHandle
+{
+public:
+    AstarteSendHandle();
+    AstarteSendHandle(const AstarteSendHandle &other);
+    ~AstarteSendHandle();
+
+    AstarteSendHandle &operator=(const AstarteSendHandle &rhs);
+
+    bool isValid() const;
+
+    QByteArray interface() const;
+    QByteArray path() const;
+
+private:
+    explicit AstarteSendHandle(AstarteSendHandleData *data);
+
+    QExplicitlySharedDataPointer<AstarteSendHandleData> d;
+
+    friend class AstarteDeviceSDK;
+    friend class AstarteGenericProducer;
+};
+
+#endif // ASTARTESENDHANDLE_H
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2017 Ispirata Srl
+ *
+ * This file is part of Astarte.
+ * Astarte is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Astarte is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Astarte.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ASTARTESENDHANDLE_P_H
+#define ASTARTESENDHANDLE_P_H
+
+#include "astartesendhandle.h"
+
+#include "internal/cachemessage.h"
+#include "internal/mqttclientwrapper.h"
+
+#include "utils/payloadcompressor.h"
+
+#include <QtCore/QPointer>
+#include <QtCore/QSharedData>
+#include <QtCore/QVariant>
+
+class AstarteGenericProducer;
+
+class AstarteSendHandleData : public QSharedData
+{
+public:
+    AstarteSendHandleData()
+        : type(QVariant::Invalid), qos(Astarte::MQTTClientWrapper::DefaultQoS) { }
+
+    // Handles may outlive the producer, or the whole SDK
+    QPointer<AstarteGenericProducer> producer;
+
+    QByteArray interface;
+    QByteArray path;
+    QVariant::Type type;
+    // Target, interface type and attributes of every message sent through the handle
+    Astarte::CacheMessage message;
+    Astarte::MQTTClientWrapper::MQTTQoS qos;
+    // Disabled unless the mapping asks for compression
+    Util::PayloadCompressor compressor;
+
+    // Full MQTT topic, filled in by the transport on the first publish
+    QByteArray topic;
+};
+
+#endif // ASTARTESENDHANDLE_P_H
@@ -0,0 +1 @@
+CREATE INDEX cachemessages_expiry ON cachemessages (expiry)
@@ -0,0 +1 @@
+ALTER TABLE persistent_entries ADD COLUMN sync_generation integer not null default 0
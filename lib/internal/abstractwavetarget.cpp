@@ -36,11 +36,16 @@ AbstractWaveTarget::AbstractWaveTarget(const QByteArray &interface, Astarte::Tra
     d->interface = interface;
     d->astarteTransport = astarteTransport;
 
-    connect(d->astarteTransport, SIGNAL(waveReceived(QByteArray,Wave)), this, SLOT(handleReceivedWave(QByteArray,Wave)));
+    d->astarteTransport->registerWaveTarget(interface, this);
 }
 
 AbstractWaveTarget::~AbstractWaveTarget()
 {
+    Q_D(AbstractWaveTarget);
+    if (d->astarteTransport) {
+        d->astarteTransport->unregisterWaveTarget(d->interface, this);
+    }
+
     delete d_w_ptr;
 }
 
@@ -51,6 +56,13 @@ QByteArray AbstractWaveTarget::interface() const
     return d->interface;
 }
 
+Astarte::Transport *AbstractWaveTarget::astarteTransport() const
+{
+    Q_D(const AbstractWaveTarget);
+
+    return d->astarteTransport;
+}
+
 bool AbstractWaveTarget::isReady() const
 {
     return true;
@@ -69,20 +81,30 @@ void AbstractWaveTarget::handleReceivedWave(const QByteArray &interface, const W
 
 void AbstractWaveTarget::sendRebound(const Rebound &rebound)
 {
-    Q_UNUSED(rebound)
+    Q_D(AbstractWaveTarget);
+    if (d->astarteTransport.isNull()) {
+        qWarning() << "Can't send rebound, transport is gone";
+        return;
+    }
+
+    // Lets the transport release the wave
+    d->astarteTransport->rebound(rebound);
 }
 
 void AbstractWaveTarget::sendFluctuation(const QByteArray &targetPath, const Fluctuation &payload)
 {
+    Q_D(AbstractWaveTarget);
+    if (d->astarteTransport.isNull()) {
+        qWarning() << "Can't send fluctuation, transport is gone";
+        return;
+    }
+
     Astarte::CacheMessage c;
     c.setTarget(QByteArray("/%1%2").replace("%1", interface()).replace("%2", targetPath));
     c.setPayload(payload.payload());
+    // Also picks up the interfaceType attribute
     c.setAttributes(payload.attributes());
-    AstarteInterface::Type interfaceType =
-        static_cast<AstarteInterface::Type>(payload.attributes().value("interfaceType").toInt());
-    c.setInterfaceType(interfaceType);
     // TODO: Make this async?
-    Q_D(AbstractWaveTarget);
     d->astarteTransport->cacheMessage(c);
 }
 
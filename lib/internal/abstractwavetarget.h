@@ -26,6 +26,7 @@
 
 namespace Astarte {
 class Transport;
+class TransportThread;
 }
 
 /**
@@ -76,8 +77,14 @@ protected Q_SLOTS:
 
 
 protected:
+    // Deliver waves through handleReceivedWave
+    friend class Astarte::Transport;
+    friend class Astarte::TransportThread;
+
     AbstractWaveTargetPrivate * const d_w_ptr;
 
+    Astarte::Transport *astarteTransport() const;
+
     virtual void waveFunction(const Wave &wave) = 0;
 };
 
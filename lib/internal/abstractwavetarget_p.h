@@ -21,6 +21,10 @@
 
 #include "abstractwavetarget.h"
 
+#include "transport.h"
+
+#include <QtCore/QPointer>
+
 typedef void (AbstractWaveTarget::* WaveFunction)(quint64 waveId,
                                                   const ByteArrayHash &attributes, const QByteArray &payload);
 
@@ -31,7 +35,8 @@ public:
     virtual ~AbstractWaveTargetPrivate() {}
 
     QByteArray interface;
-    Astarte::Transport *astarteTransport;
+    // The transport can go away first, both are usually children of the SDK
+    QPointer<Astarte::Transport> astarteTransport;
 };
 
 #endif
@@ -29,20 +29,127 @@
 
 namespace Astarte {
 
+// Version 2 stores the well known attributes as typed fields instead of strings in "a"
+#define CACHE_MESSAGE_FORMAT_VERSION 2
+
+enum AttributeKey {
+    ExtensionAttribute = 0,
+    RetentionAttribute,
+    ReliabilityAttribute,
+    ExpiryAttribute,
+    AbsoluteExpiryAttribute,
+    DbIdAttribute,
+    InterfaceTypeAttribute
+};
+
+static AttributeKey attributeKey(const QByteArray &attribute)
+{
+    if (attribute == "retention") {
+        return RetentionAttribute;
+    } else if (attribute == "reliability") {
+        return ReliabilityAttribute;
+    } else if (attribute == "expiry") {
+        return ExpiryAttribute;
+    } else if (attribute == "absoluteExpiry") {
+        return AbsoluteExpiryAttribute;
+    } else if (attribute == "dbId") {
+        return DbIdAttribute;
+    } else if (attribute == "interfaceType") {
+        return InterfaceTypeAttribute;
+    }
+
+    return ExtensionAttribute;
+}
+
 class CacheMessageData : public QSharedData
 {
 public:
-    CacheMessageData() { }
+    CacheMessageData()
+        : interfaceType(AstarteInterface::UnknownType), retention(UnknownRetention), reliability(UnknownReliability)
+        , expiry(0), absoluteExpiry(0), timestamp(0), dbId(0) { }
     CacheMessageData(const CacheMessageData &other)
-        : QSharedData(other), target(other.target), interfaceType(other.interfaceType), payload(other.payload), attributes(other.attributes) { }
+        : QSharedData(other), target(other.target), interfaceType(other.interfaceType), payload(other.payload)
+        , retention(other.retention), reliability(other.reliability), expiry(other.expiry)
+        , absoluteExpiry(other.absoluteExpiry), timestamp(other.timestamp), dbId(other.dbId), extensionAttributes(other.extensionAttributes) { }
     ~CacheMessageData() { }
 
     QByteArray target;
     AstarteInterface::Type interfaceType;
     QByteArray payload;
-    QHash<QByteArray, QByteArray> attributes;
+
+    Retention retention;
+    Reliability reliability;
+    int expiry;
+    qint64 absoluteExpiry;
+    qint64 timestamp;
+    qint64 dbId;
+    // Attributes without a typed field
+    QHash<QByteArray, QByteArray> extensionAttributes;
+
+    bool setAttribute(const QByteArray &attribute, const QByteArray &value);
+    bool clearAttribute(const QByteArray &attribute);
 };
 
+bool CacheMessageData::setAttribute(const QByteArray &attribute, const QByteArray &value)
+{
+    switch (attributeKey(attribute)) {
+        case RetentionAttribute:
+            retention = static_cast<Retention>(value.toInt());
+            return true;
+        case ReliabilityAttribute:
+            reliability = static_cast<Reliability>(value.toInt());
+            return true;
+        case ExpiryAttribute:
+            expiry = value.toInt();
+            return true;
+        case AbsoluteExpiryAttribute:
+            absoluteExpiry = value.toLongLong();
+            return true;
+        case DbIdAttribute:
+            dbId = value.toLongLong();
+            return true;
+        case InterfaceTypeAttribute:
+            interfaceType = static_cast<AstarteInterface::Type>(value.toInt());
+            return true;
+        default:
+            extensionAttributes.insert(attribute, value);
+            return true;
+    }
+}
+
+bool CacheMessageData::clearAttribute(const QByteArray &attribute)
+{
+    bool wasSet;
+    switch (attributeKey(attribute)) {
+        case RetentionAttribute:
+            wasSet = retention != UnknownRetention;
+            retention = UnknownRetention;
+            return wasSet;
+        case ReliabilityAttribute:
+            wasSet = reliability != UnknownReliability;
+            reliability = UnknownReliability;
+            return wasSet;
+        case ExpiryAttribute:
+            wasSet = expiry != 0;
+            expiry = 0;
+            return wasSet;
+        case AbsoluteExpiryAttribute:
+            wasSet = absoluteExpiry != 0;
+            absoluteExpiry = 0;
+            return wasSet;
+        case DbIdAttribute:
+            wasSet = dbId != 0;
+            dbId = 0;
+            return wasSet;
+        case InterfaceTypeAttribute:
+            wasSet = interfaceType != AstarteInterface::UnknownType;
+            interfaceType = AstarteInterface::UnknownType;
+            return wasSet;
+        default:
+            return extensionAttributes.remove(attribute) > 0;
+    }
+}
+
 CacheMessage::CacheMessage()
     : d(new CacheMessageData())
 {
@@ -70,7 +177,10 @@ CacheMessage& CacheMessage::operator=(const CacheMessage& rhs)
 
 bool CacheMessage::operator==(const CacheMessage& other) const
 {
-    return d->target == other.target() && d->payload == other.payload() && d->interfaceType == other.interfaceType() && d->attributes == other.attributes();
+    return d->target == other.d->target && d->payload == other.d->payload && d->interfaceType == other.d->interfaceType
+        && d->retention == other.d->retention && d->reliability == other.d->reliability && d->expiry == other.d->expiry
+        && d->absoluteExpiry == other.d->absoluteExpiry && d->dbId == other.d->dbId
+        && d->extensionAttributes == other.d->extensionAttributes;
 }
 
 QByteArray CacheMessage::payload() const
@@ -103,56 +213,184 @@ void CacheMessage::setInterfaceType(AstarteInterface::Type interfaceType)
     d->interfaceType = interfaceType;
 }
 
+Retention CacheMessage::retention() const
+{
+    return d->retention;
+}
+
+void CacheMessage::setRetention(Retention retention)
+{
+    d->retention = retention;
+}
+
+Reliability CacheMessage::reliability() const
+{
+    return d->reliability;
+}
+
+void CacheMessage::setReliability(Reliability reliability)
+{
+    d->reliability = reliability;
+}
+
+int CacheMessage::expiry() const
+{
+    return d->expiry;
+}
+
+void CacheMessage::setExpiry(int expiry)
+{
+    d->expiry = expiry;
+}
+
+qint64 CacheMessage::absoluteExpiry() const
+{
+    return d->absoluteExpiry;
+}
+
+void CacheMessage::setAbsoluteExpiry(qint64 absoluteExpiry)
+{
+    d->absoluteExpiry = absoluteExpiry;
+}
+
+qint64 CacheMessage::timestamp() const
+{
+    return d->timestamp;
+}
+
+void CacheMessage::setTimestamp(qint64 timestamp)
+{
+    d->timestamp = timestamp;
+}
+
+qint64 CacheMessage::dbId() const
+{
+    return d->dbId;
+}
+
+void CacheMessage::setDbId(qint64 dbId)
+{
+    d->dbId = dbId;
+}
+
 QHash<QByteArray, QByteArray> CacheMessage::attributes() const
 {
-    return d->attributes;
+    QHash<QByteArray, QByteArray> attributes = d->extensionAttributes;
+    if (d->interfaceType != AstarteInterface::UnknownType) {
+        attributes.insert("interfaceType", QByteArray::number(static_cast<int>(d->interfaceType)));
+    }
+    if (d->retention != UnknownRetention) {
+        attributes.insert("retention", QByteArray::number(static_cast<int>(d->retention)));
+    }
+    if (d->reliability != UnknownReliability) {
+        attributes.insert("reliability", QByteArray::number(static_cast<int>(d->reliability)));
+    }
+    if (d->expiry != 0) {
+        attributes.insert("expiry", QByteArray::number(d->expiry));
+    }
+    if (d->absoluteExpiry != 0) {
+        attributes.insert("absoluteExpiry", QByteArray::number(d->absoluteExpiry));
+    }
+    if (d->dbId != 0) {
+        attributes.insert("dbId", QByteArray::number(d->dbId));
+    }
+
+    return attributes;
 }
 
 QByteArray CacheMessage::attribute(const QByteArray &attribute) const
 {
-    return d->attributes.value(attribute);
+    switch (attributeKey(attribute)) {
+        case RetentionAttribute:
+            return d->retention != UnknownRetention ? QByteArray::number(static_cast<int>(d->retention)) : QByteArray();
+        case ReliabilityAttribute:
+            return d->reliability != UnknownReliability ? QByteArray::number(static_cast<int>(d->reliability)) : QByteArray();
+        case ExpiryAttribute:
+            return d->expiry != 0 ? QByteArray::number(d->expiry) : QByteArray();
+        case AbsoluteExpiryAttribute:
+            return d->absoluteExpiry != 0 ? QByteArray::number(d->absoluteExpiry) : QByteArray();
+        case DbIdAttribute:
+            return d->dbId != 0 ? QByteArray::number(d->dbId) : QByteArray();
+        case InterfaceTypeAttribute:
+            return d->interfaceType != AstarteInterface::UnknownType ? QByteArray::number(static_cast<int>(d->interfaceType)) : QByteArray();
+        default:
+            return d->extensionAttributes.value(attribute);
+    }
 }
 
 bool CacheMessage::hasAttribute(const QByteArray &attribute) const
 {
-    return d->attributes.contains(attribute);
+    if (attributeKey(attribute) == ExtensionAttribute) {
+        return d->extensionAttributes.contains(attribute);
+    }
+
+    return !CacheMessage::attribute(attribute).isEmpty();
 }
 
 void CacheMessage::setAttributes(const QHash<QByteArray, QByteArray>& attributes)
 {
-    d->attributes = attributes;
+    d->retention = UnknownRetention;
+    d->reliability = UnknownReliability;
+    d->expiry = 0;
+    d->absoluteExpiry = 0;
+    d->dbId = 0;
+    d->extensionAttributes.clear();
+
+    for (QHash<QByteArray, QByteArray>::const_iterator i = attributes.constBegin(); i != attributes.constEnd(); ++i) {
+        d->setAttribute(i.key(), i.value());
+    }
 }
 
 void CacheMessage::addAttribute(const QByteArray& attribute, const QByteArray& value)
 {
-    d->attributes.insert(attribute, value);
+    d->setAttribute(attribute, value);
 }
 
 bool CacheMessage::removeAttribute(const QByteArray& attribute)
 {
-    return d->attributes.remove(attribute);
+    return d->clearAttribute(attribute);
 }
 
 QByteArray CacheMessage::takeAttribute(const QByteArray& attribute)
 {
-    return d->attributes.take(attribute);
+    QByteArray value = CacheMessage::attribute(attribute);
+    d->clearAttribute(attribute);
+    return value;
 }
 
 QByteArray CacheMessage::serialize() const
 {
     Util::BSONSerializer s;
     s.appendInt32Value("y", static_cast<int32_t>(Protocol::CacheMessage));
+    s.appendInt32Value("v", CACHE_MESSAGE_FORMAT_VERSION);
     s.appendASCIIString("t", d->target);
     s.appendBinaryValue("p", d->payload);
     s.appendInt32Value("i", static_cast<int32_t>(d->interfaceType));
 
-    if (!d->attributes.isEmpty()) {
-        Util::BSONSerializer sa;
-        for (QHash<QByteArray, QByteArray>::const_iterator i = d->attributes.constBegin(); i != d->attributes.constEnd(); ++i) {
-            sa.appendASCIIString(i.key(), i.value());
+    if (d->retention != UnknownRetention) {
+        s.appendInt32Value("r", static_cast<int32_t>(d->retention));
+    }
+    if (d->reliability != UnknownReliability) {
+        s.appendInt32Value("l", static_cast<int32_t>(d->reliability));
+    }
+    if (d->expiry != 0) {
+        s.appendInt32Value("e", d->expiry);
+    }
+    if (d->absoluteExpiry != 0) {
+        s.appendInt64Value("x", d->absoluteExpiry);
+    }
+    if (d->timestamp != 0) {
+        s.appendInt64Value("s", d->timestamp);
+    }
+
+    // The database id is not serialized, it is assigned when the message is loaded back
+
+    if (!d->extensionAttributes.isEmpty()) {
+        s.beginSubdocument("a");
+        for (QHash<QByteArray, QByteArray>::const_iterator i = d->extensionAttributes.constBegin(); i != d->extensionAttributes.constEnd(); ++i) {
+            s.appendASCIIString(i.key(), i.value());
         }
-        sa.appendEndOfDocument();
-        s.appendDocument("a", sa.document());
+        s.endSubdocument();
     }
 
     s.appendEndOfDocument();
@@ -183,9 +421,18 @@ CacheMessage CacheMessage::fromBinary(const QByteArray &data)
             qDebug() << "CacheMessage attributes are not valid\n";
             return CacheMessage();
         }
+        // Before version 2 every attribute was stored here as a string, setAttributes maps them back
         c.setAttributes(attributesDoc.byteArrayValuesHash());
     }
 
+    if (doc.int32Value("v") >= CACHE_MESSAGE_FORMAT_VERSION) {
+        c.d->retention = static_cast<Retention>(doc.int32Value("r"));
+        c.d->reliability = static_cast<Reliability>(doc.int32Value("l"));
+        c.d->expiry = doc.int32Value("e");
+        c.d->absoluteExpiry = doc.int64Value("x");
+        c.d->timestamp = doc.int64Value("s");
+    }
+
     return c;
 }
 
@@ -26,6 +26,20 @@
 #include <QtCore/QSharedDataPointer>
 #include <QtCore/QDataStream>
 
+enum Retention {
+    UnknownRetention = 0,
+    Discard = 1,
+    Volatile = 2,
+    Stored = 3
+};
+
+enum Reliability {
+    UnknownReliability = 0,
+    Unreliable = 1,
+    Guaranteed = 2,
+    Unique = 3
+};
+
 namespace Astarte {
 
 class CacheMessageData;
@@ -49,6 +63,30 @@ public:
     QByteArray payload() const;
     void setPayload(const QByteArray &p);
 
+    Retention retention() const;
+    void setRetention(Retention retention);
+
+    Reliability reliability() const;
+    void setReliability(Reliability reliability);
+
+    /// Relative expiry in seconds, 0 if the message does not expire
+    int expiry() const;
+    void setExpiry(int expiry);
+
+    /// Absolute expiry in msecs since epoch, 0 if not set
+    qint64 absoluteExpiry() const;
+    void setAbsoluteExpiry(qint64 absoluteExpiry);
+
+    /// Time the message was first handed to the transport, in msecs since epoch, 0 if unknown
+    qint64 timestamp() const;
+    void setTimestamp(qint64 timestamp);
+
+    /// Database row id, 0 if the message is not stored
+    qint64 dbId() const;
+    void setDbId(qint64 dbId);
+
+    // Generic attribute access. Well known attributes (retention, reliability, expiry, absoluteExpiry,
+    // dbId, interfaceType) are mapped on the typed fields above, anything else is kept as is.
     QHash<QByteArray, QByteArray> attributes() const;
     QByteArray attribute(const QByteArray &attribute) const;
     bool hasAttribute(const QByteArray &attribute) const;
@@ -19,18 +19,14 @@
 #include "consumerabstractadaptor.h"
 
 #include "utils/bsondocument.h"
+#include "utils/pathmatcher.h"
 
 #include <QtCore/QDate>
-#include <QtCore/QHash>
-#include <QtCore/QPair>
 
 class ConsumerAbstractAdaptor::Private
 {
     public:
-        typedef QPair<int, QByteArray> StatePair;
-
-        QHash<StatePair, int> transitions;
-        QHash<int, int> acceptingStates;
+        Util::PathMatcher matcher;
 };
 
 ConsumerAbstractAdaptor::ConsumerAbstractAdaptor(const QByteArray &interface, Astarte::Transport *astarteTransport, QObject *parent)
@@ -46,10 +42,8 @@ ConsumerAbstractAdaptor::~ConsumerAbstractAdaptor()
 
 void ConsumerAbstractAdaptor::waveFunction(const Wave &wave)
 {
-    QList<QByteArray> noRootTokens = wave.target().mid(1).split('/');
-
-    int dIndex = dispatchIndex(noRootTokens);
-    DispatchResult result = dispatch(dIndex, wave.payload(), noRootTokens);
+    int dIndex = dispatchIndex(wave.target());
+    DispatchResult result = dispatch(dIndex, wave.payload(), wave.target());
 
     ResponseCode response;
     switch (result) {
@@ -69,59 +63,18 @@ void ConsumerAbstractAdaptor::waveFunction(const Wave &wave)
     sendRebound(Rebound(wave.id(), response));
 }
 
-void ConsumerAbstractAdaptor::insertTransition(int state, QByteArray token, int newState)
-{
-    d->transitions.insert(Private::StatePair(state, token), newState);
-}
-
-void ConsumerAbstractAdaptor::insertDispatchState(int state, int dispatchIndex)
+void ConsumerAbstractAdaptor::setDispatchMappings(const QList<QByteArray> &mappings)
 {
-    d->acceptingStates.insert(state, dispatchIndex);
+    d->matcher.compile(mappings);
 }
 
-int ConsumerAbstractAdaptor::dispatchIndex(const QList<QByteArray> &inputTokens)
+int ConsumerAbstractAdaptor::dispatchIndex(const QByteArray &target)
 {
-   if (d->acceptingStates.isEmpty()) {
+    if (Q_UNLIKELY(d->matcher.isEmpty())) {
         populateTokensAndStates();
-        d->transitions.squeeze();
-        d->acceptingStates.squeeze();
-    }
-
-    QList<int> currentStates;
-    currentStates.append(0);
-
-    QList<int> nextStates;
-
-    Q_FOREACH (const QByteArray token, inputTokens) {
-        nextStates = QList<int>();
-
-        for (int i = 0; i < currentStates.count(); i++) {
-            if (d->transitions.contains(Private::StatePair(currentStates.at(i), token))) {
-                nextStates.append(d->transitions.value(Private::StatePair(currentStates.at(i), token)));
-                // qDebug() << "tok: " << token;
-            }
-            if (d->transitions.contains(Private::StatePair(currentStates.at(i), QByteArray()))) {
-                nextStates.append(d->transitions.value(Private::StatePair(currentStates.at(i), QByteArray())));
-                // qDebug() << "epsi";
-            }
-        }
-
-        // qDebug() << "next states: " << nextStates;
-
-        if (Q_UNLIKELY(nextStates.isEmpty())) {
-            return -1;
-        }
-
-        currentStates = nextStates;
-    }
-
-    for (int i = 0; i < currentStates.count(); i++) {
-        if (d->acceptingStates.contains(currentStates.at(i))) {
-            return d->acceptingStates.value(currentStates.at(i));
-        }
     }
 
-    return -1;
+    return d->matcher.match(target);
 }
 
 bool ConsumerAbstractAdaptor::payloadToValue(const QByteArray &payload, QByteArray *value)
@@ -47,13 +47,13 @@ class ConsumerAbstractAdaptor : public AbstractWaveTarget
     protected:
         virtual void waveFunction(const Wave &wave);
 
-        void insertTransition(int state, QByteArray token, int newState);
-        void insertDispatchState(int state, int dispatchIndex);
+        /// Compiles the dispatch automaton, dispatchIndex returns indexes into mappings
+        void setDispatchMappings(const QList<QByteArray> &mappings);
 
-        int dispatchIndex(const QList<QByteArray> &inputTokens);
+        int dispatchIndex(const QByteArray &target);
 
         virtual void populateTokensAndStates() = 0;
-        virtual DispatchResult dispatch(int i, const QByteArray &value, const QList<QByteArray> &inputTokens) = 0;
+        virtual DispatchResult dispatch(int i, const QByteArray &value, const QByteArray &target) = 0;
 
         bool payloadToValue(const QByteArray &payload, QByteArray *value);
         bool payloadToValue(const QByteArray &payload, int *value);
@@ -133,12 +133,11 @@ QByteArray Fluctuation::serialize() const
     s.appendBinaryValue("p", d->payload);
 
     if (!d->attributes.isEmpty()) {
-        Util::BSONSerializer sa;
+        s.beginSubdocument("a");
         for (ByteArrayHash::const_iterator i = d->attributes.constBegin(); i != d->attributes.constEnd(); ++i) {
-            sa.appendASCIIString(i.key(), i.value());
+            s.appendASCIIString(i.key(), i.value());
         }
-        sa.appendEndOfDocument();
-        s.appendDocument("a", sa.document());
+        s.endSubdocument();
     }
 
     s.appendEndOfDocument();
@@ -25,6 +25,7 @@
 #include <QtCore/QDir>
 #include <QtCore/QTimer>
 #include <QtCore/QMetaMethod>
+#include <QtCore/QSocketNotifier>
 
 #include <QtNetwork/QSslCertificate>
 
@@ -33,8 +34,14 @@
 // We use the as variant
 #include <mosquittopp.h>
 
+#include <string.h>
+
 #define CONNACK_TIMEOUT (2 * 60 * 1000)
 
+// Integrated loop: keepalive/retry housekeeping period, and delay before reconnecting
+#define LOOP_MISC_INTERVAL 1000
+#define RECONNECT_DELAY 1000
+
 namespace Astarte {
 
 class HyperdriveMosquittoClient;
@@ -44,6 +51,10 @@ class MQTTClientWrapper::Private
 public:
     Private(MQTTClientWrapper* q) : q_ptr(q)
                                , mosquitto(0)
+                               , loopMode(MQTTClientWrapper::ThreadedLoop)
+                               , readNotifier(0)
+                               , writeNotifier(0)
+                               , notifierSocket(-1)
                                , status(MQTTClientWrapper::DisconnectedStatus)
                                , lwtRetained(false)
                                , keepAlive(5 * 60)
@@ -57,6 +68,13 @@ public:
 
     HyperdriveMosquittoClient *mosquitto;
 
+    MQTTClientWrapper::LoopMode loopMode;
+    QSocketNotifier *readNotifier;
+    QSocketNotifier *writeNotifier;
+    int notifierSocket;
+    QTimer *loopMiscTimer;
+    QTimer *reconnectTimer;
+
     MQTTClientWrapper::Status status;
     QByteArray hardwareId;
     QByteArray customerId;
@@ -82,6 +100,7 @@ public:
     QString pathToCertificate;
 
     void setStatus(MQTTClientWrapper::Status s);
+    void updateNotifiers();
 
     // MQTT CALLBACKS
     void on_connect(int rc);
@@ -125,6 +144,46 @@ void MQTTClientWrapper::Private::setStatus(MQTTClientWrapper::Status s)
     }
 }
 
+void MQTTClientWrapper::Private::updateNotifiers()
+{
+    if (loopMode != MQTTClientWrapper::IntegratedLoop || !mosquitto) {
+        return;
+    }
+
+    Q_Q(MQTTClientWrapper);
+
+    int socket = mosquitto->socket();
+    if (socket != notifierSocket) {
+        // We might be inside one of the notifiers' activation: don't delete them right away
+        if (readNotifier) {
+            readNotifier->setEnabled(false);
+            readNotifier->deleteLater();
+            readNotifier = 0;
+        }
+        if (writeNotifier) {
+            writeNotifier->setEnabled(false);
+            writeNotifier->deleteLater();
+            writeNotifier = 0;
+        }
+
+        notifierSocket = socket;
+        if (socket >= 0) {
+            readNotifier = new QSocketNotifier(socket, QSocketNotifier::Read, q);
+            QObject::connect(readNotifier, SIGNAL(activated(int)), q, SLOT(onSocketReadable()));
+            writeNotifier = new QSocketNotifier(socket, QSocketNotifier::Write, q);
+            QObject::connect(writeNotifier, SIGNAL(activated(int)), q, SLOT(onSocketWritable()));
+            loopMiscTimer->start();
+        } else {
+            loopMiscTimer->stop();
+        }
+    }
+
+    // Only poll for writability while libmosquitto has outgoing packets, or we would spin
+    if (writeNotifier) {
+        writeNotifier->setEnabled(mosquitto->want_write());
+    }
+}
+
 void MQTTClientWrapper::Private::on_connect(int rc)
 {
     qDebug() << "Connected to broker returned!";
@@ -150,11 +209,16 @@ void MQTTClientWrapper::Private::on_disconnect(int rc)
 
     if (rc == 0) {
         // Client requested disconnect.
-        mosquitto->loop_stop();
+        if (loopMode == MQTTClientWrapper::ThreadedLoop) {
+            mosquitto->loop_stop();
+        }
     } else {
-        // Unexpected disconnect, Mosquitto will reconnect
+        // Unexpected disconnect. Mosquitto's thread reconnects by itself, in the integrated loop we do
         qDebug() << "Unexpected disconnection from broker!" << rc;
         setStatus(MQTTClientWrapper::ReconnectingStatus);
+        if (loopMode == MQTTClientWrapper::IntegratedLoop) {
+            reconnectTimer->start();
+        }
 
         Q_Q(MQTTClientWrapper);
         Q_EMIT q->connectionStarted();
@@ -202,14 +266,15 @@ void MQTTClientWrapper::Private::on_message(const struct mosquitto_message *mess
 {
     Q_Q(MQTTClientWrapper);
 
-    // We need to copy the bytes. It's impossible to control the ownership otherwise.
-    // Do not use ::fromRawData until you find out how to do 0-copy without leaking!!
-    QByteArray payload((char*)message->payload, message->payloadlen);
-    QByteArray topic(message->topic);
-
-    Q_EMIT q->messageReceived(topic, payload);
+    // libmosquitto frees the message once we return, so we need to copy the bytes: do it once,
+    // in a single buffer. Everything downstream works on views of it.
+    int topicLength = qstrlen(message->topic);
+    QByteArray buffer;
+    buffer.resize(topicLength + message->payloadlen);
+    memcpy(buffer.data(), message->topic, topicLength);
+    memcpy(buffer.data() + topicLength, message->payload, message->payloadlen);
 
-    // Free message and topic??
+    Q_EMIT q->messageReceived(buffer, topicLength);
 
 }
 
@@ -252,6 +317,11 @@ MQTTClientWrapper::MQTTClientWrapper(const QUrl &host, const QByteArray &clientI
     d->connackTimer = new QTimer(this);
     d->connackTimer->setInterval(Utils::randomizedInterval(CONNACK_TIMEOUT, 1.0));
     d->connackTimer->setSingleShot(true);
+    d->loopMiscTimer = new QTimer(this);
+    d->loopMiscTimer->setInterval(LOOP_MISC_INTERVAL);
+    d->reconnectTimer = new QTimer(this);
+    d->reconnectTimer->setInterval(Utils::randomizedInterval(RECONNECT_DELAY, 1.0));
+    d->reconnectTimer->setSingleShot(true);
 }
 
 MQTTClientWrapper::~MQTTClientWrapper()
@@ -259,7 +329,12 @@ MQTTClientWrapper::~MQTTClientWrapper()
     if (Q_LIKELY(d->mosquitto)) {
         qWarning() << "Stopping mosquitto!";
         d->mosquitto->disconnect();
-        d->mosquitto->loop_stop();
+        if (d->loopMode == ThreadedLoop) {
+            d->mosquitto->loop_stop();
+        } else {
+            // Nobody will drive the loop anymore, try flushing the DISCONNECT right away
+            d->mosquitto->loop_write();
+        }
 
         delete d->mosquitto;
         mosqpp::lib_cleanup();
@@ -271,6 +346,11 @@ MQTTClientWrapper::Status MQTTClientWrapper::status() const
     return d->status;
 }
 
+MQTTClientWrapper::LoopMode MQTTClientWrapper::loopMode() const
+{
+    return d->loopMode;
+}
+
 QDateTime MQTTClientWrapper::clientCertificateExpiry() const
 {
 
@@ -331,6 +411,16 @@ void MQTTClientWrapper::setLastWill(const QByteArray& topic, const QByteArray& m
     d->lwtRetained = retained;
 }
 
+void MQTTClientWrapper::setLoopMode(MQTTClientWrapper::LoopMode loopMode)
+{
+    if (Q_UNLIKELY(d->notifierSocket >= 0 || d->status != DisconnectedStatus)) {
+        qWarning() << "Attempted to change the loop mode while connected, ignoring";
+        return;
+    }
+
+    d->loopMode = loopMode;
+}
+
 QByteArray MQTTClientWrapper::hardwareId() const
 {
 
@@ -356,6 +446,9 @@ void MQTTClientWrapper::initImpl()
     // Connect the signals received from the callback thread
     connect(this, SIGNAL(connectionStarted()), d->connackTimer, SLOT(start()));
     connect(this, SIGNAL(connackReceived()), d->connackTimer, SLOT(stop()));
+    // Integrated loop housekeeping
+    connect(d->loopMiscTimer, SIGNAL(timeout()), this, SLOT(onLoopMiscTimeout()));
+    connect(d->reconnectTimer, SIGNAL(timeout()), this, SLOT(reconnectToBroker()));
 
     // Initialize stuff
     d->mosquitto = new HyperdriveMosquittoClient(d, d->hardwareId.constData(), d->cleanSession);
@@ -405,12 +498,13 @@ bool MQTTClientWrapper::connectToBroker()
                 Q_EMIT connectionFailed();
                 return false;
             }
-            if (d->mosquitto->loop_start() != MOSQ_ERR_SUCCESS) {
+            if (d->loopMode == ThreadedLoop && d->mosquitto->loop_start() != MOSQ_ERR_SUCCESS) {
                 qWarning() << "Could not initiate async mosquitto loop! Something is beyond broken!";
                 return false;
             }
 
             d->setStatus(MQTTClientWrapper::ConnectingStatus);
+            d->updateNotifiers();
             qDebug() << "Started mosquitto connection";
 
             d->connackTimer->start();
@@ -442,6 +536,7 @@ bool MQTTClientWrapper::disconnectFromBroker()
             int rc;
 
             d->connackTimer->stop();
+            d->reconnectTimer->stop();
 
             if ((rc = d->mosquitto->disconnect()) != MOSQ_ERR_SUCCESS) {
                 if (rc == MOSQ_ERR_NO_CONN) {
@@ -454,6 +549,7 @@ bool MQTTClientWrapper::disconnectFromBroker()
                 }
             }
             d->setStatus(MQTTClientWrapper::DisconnectingStatus);
+            d->updateNotifiers();
             return true;
         }
         default: {
@@ -481,6 +577,8 @@ int MQTTClientWrapper::publish(const QByteArray& topic, const QByteArray& payloa
         return -rc;
     }
 
+    d->updateNotifiers();
+
     return mid;
 }
 
@@ -504,6 +602,51 @@ void MQTTClientWrapper::subscribe(const QByteArray& topic, MQTTQoS subQoS)
     if ((rc = d->mosquitto->subscribe(NULL, topic.constData(), qos)) != MOSQ_ERR_SUCCESS) {
         qWarning() << "Failed to start subscribe, return code " << rc;
     }
+
+    d->updateNotifiers();
+}
+
+void MQTTClientWrapper::onSocketReadable()
+{
+    int rc = d->mosquitto->loop_read();
+    if (rc != MOSQ_ERR_SUCCESS) {
+        qDebug() << "Mosquitto read failed, return code" << rc;
+    }
+
+    d->updateNotifiers();
+}
+
+void MQTTClientWrapper::onSocketWritable()
+{
+    int rc = d->mosquitto->loop_write();
+    if (rc != MOSQ_ERR_SUCCESS) {
+        qDebug() << "Mosquitto write failed, return code" << rc;
+    }
+
+    d->updateNotifiers();
+}
+
+void MQTTClientWrapper::onLoopMiscTimeout()
+{
+    // Keepalive pings and QoS retries. A missed PINGRESP closes the socket from here
+    d->mosquitto->loop_misc();
+    d->updateNotifiers();
+}
+
+void MQTTClientWrapper::reconnectToBroker()
+{
+    if (d->status != ReconnectingStatus) {
+        return;
+    }
+
+    int rc;
+    if ((rc = d->mosquitto->reconnect_async()) != MOSQ_ERR_SUCCESS) {
+        qDebug() << "Could not reconnect to broker, return code" << rc;
+        d->reconnectTimer->start();
+        return;
+    }
+
+    d->updateNotifiers();
 }
 
 }
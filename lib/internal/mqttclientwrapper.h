@@ -57,11 +57,20 @@ public:
         DefaultQoS = 99
     };
     Q_ENUMS(MQTTQoS);
+    enum LoopMode {
+        /// libmosquitto runs its own network thread, the default. Use it if the owner thread's event loop can block
+        ThreadedLoop = 0,
+        /// libmosquitto I/O is driven by socket notifiers on the thread owning the wrapper.
+        /// QoS 0 publishes are confirmed from within publish in this mode.
+        IntegratedLoop = 1
+    };
+    Q_ENUMS(LoopMode);
 
     explicit MQTTClientWrapper(const QUrl &host, const QByteArray &clientId, QObject *parent = 0);
     virtual ~MQTTClientWrapper();
 
     Status status() const;
+    LoopMode loopMode() const;
     QByteArray hardwareId() const;
     QByteArray rootClientTopic() const;
     QDateTime clientCertificateExpiry() const;
@@ -75,6 +84,8 @@ public:
     void setCleanSession(bool cleanSession = true);
     void setKeepAlive(quint64 seconds = 300);
     void setLastWill(const QByteArray &topic, const QByteArray &message, MQTTQoS qos, bool retained = false);
+    /// Note: this will only work if set before connecting to the broker.
+    void setLoopMode(LoopMode loopMode);
 
     int publish(const QByteArray &topic, const QByteArray &payload, MQTTQoS qos = DefaultQoS, bool retained = false);
     void subscribe(const QByteArray &topic, MQTTQoS qos = DefaultQoS);
@@ -86,8 +97,15 @@ public Q_SLOTS:
 protected Q_SLOTS:
     virtual void initImpl();
 
+private Q_SLOTS:
+    void onSocketReadable();
+    void onSocketWritable();
+    void onLoopMiscTimeout();
+    void reconnectToBroker();
+
 Q_SIGNALS:
-    void messageReceived(const QByteArray &topic, const QByteArray &payload);
+    /// message holds the topic, topicLength bytes, immediately followed by the payload
+    void messageReceived(const QByteArray &message, int topicLength);
     void statusChanged(Astarte::MQTTClientWrapper::Status status);
     void connectionLost(const QString &cause);
     void publishConfirmed(int mid);
@@ -0,0 +1,379 @@
+/*
+ * Copyright (C) 2017 Ispirata Srl
+ *
+ * This file is part of Astarte.
+ * Astarte is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Astarte is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Astarte.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "persistenceworker.h"
+
+#include <QtCore/QDebug>
+
+#include "utils/transportdatabasemanager.h"
+
+namespace Astarte {
+
+struct PersistenceWorker::Job
+{
+    enum Type {
+        OpenDatabase,
+        InsertPersistentEntry,
+        UpdatePersistentEntry,
+        DeletePersistentEntry,
+        InsertCacheMessage,
+        DeleteCacheMessage,
+        BeginBatch,
+        CommitBatch,
+        AllPersistentEntries,
+        DeleteExpiredCacheMessages,
+        LastCacheMessageId,
+        CacheMessagesPage,
+        Stop
+    };
+
+    explicit Job(Type t) : type(t), id(0), toId(0), limit(0), done(0), result(0), operation(0), next(0) {}
+
+    Type type;
+
+    QByteArray target;
+    QByteArray payload;
+    // Sync generation, message id or first page id, depending on the type
+    qint64 id;
+    qint64 toId;
+    int limit;
+    Astarte::CacheMessage message;
+    QDateTime expiry;
+
+    // Synchronous jobs belong to the caller, which waits on done before reading the results.
+    // The worker deletes all the others.
+    QSemaphore *done;
+    qint64 result;
+    QHash<QByteArray, QByteArray> entries;
+    QHash<QByteArray, qint64> syncGenerations;
+    QList<Astarte::CacheMessage> messages;
+
+    PersistenceFlushOperation *operation;
+
+    Job *next;
+};
+
+PersistenceFlushOperation::PersistenceFlushOperation(QObject *parent)
+    : Hemera::Operation(parent)
+{
+}
+
+PersistenceFlushOperation::~PersistenceFlushOperation()
+{
+}
+
+void PersistenceFlushOperation::startImpl()
+{
+    // Nothing to do, the worker calls complete
+}
+
+void PersistenceFlushOperation::complete(bool ok)
+{
+    if (ok) {
+        setFinished();
+    } else {
+        setFinishedWithError(QLatin1String("Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest())"),
+                             QLatin1String("Some database writes failed"));
+    }
+}
+
+PersistenceWorker::PersistenceWorker(const QString &dbPath, const QString &migrationsDirPath, QObject *parent)
+    : QThread(parent)
+    , m_dbPath(dbPath)
+    , m_migrationsDirPath(migrationsDirPath)
+    , m_queue(0)
+    , m_failedWrites(0)
+{
+}
+
+PersistenceWorker::~PersistenceWorker()
+{
+    if (isRunning()) {
+        submit(new Job(Job::Stop));
+        wait();
+    }
+
+    // Never started, nobody waits on these
+    Job *job = m_queue.fetchAndStoreAcquire(0);
+    while (job) {
+        Job *next = job->next;
+        delete job;
+        job = next;
+    }
+}
+
+void PersistenceWorker::submit(Job *job)
+{
+    Job *head;
+    do {
+        head = m_queue;
+        job->next = head;
+    } while (!m_queue.testAndSetRelease(head, job));
+
+    // Pushing on a non empty queue needs no wake up: the worker takes everything at once
+    if (!head) {
+        m_wakeUp.release();
+    }
+}
+
+void PersistenceWorker::submitAndWait(Job *job)
+{
+    QSemaphore done;
+    job->done = &done;
+    submit(job);
+    done.acquire();
+}
+
+void PersistenceWorker::run()
+{
+    bool running = true;
+    while (running) {
+        m_wakeUp.acquire();
+
+        // Newest first, reverse it into submission order
+        Job *jobs = m_queue.fetchAndStoreAcquire(0);
+        Job *ordered = 0;
+        while (jobs) {
+            Job *next = jobs->next;
+            jobs->next = ordered;
+            ordered = jobs;
+            jobs = next;
+        }
+
+        while (ordered) {
+            Job *job = ordered;
+            ordered = job->next;
+
+            if (job->type == Job::Stop) {
+                running = false;
+            } else {
+                execute(job);
+            }
+
+            if (job->done) {
+                job->done->release();
+            } else {
+                delete job;
+            }
+        }
+    }
+
+    // The connection belongs to this thread, it must not outlive it
+    TransportDatabaseManager::closeDatabase();
+}
+
+void PersistenceWorker::execute(Job *job)
+{
+    bool ok = true;
+    switch (job->type) {
+        case Job::OpenDatabase:
+            job->result = TransportDatabaseManager::ensureDatabase(m_dbPath, m_migrationsDirPath);
+            break;
+        case Job::InsertPersistentEntry:
+            ok = TransportDatabaseManager::Transactions::insertPersistentEntry(job->target, job->payload, job->id);
+            break;
+        case Job::UpdatePersistentEntry:
+            ok = TransportDatabaseManager::Transactions::updatePersistentEntry(job->target, job->payload, job->id);
+            break;
+        case Job::DeletePersistentEntry:
+            ok = TransportDatabaseManager::Transactions::deletePersistentEntry(job->target);
+            break;
+        case Job::InsertCacheMessage:
+            ok = TransportDatabaseManager::Transactions::insertCacheMessage(job->message, job->expiry) > 0;
+            break;
+        case Job::DeleteCacheMessage:
+            ok = TransportDatabaseManager::Transactions::deleteCacheMessage(job->id);
+            break;
+        case Job::BeginBatch:
+            ok = TransportDatabaseManager::beginBatch();
+            break;
+        case Job::CommitBatch:
+            ok = TransportDatabaseManager::commitBatch();
+            if (!ok) {
+                // The rollback took the writes which had succeeded with it
+                Q_FOREACH (qint64 dbId, m_batchCacheMessageIds) {
+                    Q_EMIT cacheMessageWriteFailed(dbId);
+                }
+                Q_FOREACH (const QByteArray &target, m_batchTargets) {
+                    Q_EMIT persistentEntryWriteFailed(target);
+                }
+            }
+            m_batchCacheMessageIds.clear();
+            m_batchTargets.clear();
+            ok = ok && m_failedWrites == 0;
+            m_failedWrites = 0;
+            QMetaObject::invokeMethod(job->operation, "complete", Qt::QueuedConnection, Q_ARG(bool, ok));
+            return;
+        case Job::AllPersistentEntries:
+            job->entries = TransportDatabaseManager::Transactions::allPersistentEntries(&job->syncGenerations);
+            break;
+        case Job::DeleteExpiredCacheMessages: {
+            // A transaction of its own, unless it is part of an open batch already
+            bool ownBatch = !TransportDatabaseManager::isBatchOpen() && TransportDatabaseManager::beginBatch();
+            int deleted;
+            do {
+                deleted = TransportDatabaseManager::Transactions::deleteExpiredCacheMessages(job->limit);
+                job->result += qMax(0, deleted);
+            } while (deleted == job->limit);
+            if (ownBatch && !TransportDatabaseManager::commitBatch()) {
+                // Nothing is lost, they are still expired the next time around
+                qWarning() << "Could not delete expired cache messages";
+            } else if (job->result > 0) {
+                qDebug() << "Deleted" << job->result << "expired cache messages";
+            }
+            break;
+        }
+        case Job::LastCacheMessageId:
+            job->result = TransportDatabaseManager::Transactions::lastCacheMessageId();
+            break;
+        case Job::CacheMessagesPage:
+            job->messages = TransportDatabaseManager::Transactions::cacheMessagesPage(job->id, job->toId, job->limit);
+            break;
+        case Job::Stop:
+            break;
+    }
+
+    if (!ok) {
+        ++m_failedWrites;
+        reportFailedWrite(job);
+    } else if (TransportDatabaseManager::isBatchOpen()) {
+        if (job->type == Job::InsertCacheMessage) {
+            m_batchCacheMessageIds.append(job->message.dbId());
+        } else if (job->type == Job::InsertPersistentEntry || job->type == Job::UpdatePersistentEntry
+                   || job->type == Job::DeletePersistentEntry) {
+            m_batchTargets.append(job->target);
+        }
+    }
+}
+
+void PersistenceWorker::reportFailedWrite(Job *job)
+{
+    switch (job->type) {
+        case Job::InsertCacheMessage:
+            Q_EMIT cacheMessageWriteFailed(job->message.dbId());
+            break;
+        case Job::InsertPersistentEntry:
+        case Job::UpdatePersistentEntry:
+        case Job::DeletePersistentEntry:
+            Q_EMIT persistentEntryWriteFailed(job->target);
+            break;
+        case Job::DeleteCacheMessage:
+            // The row stays behind and gets replayed at the next startup, nothing is lost
+            qWarning() << "Could not delete cache message" << job->id;
+            break;
+        default:
+            break;
+    }
+}
+
+bool PersistenceWorker::ensureDatabase()
+{
+    Job job(Job::OpenDatabase);
+    submitAndWait(&job);
+    return job.result;
+}
+
+void PersistenceWorker::insertPersistentEntry(const QByteArray &target, const QByteArray &payload, qint64 syncGeneration)
+{
+    Job *job = new Job(Job::InsertPersistentEntry);
+    job->target = target;
+    job->payload = payload;
+    job->id = syncGeneration;
+    submit(job);
+}
+
+void PersistenceWorker::updatePersistentEntry(const QByteArray &target, const QByteArray &payload, qint64 syncGeneration)
+{
+    Job *job = new Job(Job::UpdatePersistentEntry);
+    job->target = target;
+    job->payload = payload;
+    job->id = syncGeneration;
+    submit(job);
+}
+
+void PersistenceWorker::deletePersistentEntry(const QByteArray &target)
+{
+    Job *job = new Job(Job::DeletePersistentEntry);
+    job->target = target;
+    submit(job);
+}
+
+void PersistenceWorker::insertCacheMessage(const CacheMessage &message, const QDateTime &expiry)
+{
+    Job *job = new Job(Job::InsertCacheMessage);
+    job->message = message;
+    job->expiry = expiry;
+    submit(job);
+}
+
+void PersistenceWorker::deleteCacheMessage(qint64 id)
+{
+    Job *job = new Job(Job::DeleteCacheMessage);
+    job->id = id;
+    submit(job);
+}
+
+void PersistenceWorker::beginBatch()
+{
+    submit(new Job(Job::BeginBatch));
+}
+
+Hemera::Operation *PersistenceWorker::commitBatch()
+{
+    Job *job = new Job(Job::CommitBatch);
+    job->operation = new PersistenceFlushOperation;
+    Hemera::Operation *operation = job->operation;
+    submit(job);
+    return operation;
+}
+
+QHash<QByteArray, QByteArray> PersistenceWorker::allPersistentEntries(QHash<QByteArray, qint64> *syncGenerations)
+{
+    Job job(Job::AllPersistentEntries);
+    submitAndWait(&job);
+    if (syncGenerations) {
+        *syncGenerations = job.syncGenerations;
+    }
+    return job.entries;
+}
+
+void PersistenceWorker::deleteExpiredCacheMessages(int limit)
+{
+    Job *job = new Job(Job::DeleteExpiredCacheMessages);
+    job->limit = limit;
+    submit(job);
+}
+
+qint64 PersistenceWorker::lastCacheMessageId()
+{
+    Job job(Job::LastCacheMessageId);
+    submitAndWait(&job);
+    return job.result;
+}
+
+QList<CacheMessage> PersistenceWorker::cacheMessagesPage(qint64 fromId, qint64 toId, int limit)
+{
+    Job job(Job::CacheMessagesPage);
+    job.id = fromId;
+    job.toId = toId;
+    job.limit = limit;
+    submitAndWait(&job);
+    return job.messages;
+}
+
+}
@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2017 Ispirata Srl
+ *
+ * This file is part of Astarte.
+ * Astarte is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Astarte is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Astarte.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ASTARTE_PERSISTENCE_WORKER_H
+#define ASTARTE_PERSISTENCE_WORKER_H
+
+#include "utils/hemeraoperation.h"
+
+#include "cachemessage.h"
+
+#include <QtCore/QAtomicPointer>
+#include <QtCore/QDateTime>
+#include <QtCore/QHash>
+#include <QtCore/QList>
+#include <QtCore/QSemaphore>
+#include <QtCore/QThread>
+
+namespace Astarte {
+
+class PersistenceFlushOperation : public Hemera::Operation
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(PersistenceFlushOperation)
+
+public:
+    explicit PersistenceFlushOperation(QObject *parent = 0);
+    virtual ~PersistenceFlushOperation();
+
+protected:
+    virtual void startImpl();
+
+private Q_SLOTS:
+    // Invoked from the worker thread through a queued call
+    void complete(bool ok);
+};
+
+/**
+ * Runs every database access on a thread of its own, so slow storage does not stall the event loop.
+ *
+ * Writes are queued and executed in submission order without waiting for them, reads block the
+ * caller until the worker has gone through everything queued before them. Failed writes are
+ * reported back through the signals below, from the worker thread. The queue is a lock-free
+ * stack which the worker takes as a whole and reverses: it is woken up only when the queue goes
+ * from empty to non empty.
+ */
+class PersistenceWorker : public QThread
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(PersistenceWorker)
+
+public:
+    PersistenceWorker(const QString &dbPath, const QString &migrationsDirPath, QObject *parent = 0);
+    /// Executes whatever is still queued, then stops the thread
+    virtual ~PersistenceWorker();
+
+    bool ensureDatabase();
+
+    void insertPersistentEntry(const QByteArray &target, const QByteArray &payload, qint64 syncGeneration);
+    void updatePersistentEntry(const QByteArray &target, const QByteArray &payload, qint64 syncGeneration);
+    void deletePersistentEntry(const QByteArray &target);
+    /// The message is inserted with its dbId, which the caller assigns
+    void insertCacheMessage(const Astarte::CacheMessage &message, const QDateTime &expiry);
+    void deleteCacheMessage(qint64 id);
+
+    void beginBatch();
+    /// Commits the open batch, if any. The operation finishes once every write submitted so far
+    /// has been executed, with an error if any of them failed.
+    Hemera::Operation *commitBatch();
+
+    /// Deletes every expired cache message, limit rows per statement, within a single transaction
+    void deleteExpiredCacheMessages(int limit);
+
+    QHash<QByteArray, QByteArray> allPersistentEntries(QHash<QByteArray, qint64> *syncGenerations = 0);
+    qint64 lastCacheMessageId();
+    QList<Astarte::CacheMessage> cacheMessagesPage(qint64 fromId, qint64 toId, int limit);
+
+Q_SIGNALS:
+    /// The cache message with this dbId did not make it to the database
+    void cacheMessageWriteFailed(qint64 dbId);
+    /// The row of this persistent entry does not match what was last written
+    void persistentEntryWriteFailed(const QByteArray &target);
+
+protected:
+    virtual void run();
+
+private:
+    struct Job;
+
+    void submit(Job *job);
+    void submitAndWait(Job *job);
+    void execute(Job *job);
+    void reportFailedWrite(Job *job);
+
+    QString m_dbPath;
+    QString m_migrationsDirPath;
+
+    QAtomicPointer<Job> m_queue;
+    QSemaphore m_wakeUp;
+
+    // Only touched by the worker thread
+    int m_failedWrites;
+    // Writes of the open batch, all lost if it gets rolled back
+    QList<qint64> m_batchCacheMessageIds;
+    QList<QByteArray> m_batchTargets;
+};
+
+}
+
+#endif // ASTARTE_PERSISTENCE_WORKER_H
@@ -20,18 +20,24 @@
 
 #include "utils/bsondocument.h"
 #include "utils/bsonserializer.h"
+#include "utils/pathmatcher.h"
 
+#include "astartesendhandle_p.h"
+
+#include "cachemessage.h"
 #include "fluctuation.h"
+#include "transport.h"
 
 #define METHOD_ERROR "ERROR"
 
+// Room for the value, an optional timestamp and the document framing
+#define PAYLOAD_BASE_RESERVE 48
+#define AGGREGATE_ENTRY_RESERVE 32
+
 class ProducerAbstractInterface::Private
 {
     public:
-        typedef QPair<int, QByteArray> StatePair;
-
-        QHash<StatePair, int> transitions;
-        QHash<int, int> acceptingStates;
+        Util::PathMatcher matcher;
 };
 
 ProducerAbstractInterface::ProducerAbstractInterface(const QByteArray &interface, Astarte::Transport *astarteTransport, QObject *parent)
@@ -42,6 +48,7 @@ ProducerAbstractInterface::ProducerAbstractInterface(const QByteArray &interface
 
 ProducerAbstractInterface::~ProducerAbstractInterface()
 {
+    delete d;
 }
 
 void ProducerAbstractInterface::waveFunction(const Wave &wave)
@@ -51,10 +58,8 @@ void ProducerAbstractInterface::waveFunction(const Wave &wave)
     if (wave.method() != METHOD_ERROR) {
         response = NotImplemented;
     } else {
-        QList<QByteArray> noRootTokens = wave.target().mid(1).split('/');
-
-        int dIndex = dispatchIndex(noRootTokens);
-        DispatchResult result = dispatch(dIndex, wave.payload(), noRootTokens);
+        int dIndex = dispatchIndex(wave.target());
+        DispatchResult result = dispatch(dIndex, wave.payload(), wave.target());
 
         switch (result) {
             case Success:
@@ -74,73 +79,86 @@ void ProducerAbstractInterface::waveFunction(const Wave &wave)
     sendRebound(Rebound(wave.id(), response));
 }
 
-void ProducerAbstractInterface::insertTransition(int state, QByteArray token, int newState)
+void ProducerAbstractInterface::setDispatchMappings(const QList<QByteArray> &mappings)
 {
-    d->transitions.insert(Private::StatePair(state, token), newState);
+    d->matcher.compile(mappings);
 }
 
-void ProducerAbstractInterface::insertDispatchState(int state, int dispatchIndex)
+int ProducerAbstractInterface::dispatchIndex(const QByteArray &target)
 {
-    d->acceptingStates.insert(state, dispatchIndex);
-}
-
-int ProducerAbstractInterface::dispatchIndex(const QList<QByteArray> &inputTokens)
-{
-   if (d->acceptingStates.isEmpty()) {
+    if (Q_UNLIKELY(d->matcher.isEmpty())) {
         populateTokensAndStates();
-        d->transitions.squeeze();
-        d->acceptingStates.squeeze();
     }
 
-    QList<int> currentStates;
-    currentStates.append(0);
+    return d->matcher.match(target);
+}
 
-    QList<int> nextStates;
+void ProducerAbstractInterface::sendRawDataOnEndpoint(const QByteArray &value, const QByteArray &target, const QHash<QByteArray, QByteArray> &attributes)
+{
+    Fluctuation fluctuation;
+    fluctuation.setPayload(value);
+    fluctuation.setAttributes(attributes);
+    sendFluctuation(target, fluctuation);
+}
 
-    Q_FOREACH (const QByteArray token, inputTokens) {
-        nextStates = QList<int>();
+void ProducerAbstractInterface::sendRawDataOnHandle(const QByteArray &value, AstarteSendHandleData *handle)
+{
+    Astarte::CacheMessage cacheMessage = handle->message;
+    cacheMessage.setPayload(value);
+    astarteTransport()->cacheMessage(cacheMessage, handle->qos, &handle->topic);
+}
 
-        for (int i = 0; i < currentStates.count(); i++) {
-            if (d->transitions.contains(Private::StatePair(currentStates.at(i), token))) {
-                nextStates.append(d->transitions.value(Private::StatePair(currentStates.at(i), token)));
-                // qDebug() << "tok: " << token;
-            }
-            if (d->transitions.contains(Private::StatePair(currentStates.at(i), QByteArray()))) {
-                nextStates.append(d->transitions.value(Private::StatePair(currentStates.at(i), QByteArray())));
-                // qDebug() << "epsi";
-            }
-        }
+void ProducerAbstractInterface::sendDataOnEndpoint(const QByteArray &value, const QByteArray &target, const QHash<QByteArray, QByteArray> &attributes,
+                                                   const QDateTime &timestamp, const QVariantHash &metadata)
+{
+    sendRawDataOnEndpoint(serializeValue(value, timestamp, metadata), target, attributes);
+}
 
-        // qDebug() << "next states: " << nextStates;
+void ProducerAbstractInterface::sendDataOnEndpoint(double value, const QByteArray &target, const QHash<QByteArray, QByteArray> &attributes,
+                                                   const QDateTime &timestamp, const QVariantHash &metadata)
+{
+    sendRawDataOnEndpoint(serializeValue(value, timestamp, metadata), target, attributes);
+}
 
-        if (Q_UNLIKELY(nextStates.isEmpty())) {
-            return -1;
-        }
+void ProducerAbstractInterface::sendDataOnEndpoint(int value, const QByteArray &target, const QHash<QByteArray, QByteArray> &attributes,
+                                                   const QDateTime &timestamp, const QVariantHash &metadata)
+{
+    sendRawDataOnEndpoint(serializeValue(value, timestamp, metadata), target, attributes);
+}
 
-        currentStates = nextStates;
-    }
+void ProducerAbstractInterface::sendDataOnEndpoint(qint64 value, const QByteArray &target, const QHash<QByteArray, QByteArray> &attributes,
+                                                   const QDateTime &timestamp, const QVariantHash &metadata)
+{
+    sendRawDataOnEndpoint(serializeValue(value, timestamp, metadata), target, attributes);
+}
 
-    for (int i = 0; i < currentStates.count(); i++) {
-        if (d->acceptingStates.contains(currentStates.at(i))) {
-            return d->acceptingStates.value(currentStates.at(i));
-        }
-    }
+void ProducerAbstractInterface::sendDataOnEndpoint(bool value, const QByteArray &target, const QHash<QByteArray, QByteArray> &attributes,
+                                                   const QDateTime &timestamp, const QVariantHash &metadata)
+{
+    sendRawDataOnEndpoint(serializeValue(value, timestamp, metadata), target, attributes);
+}
 
-    return -1;
+void ProducerAbstractInterface::sendDataOnEndpoint(const QString &value, const QByteArray &target, const QHash<QByteArray, QByteArray> &attributes,
+                                                   const QDateTime &timestamp, const QVariantHash &metadata)
+{
+    sendRawDataOnEndpoint(serializeValue(value, timestamp, metadata), target, attributes);
 }
 
-void ProducerAbstractInterface::sendRawDataOnEndpoint(const QByteArray &value, const QByteArray &target, const QHash<QByteArray, QByteArray> &attributes)
+void ProducerAbstractInterface::sendDataOnEndpoint(const QDateTime &value, const QByteArray &target, const QHash<QByteArray, QByteArray> &attributes,
+                                                   const QDateTime &timestamp, const QVariantHash &metadata)
 {
-    Fluctuation fluctuation;
-    fluctuation.setPayload(value);
-    fluctuation.setAttributes(attributes);
-    sendFluctuation(target, fluctuation);
+    sendRawDataOnEndpoint(serializeValue(value, timestamp, metadata), target, attributes);
 }
 
-void ProducerAbstractInterface::sendDataOnEndpoint(const QByteArray &value, const QByteArray &target, const QHash<QByteArray, QByteArray> &attributes,
+void ProducerAbstractInterface::sendDataOnEndpoint(const QVariantHash &value, const QByteArray &target, const QHash<QByteArray, QByteArray> &attributes,
                                                    const QDateTime &timestamp, const QVariantHash &metadata)
 {
-    Util::BSONSerializer serializer;
+    sendRawDataOnEndpoint(serializeValue(value, timestamp, metadata), target, attributes);
+}
+
+QByteArray ProducerAbstractInterface::serializeValue(const QByteArray &value, const QDateTime &timestamp, const QVariantHash &metadata)
+{
+    Util::BSONSerializer serializer(PAYLOAD_BASE_RESERVE + value.count());
     serializer.appendBinaryValue("v", value);
     if (!timestamp.isNull() && timestamp.isValid()) {
         serializer.appendDateTime("t", timestamp);
@@ -149,13 +167,12 @@ void ProducerAbstractInterface::sendDataOnEndpoint(const QByteArray &value, cons
         serializer.appendDocument("m", metadata);
     }
     serializer.appendEndOfDocument();
-    sendRawDataOnEndpoint(serializer.document(), target, attributes);
+    return serializer.document();
 }
 
-void ProducerAbstractInterface::sendDataOnEndpoint(double value, const QByteArray &target, const QHash<QByteArray, QByteArray> &attributes,
-                                                   const QDateTime &timestamp, const QVariantHash &metadata)
+QByteArray ProducerAbstractInterface::serializeValue(double value, const QDateTime &timestamp, const QVariantHash &metadata)
 {
-    Util::BSONSerializer serializer;
+    Util::BSONSerializer serializer(PAYLOAD_BASE_RESERVE);
     serializer.appendDoubleValue("v", value);
     if (!timestamp.isNull() && timestamp.isValid()) {
         serializer.appendDateTime("t", timestamp);
@@ -164,13 +181,12 @@ void ProducerAbstractInterface::sendDataOnEndpoint(double value, const QByteArra
         serializer.appendDocument("m", metadata);
     }
     serializer.appendEndOfDocument();
-    sendRawDataOnEndpoint(serializer.document(), target, attributes);
+    return serializer.document();
 }
 
-void ProducerAbstractInterface::sendDataOnEndpoint(int value, const QByteArray &target, const QHash<QByteArray, QByteArray> &attributes,
-                                                   const QDateTime &timestamp, const QVariantHash &metadata)
+QByteArray ProducerAbstractInterface::serializeValue(int value, const QDateTime &timestamp, const QVariantHash &metadata)
 {
-    Util::BSONSerializer serializer;
+    Util::BSONSerializer serializer(PAYLOAD_BASE_RESERVE);
     serializer.appendInt32Value("v", value);
     if (!timestamp.isNull() && timestamp.isValid()) {
         serializer.appendDateTime("t", timestamp);
@@ -179,13 +195,12 @@ void ProducerAbstractInterface::sendDataOnEndpoint(int value, const QByteArray &
         serializer.appendDocument("m", metadata);
     }
     serializer.appendEndOfDocument();
-    sendRawDataOnEndpoint(serializer.document(), target, attributes);
+    return serializer.document();
 }
 
-void ProducerAbstractInterface::sendDataOnEndpoint(qint64 value, const QByteArray &target, const QHash<QByteArray, QByteArray> &attributes,
-                                                   const QDateTime &timestamp, const QVariantHash &metadata)
+QByteArray ProducerAbstractInterface::serializeValue(qint64 value, const QDateTime &timestamp, const QVariantHash &metadata)
 {
-    Util::BSONSerializer serializer;
+    Util::BSONSerializer serializer(PAYLOAD_BASE_RESERVE);
     serializer.appendInt64Value("v", value);
     if (!timestamp.isNull() && timestamp.isValid()) {
         serializer.appendDateTime("t", timestamp);
@@ -194,13 +209,12 @@ void ProducerAbstractInterface::sendDataOnEndpoint(qint64 value, const QByteArra
         serializer.appendDocument("m", metadata);
     }
     serializer.appendEndOfDocument();
-    sendRawDataOnEndpoint(serializer.document(), target, attributes);
+    return serializer.document();
 }
 
-void ProducerAbstractInterface::sendDataOnEndpoint(bool value, const QByteArray &target, const QHash<QByteArray, QByteArray> &attributes,
-                                                   const QDateTime &timestamp, const QVariantHash &metadata)
+QByteArray ProducerAbstractInterface::serializeValue(bool value, const QDateTime &timestamp, const QVariantHash &metadata)
 {
-    Util::BSONSerializer serializer;
+    Util::BSONSerializer serializer(PAYLOAD_BASE_RESERVE);
     serializer.appendBooleanValue("v", value);
     if (!timestamp.isNull() && timestamp.isValid()) {
         serializer.appendDateTime("t", timestamp);
@@ -209,13 +223,12 @@ void ProducerAbstractInterface::sendDataOnEndpoint(bool value, const QByteArray
         serializer.appendDocument("m", metadata);
     }
     serializer.appendEndOfDocument();
-    sendRawDataOnEndpoint(serializer.document(), target, attributes);
+    return serializer.document();
 }
 
-void ProducerAbstractInterface::sendDataOnEndpoint(const QString &value, const QByteArray &target, const QHash<QByteArray, QByteArray> &attributes,
-                                                   const QDateTime &timestamp, const QVariantHash &metadata)
+QByteArray ProducerAbstractInterface::serializeValue(const QString &value, const QDateTime &timestamp, const QVariantHash &metadata)
 {
-    Util::BSONSerializer serializer;
+    Util::BSONSerializer serializer(PAYLOAD_BASE_RESERVE + value.length() * 3);
     serializer.appendString("v", value);
     if (!timestamp.isNull() && timestamp.isValid()) {
         serializer.appendDateTime("t", timestamp);
@@ -224,13 +237,12 @@ void ProducerAbstractInterface::sendDataOnEndpoint(const QString &value, const Q
         serializer.appendDocument("m", metadata);
     }
     serializer.appendEndOfDocument();
-    sendRawDataOnEndpoint(serializer.document(), target, attributes);
+    return serializer.document();
 }
 
-void ProducerAbstractInterface::sendDataOnEndpoint(const QDateTime &value, const QByteArray &target, const QHash<QByteArray, QByteArray> &attributes,
-                                                   const QDateTime &timestamp, const QVariantHash &metadata)
+QByteArray ProducerAbstractInterface::serializeValue(const QDateTime &value, const QDateTime &timestamp, const QVariantHash &metadata)
 {
-    Util::BSONSerializer serializer;
+    Util::BSONSerializer serializer(PAYLOAD_BASE_RESERVE);
     serializer.appendDateTime("v", value);
     if (!timestamp.isNull() && timestamp.isValid()) {
         serializer.appendDateTime("t", timestamp);
@@ -239,13 +251,12 @@ void ProducerAbstractInterface::sendDataOnEndpoint(const QDateTime &value, const
         serializer.appendDocument("m", metadata);
     }
     serializer.appendEndOfDocument();
-    sendRawDataOnEndpoint(serializer.document(), target, attributes);
+    return serializer.document();
 }
 
-void ProducerAbstractInterface::sendDataOnEndpoint(const QVariantHash &value, const QByteArray &target, const QHash<QByteArray, QByteArray> &attributes,
-                                                   const QDateTime &timestamp, const QVariantHash &metadata)
+QByteArray ProducerAbstractInterface::serializeValue(const QVariantHash &value, const QDateTime &timestamp, const QVariantHash &metadata)
 {
-    Util::BSONSerializer serializer;
+    Util::BSONSerializer serializer(PAYLOAD_BASE_RESERVE + value.count() * AGGREGATE_ENTRY_RESERVE);
     serializer.appendDocument("v", value);
     if (!timestamp.isNull() && timestamp.isValid()) {
         serializer.appendDateTime("t", timestamp);
@@ -254,7 +265,7 @@ void ProducerAbstractInterface::sendDataOnEndpoint(const QVariantHash &value, co
         serializer.appendDocument("m", metadata);
     }
     serializer.appendEndOfDocument();
-    sendRawDataOnEndpoint(serializer.document(), target, attributes);
+    return serializer.document();
 }
 
 bool ProducerAbstractInterface::payloadToValue(const QByteArray &payload, QByteArray *value)
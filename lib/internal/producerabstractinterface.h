@@ -20,6 +20,7 @@
 #define _HYPERSPACE_PLUS_PROVIDERABSTRACTINTERFACE_H_
 
 #include "abstractwavetarget.h"
+#include "cachemessage.h"
 
 #include <QtCore/QDateTime>
 
@@ -27,19 +28,7 @@ namespace Astarte {
     class Transport;
 }
 
-enum Retention {
-    UnknownRetention = 0,
-    Discard = 1,
-    Volatile = 2,
-    Stored = 3
-};
-
-enum Reliability {
-    UnknownReliability = 0,
-    Unreliable = 1,
-    Guaranteed = 2,
-    Unique = 3
-};
+class AstarteSendHandleData;
 
 class ProducerAbstractInterface : public AbstractWaveTarget
 {
@@ -58,15 +47,16 @@ class ProducerAbstractInterface : public AbstractWaveTarget
     protected:
         virtual void waveFunction(const Wave &wave);
 
-        void insertTransition(int state, QByteArray token, int newState);
-        void insertDispatchState(int state, int dispatchIndex);
+        /// Compiles the dispatch automaton, dispatchIndex returns indexes into mappings
+        void setDispatchMappings(const QList<QByteArray> &mappings);
 
-        int dispatchIndex(const QList<QByteArray> &inputTokens);
+        int dispatchIndex(const QByteArray &target);
 
         virtual void populateTokensAndStates() = 0;
-        virtual ProducerAbstractInterface::DispatchResult dispatch(int i, const QByteArray &value, const QList<QByteArray> &inputTokens) = 0;
+        virtual ProducerAbstractInterface::DispatchResult dispatch(int i, const QByteArray &value, const QByteArray &target) = 0;
 
         void sendRawDataOnEndpoint(const QByteArray &value, const QByteArray &target, const QHash<QByteArray, QByteArray> &attributes = QHash<QByteArray, QByteArray>());
+        void sendRawDataOnHandle(const QByteArray &value, AstarteSendHandleData *handle);
 
         void sendDataOnEndpoint(const QByteArray &value, const QByteArray &target, const QHash<QByteArray, QByteArray> &attributes = QHash<QByteArray, QByteArray>(),
                                 const QDateTime &timestamp = QDateTime(), const QVariantHash &metadata = QVariantHash());
@@ -85,6 +75,15 @@ class ProducerAbstractInterface : public AbstractWaveTarget
         void sendDataOnEndpoint(const QVariantHash &value, const QByteArray &target, const QHash<QByteArray, QByteArray> &attributes = QHash<QByteArray, QByteArray>(),
                                 const QDateTime &timestamp = QDateTime(), const QVariantHash &metadata = QVariantHash());
 
+        QByteArray serializeValue(const QByteArray &value, const QDateTime &timestamp, const QVariantHash &metadata);
+        QByteArray serializeValue(double value, const QDateTime &timestamp, const QVariantHash &metadata);
+        QByteArray serializeValue(int value, const QDateTime &timestamp, const QVariantHash &metadata);
+        QByteArray serializeValue(qint64 value, const QDateTime &timestamp, const QVariantHash &metadata);
+        QByteArray serializeValue(bool value, const QDateTime &timestamp, const QVariantHash &metadata);
+        QByteArray serializeValue(const QString &value, const QDateTime &timestamp, const QVariantHash &metadata);
+        QByteArray serializeValue(const QDateTime &value, const QDateTime &timestamp, const QVariantHash &metadata);
+        QByteArray serializeValue(const QVariantHash &value, const QDateTime &timestamp, const QVariantHash &metadata);
+
         bool payloadToValue(const QByteArray &payload, QByteArray *value);
         bool payloadToValue(const QByteArray &payload, int *value);
         bool payloadToValue(const QByteArray &payload, qint64 *value);
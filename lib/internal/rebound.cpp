@@ -137,12 +137,11 @@ QByteArray Rebound::serialize() const
     s.appendInt64Value("u", (int64_t) d->id);
     s.appendInt32Value("r", (int32_t) d->responseCode);
     if (!d->attributes.isEmpty()) {
-        Util::BSONSerializer sa;
+        s.beginSubdocument("a");
         for (ByteArrayHash::const_iterator i = d->attributes.constBegin(); i != d->attributes.constEnd(); ++i) {
-            sa.appendASCIIString(i.key(), i.value());
+            s.appendASCIIString(i.key(), i.value());
         }
-        sa.appendEndOfDocument();
-        s.appendDocument("a", sa.document());
+        s.endSubdocument();
     }
     s.appendBinaryValue("p", d->payload);
     s.appendEndOfDocument();
@@ -20,23 +20,30 @@
 
 #include "httpendpoint.h"
 #include "transportcache.h"
+#include "transportthread.h"
 #include "mqttclientwrapper.h"
 #include "producerabstractinterface.h"
 
+#include "abstractwavetarget.h"
 #include "wave.h"
 #include "rebound.h"
 #include "fluctuation.h"
 
+#include "utils/bsondocument.h"
 #include "utils/hemeraoperation.h"
+#include "utils/transportdatabasemanager.h"
 
 #include <QtCore/QByteArray>
 #include <QtCore/QCoreApplication>
+#include <QtCore/QDateTime>
 #include <QtCore/QDir>
 #include <QtCore/QTimer>
+#include <QtCore/QTimerEvent>
 #include <QtCore/QStringList>
 #include <QtCore/QSocketNotifier>
 #include <QtCore/QDebug>
 #include <QtCore/QSettings>
+#include <QtCore/QThread>
 #include <QtCore/QVariantMap>
 
 #include <QtCore/QFuture>
@@ -46,7 +53,10 @@
 
 #include "utils/utils.h"
 
+#include <limits.h>
+#include <math.h>
 #include <signal.h>
+#include <string.h>
 #include <unistd.h>
 
 #include <sys/types.h>
@@ -60,24 +70,67 @@
 
 #define CERTIFICATE_RENEWAL_DAYS 8
 
+#define DEFAULT_RETRY_DRAIN_BATCH_SIZE 64
+
+#define DEFAULT_BATCH_WINDOW_MS 1000
+#define DEFAULT_BATCH_MAX_BYTES 4096
+
+#define DEFAULT_PENDING_WAVES_LIMIT 256
+#define DEFAULT_PENDING_WAVE_TIMEOUT_MS (30 * 1000)
+
 namespace Astarte
 {
 
 Transport::Transport(const QString &configurationPath, const QByteArray &hardwareId, QObject* parent)
     : AsyncInitObject(parent)
+    , m_transportThread(0)
     , m_configurationPath(configurationPath)
     , m_hardwareId(hardwareId)
     , m_rebootTimer(new QTimer(this))
     , m_rebootWhenConnectionFails(false)
     , m_rebootDelayMinutes(600)
+    , m_mqttLoopMode(MQTTClientWrapper::ThreadedLoop)
+    , m_currentLane(ControlLane)
+    , m_pendingSyncControls(0)
+    , m_maxInFlightMessages(0)
+    , m_retryDrainBatchSize(DEFAULT_RETRY_DRAIN_BATCH_SIZE)
+    , m_retryDrainPending(false)
+    , m_publishTimerId(0)
+    , m_throttledMessages(0)
+    , m_batchWindowms(DEFAULT_BATCH_WINDOW_MS)
+    , m_batchMaxBytes(DEFAULT_BATCH_MAX_BYTES)
+    , m_waveArrivals(0)
+    , m_pendingWavesLimit(DEFAULT_PENDING_WAVES_LIMIT)
+    , m_pendingWaveTimeoutms(DEFAULT_PENDING_WAVE_TIMEOUT_MS)
+    , m_pendingWavesTimerId(0)
+    , m_droppedWaves(0)
 {
+    for (int i = 0; i < 3; ++i) {
+        m_publishBuckets[i].rate = 0;
+        m_publishBuckets[i].burst = 1;
+        m_publishBuckets[i].tokens = 1;
+        m_publishBuckets[i].lastRefill = 0;
+    }
+    const int defaultWeights[PublishLaneCount] = { 8, 4, 4, 1 };
+    for (int i = 0; i < PublishLaneCount; ++i) {
+        m_laneWeights[i] = defaultWeights[i];
+        m_laneCredits[i] = defaultWeights[i];
+    }
+
     qRegisterMetaType<MQTTClientWrapper::Status>();
     connect(this, SIGNAL(introspectionChanged()), this, SLOT(publishIntrospection()));
     connect(this, SIGNAL(introspectionChanged()), this, SLOT(setupClientSubscriptions()));
+    // Don't lose samples still waiting for their batch window
+    connect(QCoreApplication::instance(), SIGNAL(aboutToQuit()), this, SLOT(flushBatches()));
 }
 
 Transport::~Transport()
 {
+    // Batches are flushed on disconnection and when the application quits, not here: the MQTT client
+    // might be gone already
+    if (!m_pendingBatches.isEmpty()) {
+        qWarning() << "Dropping" << m_pendingBatches.count() << "pending batches on destruction";
+    }
 }
 
 void Transport::initImpl()
@@ -102,13 +155,83 @@ void Transport::initImpl()
 
         QSettings syncSettings(QString("%1/transportStatus.conf").arg(m_persistencyDir), QSettings::IniFormat);
         m_synced = syncSettings.value(QLatin1String("isSynced"), false).toBool();
+        m_syncGeneration = syncSettings.value(QLatin1String("syncGeneration"), 0).toLongLong();
 
         TransportCache::setPersistencyDir(m_persistencyDir);
+        TransportCache::setWriteBatching(settings.value(QLatin1String("persistenceBatchSize"), 1).toInt(),
+                                         settings.value(QLatin1String("persistenceDurabilityWindowMs"), 0).toInt());
+        // Bytes of non stored retry entries kept in memory, 0 means unbounded
+        TransportCache::setRetryMemoryBudget(settings.value(QLatin1String("retryMemoryBudget"), 0).toLongLong(),
+                                             settings.value(QLatin1String("retryOverflowPolicy")).toString() == QLatin1String("dropOldest")
+                                                ? TransportCache::DropOldestRetryEntries : TransportCache::SpillRetryEntries);
+
+        // Stored messages can live in an append-only segmented log rather than in persistence.db
+        if (settings.value(QLatin1String("storedMessagesBackend")).toString() == QLatin1String("log")) {
+            TransportDatabaseManager::setStoredMessagesLog(QString("%1/storedmessages").arg(m_persistencyDir),
+                                                           settings.value(QLatin1String("storedMessagesSegmentSize"), 4 * 1024 * 1024).toLongLong());
+        }
+
+        // SQLite tuning for persistence.db, e.g. journal_mode=WAL and synchronous=NORMAL
+        QStringList databasePragmas = QStringList() << QLatin1String("journal_mode") << QLatin1String("synchronous")
+                                                    << QLatin1String("temp_store") << QLatin1String("cache_size")
+                                                    << QLatin1String("mmap_size") << QLatin1String("page_size")
+                                                    << QLatin1String("wal_autocheckpoint") << QLatin1String("busy_timeout");
+        Q_FOREACH (const QString &pragma, databasePragmas) {
+            if (settings.contains(pragma)) {
+                TransportDatabaseManager::setPragma(pragma, settings.value(pragma).toString());
+            }
+        }
+
+        // Publish scheduling: messages per second for each QoS class (0 is unlimited), bucket size,
+        // bound on unconfirmed QoS 1/2 messages and retried messages handed over per event loop iteration
+        const char *rateKeys[3] = { "publishRateQoS0", "publishRateQoS1", "publishRateQoS2" };
+        double burst = qMax(1.0, settings.value(QLatin1String("publishBurst"), 1).toDouble());
+        for (int i = 0; i < 3; ++i) {
+            m_publishBuckets[i].rate = qMax(0.0, settings.value(QLatin1String(rateKeys[i]), 0).toDouble());
+            m_publishBuckets[i].burst = burst;
+            m_publishBuckets[i].tokens = burst;
+            m_publishBuckets[i].lastRefill = QDateTime::currentMSecsSinceEpoch();
+        }
+        m_maxInFlightMessages = settings.value(QLatin1String("maxInFlightMessages"), 0).toInt();
+        m_retryDrainBatchSize = qMax(1, settings.value(QLatin1String("retryDrainBatchSize"), DEFAULT_RETRY_DRAIN_BATCH_SIZE).toInt());
+
+        // How many queued messages each lane publishes per round when the broker can't take them all
+        const char *weightKeys[PublishLaneCount] = { "controlLaneWeight", "propertiesLaneWeight", "liveLaneWeight", "replayLaneWeight" };
+        for (int i = 0; i < PublishLaneCount; ++i) {
+            m_laneWeights[i] = qMax(1, settings.value(QLatin1String(weightKeys[i]), m_laneWeights[i]).toInt());
+            m_laneCredits[i] = m_laneWeights[i];
+        }
+
+        // Opt-in payload batching: datastream samples for these interfaces (or interface/path prefixes) are
+        // coalesced for up to batchWindowMs, or until batchMaxBytes, and published as a single document.
+        // Samples of Stored mappings are never batched, they must reach the database right away.
+        //
+        // Wire contract: the batch goes on the mapping's usual topic, <root>/<interface><path>, with QoS
+        // and retention of its samples. Its BSON payload is { "b": [ sample, ... ] }, where each sample
+        // is the document that would have been published on its own ({ "v": ..., "t": ... }), "t" being
+        // always present. The receiving end must recognize the "b" array and unwrap it, so only list
+        // interfaces whose server side ingestion is known to do so.
+        Q_FOREACH (const QString &target, settings.value(QLatin1String("batchedInterfaces")).toStringList()) {
+            m_batchedTargets.insert(target.trimmed().toLatin1());
+        }
+        m_batchWindowms = qMax(0, settings.value(QLatin1String("batchWindowMs"), DEFAULT_BATCH_WINDOW_MS).toInt());
+        m_batchMaxBytes = qMax(1, settings.value(QLatin1String("batchMaxBytes"), DEFAULT_BATCH_MAX_BYTES).toInt());
+
+        // Inbound waves are kept until their rebound, but no more than pendingWavesLimit of them
+        // and no longer than pendingWaveTimeoutMs
+        m_pendingWavesLimit = qMax(1, settings.value(QLatin1String("pendingWavesLimit"), DEFAULT_PENDING_WAVES_LIMIT).toInt());
+        m_pendingWaveTimeoutms = qMax(1, settings.value(QLatin1String("pendingWaveTimeoutMs"), DEFAULT_PENDING_WAVE_TIMEOUT_MS).toInt());
+
+        TransportCache::instance()->setSyncGeneration(m_syncGeneration);
         connect(TransportCache::instance()->init(), SIGNAL(finished(Hemera::Operation*)), this, SLOT(setOnePartIsReady()));
 
         m_astarteEndpoint = new Astarte::HTTPEndpoint(m_configurationPath, m_persistencyDir, settings.value(QLatin1String("endpoint")).toUrl(),
                                                       m_hardwareId, QSslConfiguration::defaultConfiguration(), this);
 
+        // libmosquitto runs its own thread unless the application asks to drive it from our event loop
+        m_mqttLoopMode = settings.value(QLatin1String("mqttLoopMode")).toString() == QLatin1String("integrated")
+                             ? MQTTClientWrapper::IntegratedLoop : MQTTClientWrapper::ThreadedLoop;
+
         m_rebootWhenConnectionFails = settings.value(QLatin1String("rebootWhenConnectionFails"), false).toBool();
         m_rebootDelayMinutes = settings.value(QLatin1String("rebootDelayMinutes"), 600).toInt();
         //m_rebootTimer->setTimerType(Qt::VeryCoarseTimer);
@@ -133,6 +256,7 @@ void Transport::onEndpointReady(Hemera::Operation *op)
     }
 
     if (!m_mqttBroker.isNull()) {
+        flushBatches();
         m_mqttBroker.data()->disconnectFromBroker();
         m_mqttBroker.data()->deleteLater();
     }
@@ -189,32 +313,31 @@ void Transport::setupMqtt()
     // Ok to synchronize this.
     m_mqttBroker.data()->init()->synchronize();
     m_mqttBroker.data()->setKeepAlive(60);
+    m_mqttBroker.data()->setLoopMode(m_mqttLoopMode);
     m_mqttBroker.data()->connectToBroker();
 
     connect(m_mqttBroker.data(), SIGNAL(statusChanged(Astarte::MQTTClientWrapper::Status)), this, SLOT(onStatusChanged(Astarte::MQTTClientWrapper::Status)));
-    connect(m_mqttBroker.data(), SIGNAL(messageReceived(QByteArray,QByteArray)), this, SLOT(onMQTTMessageReceived(QByteArray,QByteArray)));
-    connect(m_mqttBroker.data(), SIGNAL(publishConfirmed(int)), this, SLOT(onPublishConfirmed(int)));
+    connect(m_mqttBroker.data(), SIGNAL(messageReceived(QByteArray,int)), this, SLOT(onMQTTMessageReceived(QByteArray,int)));
+    // Queued whatever the loop mode: the confirmation must never overtake publishNow's in-flight bookkeeping
+    connect(m_mqttBroker.data(), SIGNAL(publishConfirmed(int)), this, SLOT(onPublishConfirmed(int)), Qt::QueuedConnection);
     connect(m_mqttBroker.data(), SIGNAL(connackTimeout()), this, SLOT(handleConnackTimeout()));
     connect(m_mqttBroker.data(), SIGNAL(connectionFailed()), this, SLOT(handleConnectionFailed()));
 }
 
-void Transport::onMQTTMessageReceived(const QByteArray& topic, const QByteArray& payload)
+void Transport::onMQTTMessageReceived(const QByteArray &message, int topicLength)
 {
     // Normalize the message
-    if (!topic.startsWith(m_mqttBroker.data()->rootClientTopic())) {
-        qWarning() << "Received MQTT message on topic" << topic << ", which does not match the device base hierarchy!";
+    const QByteArray rootClientTopic = m_mqttBroker.data()->rootClientTopic();
+    if (topicLength < rootClientTopic.length() || memcmp(message.constData(), rootClientTopic.constData(), rootClientTopic.length())) {
+        qWarning() << "Received MQTT message on topic" << message.left(topicLength) << ", which does not match the device base hierarchy!";
         return;
     }
 
-    QByteArray relativeTopic = topic;
-    relativeTopic.remove(0, m_mqttBroker.data()->rootClientTopic().length());
-
-    // Prepare a write wave
-    Wave w;
+    // Prepare a write wave, target and payload are slices of the message
+    Wave w = Wave::fromBuffer(message, rootClientTopic.length(), topicLength - rootClientTopic.length(),
+                              topicLength, message.length() - topicLength);
     w.setMethod(METHOD_WRITE);
-    w.setTarget(relativeTopic);
-    w.setPayload(payload);
-    m_waveStorage.insert(w.id(), w);
+    trackPendingWave(w);
     qDebug() << "Sending wave" << w.method() << w.target();
     routeWave(w, -1);
 }
@@ -240,40 +363,94 @@ void Transport::setupClientSubscriptions()
 
 void Transport::sendProperties()
 {
-    for (QHash< QByteArray, QByteArray >::const_iterator i = TransportCache::instance()->allPersistentEntries().constBegin();
-         i != TransportCache::instance()->allPersistentEntries().constEnd();
-         ++i) {
-
-        // Recreate the cacheMessage
-        CacheMessage c;
-        c.setTarget(i.key());
-        c.setPayload(i.value());
-        c.setInterfaceType(AstarteInterface::Properties);
+    // Walks the cache in place, sending only what the broker did not confirm since the last full resync
+    class StalePropertySender : public TransportCache::PersistentEntryVisitor
+    {
+    public:
+        StalePropertySender(Transport *transport) : m_transport(transport), m_now(QDateTime::currentMSecsSinceEpoch()) {}
+
+        virtual void visitPersistentEntry(const QByteArray &target, const QByteArray &payload)
+        {
+            // Recreate the cacheMessage
+            CacheMessage c;
+            c.setTarget(target);
+            c.setPayload(payload);
+            c.setInterfaceType(AstarteInterface::Properties);
+            c.setTimestamp(m_now);
+
+            // Publishing never touches the persistent entries, confirmations come from the event loop
+            if (m_transport->m_mqttBroker.isNull()) {
+                m_transport->handleFailedPublish(c);
+                return;
+            }
 
-        if (m_mqttBroker.isNull()) {
-            handleFailedPublish(c);
-            continue;
+            QueuedPublish queued;
+            queued.message = c;
+            queued.qos = MQTTClientWrapper::ExactlyOnceQoS;
+            queued.topic = m_transport->m_mqttBroker.data()->rootClientTopic() + target;
+            queued.control = false;
+            queued.resync = true;
+            m_transport->enqueuePublish(queued, PropertiesLane);
         }
 
-        int rc = m_mqttBroker.data()->publish(m_mqttBroker.data()->rootClientTopic() + i.key(), i.value(), MQTTClientWrapper::ExactlyOnceQoS);
-        if (rc < 0) {
-            // If it's < 0, it's an error
-            handleFailedPublish(c);
-        } else {
-            // Otherwise, it's the messageId
-            qDebug() << "Inserting in-flight message id " << rc;
-            TransportCache::instance()->addInFlightEntry(rc, c);
-        }
-    }
+    private:
+        Transport *m_transport;
+        qint64 m_now;
+    };
+
+    StalePropertySender sender(this);
+    TransportCache::instance()->visitPersistentEntries(&sender, true);
 }
 
 void Transport::resendFailedMessages()
 {
-    QList<int> ids = TransportCache::instance()->allRetryIds();
-    Q_FOREACH (int id, ids) {
+    m_retryDrainPending = false;
+    if (m_mqttBroker.isNull() || m_mqttBroker.data()->status() != MQTTClientWrapper::ConnectedStatus) {
+        return;
+    }
+
+    // Hand retried messages over a batch at a time, and only while the replay lane has room,
+    // so a large backlog never floods the client outgoing queue
+    int budget = m_retryDrainBatchSize - m_publishLanes[ReplayLane].count();
+    if (budget <= 0) {
+        m_retryDrainPending = true;
+        return;
+    }
+
+    int retryCount = TransportCache::instance()->retryEntriesCount();
+    Q_FOREACH (int id, TransportCache::instance()->retryIds(budget)) {
         CacheMessage failedMessage = TransportCache::instance()->takeRetryEntry(id);
-        // Call cache message function with the failed message
-        cacheMessage(failedMessage);
+        // Retried datastreams wait in the replay lane, so they don't delay live ones
+        publishCacheMessage(failedMessage, publishQoS(failedMessage.interfaceType(), failedMessage.reliability()), 0,
+                            failedMessage.interfaceType() == AstarteInterface::Properties ? PropertiesLane : ReplayLane);
+    }
+
+    // Stored messages are replayed from the database one page at a time: pull the next one
+    // once the current page has been handed over to the broker, even if other messages are
+    // still waiting to be retried, and go through the event loop in between so confirmations
+    // can be processed.
+    if (TransportCache::instance()->hasPendingReplay() && TransportCache::instance()->isReplayPageDrained()) {
+        TransportCache::instance()->loadReplayPage();
+        QTimer::singleShot(0, this, SLOT(resendFailedMessages()));
+        return;
+    }
+
+    int remaining = TransportCache::instance()->retryEntriesCount();
+    if (remaining > 0) {
+        // Keep going only if messages actually left the retry set, failed publishes land back in it
+        if (remaining < retryCount) {
+            if (m_publishLanes[ReplayLane].count() < m_retryDrainBatchSize) {
+                QTimer::singleShot(0, this, SLOT(resendFailedMessages()));
+            } else {
+                m_retryDrainPending = true;
+            }
+        }
+        return;
+    }
+
+    if (TransportCache::instance()->pendingSpilledRetryEntries() > 0) {
+        TransportCache::instance()->loadSpilledRetryEntries();
+        QTimer::singleShot(0, this, SLOT(resendFailedMessages()));
     }
 }
 
@@ -281,17 +458,23 @@ void Transport::rebound(const Rebound& r, int fd)
 {
     Q_UNUSED(fd);
 
-    Rebound rebound = r;
+    if (isForeignThread()) {
+        m_transportThread->postRebound(r);
+        return;
+    }
 
-    // FIXME: We should just trigger errors here.
-    return;
+    Rebound rebound = r;
 
-    if (!m_waveStorage.contains(r.id())) {
-        qWarning() << "Got a rebound with id" << r.id() << "which does not match any routing rules!";
+    // The wave is done with, release it right away
+    Wave w;
+    if (!takePendingWave(r.id(), &w)) {
+        qWarning() << "Got a rebound with id" << r.id() << "which does not match any pending wave!";
         return;
     }
 
-    Wave w = m_waveStorage.take(r.id());
+    // FIXME: We should just trigger errors here.
+    return;
+
     QByteArray waveTarget = w.target();
 
     if (m_commandTree.contains(r.id())) {
@@ -316,62 +499,455 @@ void Transport::fluctuation(const Fluctuation &fluctuation)
     qDebug() << "Received fluctuation from: " << fluctuation.target() << fluctuation.payload();
 }
 
+MQTTClientWrapper::MQTTQoS Transport::publishQoS(AstarteInterface::Type interfaceType, Reliability reliability)
+{
+    switch (interfaceType) {
+        case AstarteInterface::Properties:
+            return MQTTClientWrapper::ExactlyOnceQoS;
+
+        case AstarteInterface::DataStream: {
+            switch (reliability) {
+                case (Guaranteed):
+                    return MQTTClientWrapper::AtLeastOnceQoS;
+                case (Unique):
+                    return MQTTClientWrapper::ExactlyOnceQoS;
+                default:
+                    // Default Unreliable
+                    return MQTTClientWrapper::AtMostOnceQoS;
+            }
+        }
+
+        default:
+            return MQTTClientWrapper::DefaultQoS;
+    }
+}
+
 void Transport::cacheMessage(const CacheMessage &cacheMessage)
+{
+    this->cacheMessage(cacheMessage, publishQoS(cacheMessage.interfaceType(), cacheMessage.reliability()), 0);
+}
+
+void Transport::cacheMessage(const CacheMessage &cacheMessage, MQTTClientWrapper::MQTTQoS qos, QByteArray *topic)
+{
+    // The topic cache can't be shared across threads, the command goes without it
+    if (isForeignThread()) {
+        m_transportThread->postCacheMessage(cacheMessage, qos);
+        return;
+    }
+
+    if (!m_batchedTargets.isEmpty() && cacheMessage.interfaceType() == AstarteInterface::DataStream
+        && cacheMessage.retention() != Stored && isBatched(cacheMessage.target())) {
+        appendToBatch(cacheMessage, qos);
+        return;
+    }
+
+    publishCacheMessage(cacheMessage, qos, topic, cacheMessage.interfaceType() == AstarteInterface::Properties ? PropertiesLane : LiveLane);
+}
+
+void Transport::publishCacheMessage(const CacheMessage &cacheMessage, MQTTClientWrapper::MQTTQoS qos, QByteArray *topic, PublishLane lane)
 {
     qDebug() << "Received cacheMessage from: " << cacheMessage.target() << cacheMessage.payload();
+
+    CacheMessage message = cacheMessage;
+    if (message.timestamp() == 0) {
+        // First time we see it, replay follows this order
+        message.setTimestamp(QDateTime::currentMSecsSinceEpoch());
+    }
+
     if (m_mqttBroker.isNull()) {
-        handleFailedPublish(cacheMessage);
+        handleFailedPublish(message);
         return;
     }
 
-    int rc;
-
-    switch (cacheMessage.interfaceType()) {
-        case AstarteInterface::Properties: {
-            if (TransportCache::instance()->isCached(cacheMessage.target())
-                    && TransportCache::instance()->persistentEntry(cacheMessage.target()) == cacheMessage.payload()) {
+    if (qos == MQTTClientWrapper::DefaultQoS) {
+        qDebug() << "Unsupported interfaceType";
+        handleFailedPublish(message);
+        return;
+    }
 
-                qDebug() << cacheMessage.target() << "is not changed, not publishing it again";
-                // We consider it delivered, so remove it from the DB
-                TransportCache::instance()->removeFromDatabase(cacheMessage);
-                return;
-            }
+    if (message.interfaceType() == AstarteInterface::Properties) {
+        if (TransportCache::instance()->persistentEntryEquals(message.target(), message.payload())) {
 
-            rc = m_mqttBroker.data()->publish(m_mqttBroker.data()->rootClientTopic() + cacheMessage.target(), cacheMessage.payload(), MQTTClientWrapper::ExactlyOnceQoS);
-            break;
+            qDebug() << message.target() << "is not changed, not publishing it again";
+            // We consider it delivered, so remove it from the DB
+            TransportCache::instance()->removeFromDatabase(message);
+            return;
         }
+    }
 
-        case AstarteInterface::DataStream: {
-            Reliability reliability = static_cast<Reliability>(cacheMessage.attributes().value("reliability").toInt());
-            switch (reliability) {
-                case (Guaranteed):
-                    rc = m_mqttBroker.data()->publish(m_mqttBroker.data()->rootClientTopic() + cacheMessage.target(), cacheMessage.payload(), MQTTClientWrapper::AtLeastOnceQoS);
-                    break;
-                case (Unique):
-                    rc = m_mqttBroker.data()->publish(m_mqttBroker.data()->rootClientTopic() + cacheMessage.target(), cacheMessage.payload(), MQTTClientWrapper::ExactlyOnceQoS);
-                    break;
-                default:
-                    // Default Unreliable
-                    rc = m_mqttBroker.data()->publish(m_mqttBroker.data()->rootClientTopic() + cacheMessage.target(), cacheMessage.payload(), MQTTClientWrapper::AtMostOnceQoS);
-                    break;
-            }
-            break;
+    QByteArray rootClientTopic = m_mqttBroker.data()->rootClientTopic();
+    QueuedPublish queued;
+    if (topic) {
+        // Rebuild the cached topic only if the client root changed
+        if (topic->size() != rootClientTopic.size() + message.target().size() || !topic->startsWith(rootClientTopic)) {
+            *topic = rootClientTopic + message.target();
         }
+        queued.topic = *topic;
+    } else {
+        queued.topic = rootClientTopic + message.target();
+    }
+    queued.message = message;
+    queued.qos = qos;
+    queued.control = false;
 
-        default: {
-            rc = -1;
-            qDebug() << "Unsupported interfaceType";
-            break;
+    enqueuePublish(queued, lane);
+}
+
+bool Transport::isBatched(const QByteArray &target) const
+{
+    // Try the interface first, then longer and longer path prefixes
+    int end = target.indexOf('/', 1);
+    while (end > 0) {
+        if (m_batchedTargets.contains(target.mid(1, end - 1))) {
+            return true;
         }
+        end = target.indexOf('/', end + 1);
+    }
+
+    return m_batchedTargets.contains(target.mid(1));
+}
+
+void Transport::appendToBatch(const CacheMessage &cacheMessage, MQTTClientWrapper::MQTTQoS qos)
+{
+    Util::BSONDocument sample(cacheMessage.payload());
+    if (Q_UNLIKELY(!sample.isValid())) {
+        publishCacheMessage(cacheMessage, qos, 0, LiveLane);
+        return;
+    }
+
+    CacheMessage message = cacheMessage;
+    if (message.timestamp() == 0) {
+        message.setTimestamp(QDateTime::currentMSecsSinceEpoch());
+    }
+
+    // A batch is published as a single message, so its samples must share how it is delivered
+    QHash< QByteArray, PendingBatch >::iterator batch = m_pendingBatches.find(message.target());
+    if (batch != m_pendingBatches.end() && (batch->qos != qos || batch->message.retention() != message.retention()
+                                            || batch->message.reliability() != message.reliability()
+                                            || batch->message.expiry() != message.expiry())) {
+        flushBatch(message.target());
+        batch = m_pendingBatches.end();
+    }
+
+    if (batch == m_pendingBatches.end()) {
+        PendingBatch newBatch;
+        newBatch.message = message;
+        newBatch.qos = qos;
+        newBatch.count = 0;
+        newBatch.serializer.reserve(qMin(m_batchMaxBytes, DEFAULT_BATCH_MAX_BYTES) + message.payload().count());
+        newBatch.serializer.beginArray("b");
+        newBatch.timerId = startTimer(m_batchWindowms);
+        m_batchTimers.insert(newBatch.timerId, message.target());
+        batch = m_pendingBatches.insert(message.target(), newBatch);
+    }
+
+    batch->serializer.beginSubdocument(QByteArray::number(batch->count).constData());
+    batch->serializer.appendElements(message.payload());
+    if (!sample.contains("t")) {
+        // The batch goes out later, keep the time the sample was taken
+        batch->serializer.appendDateTime("t", QDateTime::fromMSecsSinceEpoch(message.timestamp()));
+    }
+    batch->serializer.endSubdocument();
+    ++batch->count;
+
+    if (batch->serializer.size() >= m_batchMaxBytes) {
+        flushBatch(message.target());
+    }
+}
+
+void Transport::flushBatch(const QByteArray &target)
+{
+    QHash< QByteArray, PendingBatch >::iterator i = m_pendingBatches.find(target);
+    if (i == m_pendingBatches.end()) {
+        return;
+    }
+
+    PendingBatch batch = i.value();
+    m_pendingBatches.erase(i);
+    killTimer(batch.timerId);
+    m_batchTimers.remove(batch.timerId);
+
+    // { "b": [ { "v": ..., "t": ... }, ... ] }, the message keeps the first sample timestamp
+    batch.serializer.endArray();
+    batch.serializer.appendEndOfDocument();
+    batch.message.setPayload(batch.serializer.document());
+
+    qDebug() << "Publishing" << batch.count << "batched samples for" << target;
+    publishCacheMessage(batch.message, batch.qos, &batch.topic, LiveLane);
+}
+
+void Transport::flushBatches()
+{
+    Q_FOREACH (const QByteArray &target, m_pendingBatches.keys()) {
+        flushBatch(target);
+    }
+}
+
+int Transport::publishControl(const QByteArray &topic, const QByteArray &payload, bool syncControl)
+{
+    QueuedPublish queued;
+    queued.message.setPayload(payload);
+    queued.qos = MQTTClientWrapper::ExactlyOnceQoS;
+    queued.topic = topic;
+    queued.control = true;
+    queued.syncControl = syncControl;
+    if (syncControl) {
+        ++m_pendingSyncControls;
+    }
+
+    return enqueuePublish(queued, ControlLane);
+}
+
+int Transport::enqueuePublish(const QueuedPublish &queued, PublishLane lane)
+{
+    // Publish right away only if nothing is waiting in this lane or in a more urgent one,
+    // otherwise ordering would not hold
+    bool lanesEmpty = true;
+    for (int i = ControlLane; i <= lane && lanesEmpty; ++i) {
+        lanesEmpty = m_publishLanes[i].isEmpty();
+    }
+
+    if (lanesEmpty && canPublish(queued.qos)) {
+        return publishNow(queued);
+    }
+
+    // Throttled, wait for a token or for in-flight messages to be confirmed. The lanes are only in memory,
+    // so what must survive a restart goes to the database now: the in-flight entry keeps the dbId and
+    // deletes the row once confirmed.
+    QueuedPublish waiting = queued;
+    if (!waiting.control) {
+        TransportCache::instance()->persistMessage(waiting.message);
+    }
+    m_publishLanes[lane].enqueue(waiting);
+    ++m_throttledMessages;
+    schedulePublishDrain();
+
+    return 0;
+}
+
+bool Transport::canPublish(MQTTClientWrapper::MQTTQoS qos)
+{
+    if (qos != MQTTClientWrapper::AtMostOnceQoS && m_maxInFlightMessages > 0 && m_inFlightIds.count() >= m_maxInFlightMessages) {
+        return false;
+    }
+
+    PublishBucket &bucket = m_publishBuckets[qos];
+    if (bucket.rate <= 0) {
+        return true;
+    }
+
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    bucket.tokens = qMin(bucket.burst, bucket.tokens + (now - bucket.lastRefill) * bucket.rate / 1000.0);
+    bucket.lastRefill = now;
+
+    return bucket.tokens >= 1.0;
+}
+
+int Transport::publishNow(const QueuedPublish &queued)
+{
+    if (m_publishBuckets[queued.qos].rate > 0) {
+        m_publishBuckets[queued.qos].tokens -= 1.0;
     }
 
-    if (rc < 0) {
+    int rc = m_mqttBroker.isNull() ? -1 : m_mqttBroker.data()->publish(queued.topic, queued.message.payload(), queued.qos);
+
+    if (rc >= 0 && queued.qos != MQTTClientWrapper::AtMostOnceQoS) {
+        m_inFlightIds.insert(rc);
+    }
+
+    if (queued.control) {
+        if (rc < 0) {
+            // Resync when we're back online
+            qWarning() << "Can't publish on" << queued.topic << ", error " << rc;
+            setSynced(false);
+            if (queued.syncControl) {
+                // This synchronization can't complete anymore
+                m_syncControlIds.clear();
+                m_pendingSyncControls = 0;
+            }
+        } else if (queued.syncControl) {
+            m_syncControlIds.insert(rc);
+        }
+    } else if (rc < 0) {
         // If it's < 0, it's an error
-        handleFailedPublish(cacheMessage);
+        handleFailedPublish(queued.message);
     } else {
         // Otherwise, it's the messageId
         qDebug() << "Inserting in-flight message id " << rc;
-        TransportCache::instance()->addInFlightEntry(rc, cacheMessage);
+        TransportCache::instance()->addInFlightEntry(rc, queued.message);
+    }
+
+    return rc;
+}
+
+void Transport::drainPublishQueues()
+{
+    // Weighted round robin: the current lane publishes up to its weight, then hands over to the next one.
+    // Lanes which are empty or waiting on their QoS bucket are skipped and keep their credits.
+    while (true) {
+        int lane = -1;
+        for (int i = 0; i < PublishLaneCount && lane < 0; ++i) {
+            int candidate = (m_currentLane + i) % PublishLaneCount;
+            if (!m_publishLanes[candidate].isEmpty() && canPublish(m_publishLanes[candidate].head().qos)) {
+                lane = candidate;
+            }
+        }
+
+        if (lane < 0) {
+            break;
+        }
+
+        publishNow(m_publishLanes[lane].dequeue());
+
+        if (--m_laneCredits[lane] <= 0 || m_publishLanes[lane].isEmpty()) {
+            m_laneCredits[lane] = m_laneWeights[lane];
+            m_currentLane = (lane + 1) % PublishLaneCount;
+        }
+    }
+
+    schedulePublishDrain();
+
+    if (m_retryDrainPending && m_publishLanes[ReplayLane].count() < m_retryDrainBatchSize) {
+        resendFailedMessages();
+    }
+}
+
+void Transport::schedulePublishDrain()
+{
+    if (m_publishTimerId) {
+        killTimer(m_publishTimerId);
+        m_publishTimerId = 0;
+    }
+
+    // Wake up when the first throttled lane gets a token. Lanes waiting only on in-flight
+    // confirmations are drained from onPublishConfirmed instead.
+    qint64 delayms = -1;
+    for (int lane = ControlLane; lane < PublishLaneCount; ++lane) {
+        if (m_publishLanes[lane].isEmpty()) {
+            continue;
+        }
+
+        MQTTClientWrapper::MQTTQoS qos = m_publishLanes[lane].head().qos;
+        const PublishBucket &bucket = m_publishBuckets[qos];
+        bool inFlightBound = qos != MQTTClientWrapper::AtMostOnceQoS && m_maxInFlightMessages > 0
+                             && m_inFlightIds.count() >= m_maxInFlightMessages;
+        if (inFlightBound) {
+            continue;
+        }
+
+        qint64 wait = 0;
+        if (bucket.rate > 0 && bucket.tokens < 1.0) {
+            wait = static_cast<qint64>(ceil((1.0 - bucket.tokens) * 1000.0 / bucket.rate));
+        }
+        if (delayms < 0 || wait < delayms) {
+            delayms = wait;
+        }
+    }
+
+    if (delayms >= 0) {
+        m_publishTimerId = startTimer(static_cast<int>(qMin(delayms, Q_INT64_C(INT_MAX))));
+    }
+}
+
+void Transport::timerEvent(QTimerEvent *event)
+{
+    if (event->timerId() == m_publishTimerId) {
+        killTimer(m_publishTimerId);
+        m_publishTimerId = 0;
+        drainPublishQueues();
+    } else if (m_batchTimers.contains(event->timerId())) {
+        flushBatch(m_batchTimers.value(event->timerId()));
+    } else if (event->timerId() == m_pendingWavesTimerId) {
+        expirePendingWaves();
+    } else {
+        AsyncInitObject::timerEvent(event);
+    }
+}
+
+int Transport::queuedMessages() const
+{
+    int count = 0;
+    for (int lane = ControlLane; lane < PublishLaneCount; ++lane) {
+        count += m_publishLanes[lane].count();
+    }
+
+    return count;
+}
+
+int Transport::inFlightMessages() const
+{
+    return m_inFlightIds.count();
+}
+
+quint64 Transport::throttledMessages() const
+{
+    return m_throttledMessages;
+}
+
+int Transport::pendingWaves() const
+{
+    return m_pendingWaves.count();
+}
+
+quint64 Transport::droppedWaves() const
+{
+    return m_droppedWaves;
+}
+
+void Transport::trackPendingWave(const Wave &wave)
+{
+    // When full, the oldest wave is the least likely to ever get its rebound
+    while (m_pendingWaves.count() >= m_pendingWavesLimit) {
+        QMap< quint64, PendingWave >::iterator oldest = m_pendingWaves.begin();
+        qDebug() << "Pending wave table is full, dropping wave" << oldest->wave.id();
+        m_pendingWaveArrivals.remove(oldest->wave.id());
+        m_pendingWaves.erase(oldest);
+        ++m_droppedWaves;
+    }
+
+    PendingWave pending;
+    pending.wave = wave;
+    pending.received = QDateTime::currentMSecsSinceEpoch();
+    m_pendingWaves.insert(m_waveArrivals, pending);
+    m_pendingWaveArrivals.insert(wave.id(), m_waveArrivals);
+    ++m_waveArrivals;
+
+    // Otherwise the timer is armed for an older wave already
+    if (!m_pendingWavesTimerId) {
+        m_pendingWavesTimerId = startTimer(m_pendingWaveTimeoutms);
+    }
+}
+
+bool Transport::takePendingWave(quint64 id, Wave *wave)
+{
+    QHash< quint64, quint64 >::iterator i = m_pendingWaveArrivals.find(id);
+    if (i == m_pendingWaveArrivals.end()) {
+        return false;
+    }
+
+    *wave = m_pendingWaves.take(i.value()).wave;
+    m_pendingWaveArrivals.erase(i);
+    return true;
+}
+
+void Transport::expirePendingWaves()
+{
+    // Arrival order is also age order
+    qint64 deadline = QDateTime::currentMSecsSinceEpoch() - m_pendingWaveTimeoutms;
+    while (!m_pendingWaves.isEmpty() && m_pendingWaves.begin()->received <= deadline) {
+        QMap< quint64, PendingWave >::iterator oldest = m_pendingWaves.begin();
+        qDebug() << "Wave" << oldest->wave.id() << "got no rebound in time, dropping it";
+        m_pendingWaveArrivals.remove(oldest->wave.id());
+        m_pendingWaves.erase(oldest);
+        ++m_droppedWaves;
+    }
+
+    // Armed again for the deadline of the oldest wave left, so none outlives the timeout by more than a tick
+    killTimer(m_pendingWavesTimerId);
+    m_pendingWavesTimerId = 0;
+    if (!m_pendingWaves.isEmpty()) {
+        qint64 delayms = m_pendingWaves.begin()->received + m_pendingWaveTimeoutms - QDateTime::currentMSecsSinceEpoch();
+        m_pendingWavesTimerId = startTimer(static_cast<int>(qBound(Q_INT64_C(0), delayms, Q_INT64_C(INT_MAX))));
     }
 }
 
@@ -381,11 +957,13 @@ void Transport::forceNewPairing()
     qWarning() << "Forcing new pairing";
 
     if (!m_mqttBroker.isNull()) {
+        flushBatches();
         m_mqttBroker.data()->disconnectFromBroker();
         m_mqttBroker.data()->deleteLater();
     }
     // Reset the cache
     TransportCache::instance()->resetInFlightEntries();
+    m_inFlightIds.clear();
 
     startPairing(true);
 }
@@ -396,14 +974,25 @@ void Transport::onStatusChanged(Astarte::MQTTClientWrapper::Status status)
         // We're connected, stop the reboot timer
         qDebug() << "Connected, stopping the reboot timer";
         m_rebootTimer->stop();
-        if (!m_mqttBroker.data()->sessionPresent() || !m_synced) {
+        if (!m_mqttBroker.data()->sessionPresent()) {
+            // Nothing we handed over before is going to be confirmed
+            m_inFlightIds.clear();
+        }
+        if (!m_synced) {
             // We're desynced
             bigBang();
+        } else if (!m_mqttBroker.data()->sessionPresent()) {
+            // The broker forgot about us, but it still has the properties we synced
+            synchronize(false);
         }
 
         // Resend the messages that failed to be published
+        drainPublishQueues();
         resendFailedMessages();
     } else {
+        // Batches can't go out now, hand them to the retry cache rather than sitting on them
+        flushBatches();
+
         // If we are in every other state, we start the reboot timer (if needed)
         if (m_rebootWhenConnectionFails && !m_rebootTimer->isActive()) {
             qDebug() << "Not connected state, restarting the reboot timer";
@@ -437,13 +1026,15 @@ void Transport::handleRebootTimerTimeout()
 void Transport::handleFailedPublish(const CacheMessage &cacheMessage)
 {
     qWarning() << "Can't publish for target" << cacheMessage.target();
-    if (cacheMessage.attributes().value("retention").toInt() == static_cast<int>(Discard)) {
+    if (cacheMessage.retention() == Discard) {
         // Prepare an error wave
         Wave w;
         w.setMethod(METHOD_ERROR);
         w.setTarget(cacheMessage.target());
         w.setPayload(cacheMessage.payload());
         qDebug() << "Sending error wave for Discard target " << w.target();
+        // Its target rebounds it like any other wave
+        trackPendingWave(w);
         routeWave(w, -1);
     } else {
         int id = TransportCache::instance()->addRetryEntry(cacheMessage);
@@ -451,57 +1042,111 @@ void Transport::handleFailedPublish(const CacheMessage &cacheMessage)
     }
 }
 
+void Transport::setSynced(bool synced)
+{
+    if (m_synced == synced) {
+        return;
+    }
+
+    m_synced = synced;
+    QSettings syncSettings(QString("%1/transportStatus.conf").arg(m_persistencyDir), QSettings::IniFormat);
+    syncSettings.setValue(QLatin1String("isSynced"), synced);
+}
+
 void Transport::bigBang()
 {
     qWarning() << "Received bigBang";
+    synchronize(true);
+}
 
-    QSettings syncSettings(QString("%1/transportStatus.conf").arg(m_persistencyDir), QSettings::IniFormat);
-    if (m_synced) {
-        m_synced = false;
-        syncSettings.setValue(QLatin1String("isSynced"), false);
-    }
+void Transport::synchronize(bool fullResync)
+{
+    setSynced(false);
 
     if (m_mqttBroker.isNull()) {
         qDebug() << "Can't send emptyCache request, broker is null";
         return;
     }
 
+    // Control messages still queued are superseded by the ones below, and so are the properties
+    // queued by an earlier sendProperties, which sends them again
+    m_publishLanes[ControlLane].clear();
+    QQueue< QueuedPublish > &propertiesLane = m_publishLanes[PropertiesLane];
+    for (QQueue< QueuedPublish >::iterator i = propertiesLane.begin(); i != propertiesLane.end();) {
+        if (i->resync) {
+            i = propertiesLane.erase(i);
+        } else {
+            ++i;
+        }
+    }
+    m_syncControlIds.clear();
+    m_pendingSyncControls = 0;
+
+    if (fullResync) {
+        // A new generation makes every property stale, so all of them are sent again
+        ++m_syncGeneration;
+        QSettings syncSettings(QString("%1/transportStatus.conf").arg(m_persistencyDir), QSettings::IniFormat);
+        syncSettings.setValue(QLatin1String("syncGeneration"), m_syncGeneration);
+        TransportCache::instance()->setSyncGeneration(m_syncGeneration);
+    }
+
     // We need to setup again the subscriptions, unless we have a persistent session on the other end.
     setupClientSubscriptions();
     // And publish the introspection.
     publishIntrospection();
 
-    int rc = m_mqttBroker.data()->publish(m_mqttBroker.data()->rootClientTopic() + "/control/emptyCache", "1", MQTTClientWrapper::ExactlyOnceQoS);
-    if (rc < 0) {
-        // We leave m_synced to false and we retry when we're back online
-        qWarning() << "Can't send emptyCache request, error " << rc;
-        return;
-    }
+    // Only a full resync asks the broker to drop its cache and to reconcile the producer
+    // properties, an incremental one relies on what the broker already holds
+    if (fullResync) {
+        // Control messages go through the control lane: they are published before any queued
+        // property, and properties before any queued datastream
+        int rc = publishControl(m_mqttBroker.data()->rootClientTopic() + "/control/emptyCache", "1", true);
+        if (rc < 0) {
+            // We leave m_synced to false and we retry when we're back online
+            qWarning() << "Can't send emptyCache request, error " << rc;
+            return;
+        }
 
-    QByteArray payload;
-    Q_FOREACH (const QByteArray &path, TransportCache::instance()->allPersistentEntries().keys()) {
-        // Remove leading slash
-        payload.append(path.mid(1));
-        payload.append(';');
-    }
-    // Remove trailing semicolon
-    payload.chop(1);
+        class PropertyPathsCollector : public TransportCache::PersistentEntryVisitor
+        {
+        public:
+            virtual void visitPersistentEntry(const QByteArray &target, const QByteArray &payload)
+            {
+                Q_UNUSED(payload);
+                // Remove leading slash
+                paths.append(target.constData() + 1, target.count() - 1);
+                paths.append(';');
+            }
 
-    qDebug() << "Producer property paths are: " << payload;
+            QByteArray paths;
+        };
 
-    rc = m_mqttBroker.data()->publish(m_mqttBroker.data()->rootClientTopic() + "/control/producer/properties", qCompress(payload), MQTTClientWrapper::ExactlyOnceQoS);
-    if (rc < 0) {
-        // We leave m_synced to false and we retry when we're back online
-        qWarning() << "Can't send producer properties list, error " << rc;
-        return;
+        PropertyPathsCollector collector;
+        TransportCache::instance()->visitPersistentEntries(&collector);
+        QByteArray payload = collector.paths;
+        // Remove trailing semicolon
+        payload.chop(1);
+
+        qDebug() << "Producer property paths are: " << payload;
+
+        rc = publishControl(m_mqttBroker.data()->rootClientTopic() + "/control/producer/properties", qCompress(payload), true);
+        if (rc < 0) {
+            // We leave m_synced to false and we retry when we're back online
+            qWarning() << "Can't send producer properties list, error " << rc;
+            return;
+        }
     }
 
-    // Send the cached properties
+    // Send the cached properties which are not in sync
     sendProperties();
 
-    // If we are here, the messages are in the hands of mosquitto
-    m_synced = true;
-    syncSettings.setValue(QLatin1String("isSynced"), true);
+    if (!fullResync) {
+        // No control message to wait for, the stale entries are queued in order
+        setSynced(true);
+        return;
+    }
+
+    // We are synced once the broker has confirmed both control messages, see onPublishConfirmed
 }
 
 void Transport::onPublishConfirmed(int messageId)
@@ -509,6 +1154,14 @@ void Transport::onPublishConfirmed(int messageId)
     qDebug() << "Message with id" << messageId << ": publish confirmed";
     CacheMessage cacheMessage = TransportCache::instance()->takeInFlightEntry(messageId);
 
+    if (m_inFlightIds.remove(messageId) && queuedMessages() > 0) {
+        drainPublishQueues();
+    }
+
+    if (m_syncControlIds.remove(messageId) && --m_pendingSyncControls == 0) {
+        setSynced(true);
+    }
+
     if (cacheMessage.interfaceType() == AstarteInterface::Properties) {
         if (cacheMessage.payload().isEmpty()) {
             TransportCache::instance()->removePersistentEntry(cacheMessage.target());
@@ -542,7 +1195,7 @@ void Transport::publishIntrospection()
 
     qDebug() << "Introspection is " << payload;
 
-    m_mqttBroker.data()->publish(m_mqttBroker.data()->rootClientTopic(), payload, MQTTClientWrapper::ExactlyOnceQoS);
+    publishControl(m_mqttBroker.data()->rootClientTopic(), payload);
 }
 
 QHash< QByteArray, AstarteInterface> Transport::introspection() const
@@ -553,6 +1206,11 @@ QHash< QByteArray, AstarteInterface> Transport::introspection() const
 
 void Transport::setIntrospection(const QHash< QByteArray, AstarteInterface> &introspection)
 {
+    if (isForeignThread()) {
+        m_transportThread->postIntrospection(introspection);
+        return;
+    }
+
     if (m_introspection != introspection) {
         m_introspection = introspection;
         emit introspectionChanged();
@@ -563,21 +1221,71 @@ void Transport::routeWave(const Wave &wave, int fd)
 {
     Q_UNUSED(fd)
 
-    QByteArray waveTarget = wave.target();
+    // Only views from here on: the wave keeps the bytes alive
+    const QByteArray waveTarget = wave.target();
     int targetIndex = waveTarget.indexOf('/', 1);
-    QByteArray interface = waveTarget.mid(1, targetIndex - 1);
-    QByteArray relativeTarget = waveTarget.right(waveTarget.length() - targetIndex);
+    if (targetIndex < 0) {
+        qWarning() << "Wave target" << waveTarget << "has no interface";
+        return;
+    }
+    const QByteArray interface = QByteArray::fromRawData(waveTarget.constData() + 1, targetIndex - 1);
 
     if (interface == "control") {
         qDebug() << "Received control wave, not implemented in SDK";
         return;
     }
 
-    Wave w;
-    w.setTarget(relativeTarget);
-    w.setPayload(wave.payload());
+    Wave w = wave;
+    w.removeTargetPrefix(targetIndex);
+
+    if (m_transportThread) {
+        // Targets live on the owner thread, which looks them up when draining its queue
+        m_transportThread->postWave(interface, w);
+    } else if (AbstractWaveTarget *target = m_waveTargets.value(interface)) {
+        target->handleReceivedWave(interface, w);
+    } else {
+        qDebug() << "No target for interface" << interface << ", dropping wave" << w.id();
+    }
 
     Q_EMIT waveReceived(interface, w);
 }
 
+void Transport::registerWaveTarget(const QByteArray &interface, AbstractWaveTarget *target)
+{
+    if (m_transportThread) {
+        m_transportThread->registerWaveTarget(interface, target);
+        return;
+    }
+
+    if (m_waveTargets.contains(interface)) {
+        qWarning() << "Interface" << interface << "already has a wave target, replacing it";
+    }
+
+    m_waveTargets.insert(interface, target);
+}
+
+void Transport::unregisterWaveTarget(const QByteArray &interface, AbstractWaveTarget *target)
+{
+    if (m_transportThread) {
+        m_transportThread->unregisterWaveTarget(interface, target);
+        return;
+    }
+
+    // Only if it was not replaced in the meantime
+    QHash< QByteArray, AbstractWaveTarget* >::iterator i = m_waveTargets.find(interface);
+    if (i != m_waveTargets.end() && i.value() == target) {
+        m_waveTargets.erase(i);
+    }
+}
+
+void Transport::setTransportThread(TransportThread *thread)
+{
+    m_transportThread = thread;
+}
+
+bool Transport::isForeignThread() const
+{
+    return m_transportThread && QThread::currentThread() != thread();
+}
+
 }
@@ -24,9 +24,15 @@
 #include <QtCore/QObject>
 
 #include <QtCore/QWeakPointer>
+#include <QtCore/QMap>
+#include <QtCore/QQueue>
 #include <QtCore/QSet>
 
 #include "astarteinterface.h"
+#include "cachemessage.h"
+#include "wave.h"
+
+#include "utils/bsonserializer.h"
 
 #include "utils/hemeraasyncinitobject.h"
 
@@ -36,14 +42,15 @@ namespace Astarte {
 class Endpoint;
 }
 
+class AbstractWaveTarget;
 class Fluctuation;
 class Rebound;
-class Wave;
 
 namespace Astarte {
 class MQTTClientWrapper;
 class CacheMessage;
 class Interface;
+class TransportThread;
 
 class Transport : public Hemera::AsyncInitObject
 {
@@ -57,15 +64,40 @@ public:
     virtual void rebound(const Rebound& rebound, int fd = -1);
     virtual void fluctuation(const Fluctuation& fluctuation);
     virtual void cacheMessage(const CacheMessage& cacheMessage);
+    // Publishes with a known QoS, topic caches rootClientTopic() + target across calls
+    void cacheMessage(const CacheMessage &cacheMessage, MQTTClientWrapper::MQTTQoS qos, QByteArray *topic);
     virtual void bigBang();
 
+    static MQTTClientWrapper::MQTTQoS publishQoS(AstarteInterface::Type interfaceType, Reliability reliability);
+
+    /// Inbound waves for interface are delivered straight to target, until it is unregistered
+    void registerWaveTarget(const QByteArray &interface, AbstractWaveTarget *target);
+    void unregisterWaveTarget(const QByteArray &interface, AbstractWaveTarget *target);
+
+    /// Calls from other threads go through thread's queues, and inbound waves are delivered by it
+    void setTransportThread(TransportThread *thread);
+
     QHash< QByteArray, AstarteInterface > introspection() const;
     void setIntrospection(const QHash< QByteArray, AstarteInterface > &introspection);
 
+    /// Messages waiting in the publish queues
+    int queuedMessages() const;
+    /// QoS 1 and 2 messages handed to the broker and not confirmed yet
+    int inFlightMessages() const;
+    /// Messages which had to wait in a publish queue since startup
+    quint64 throttledMessages() const;
+    /// Inbound waves waiting for their rebound
+    int pendingWaves() const;
+    /// Inbound waves dropped from the pending table, because it was full or they timed out, since startup
+    quint64 droppedWaves() const;
+
 Q_SIGNALS:
     void introspectionChanged();
     void waveReceived(const QByteArray &interface, const Wave &wave);
 
+protected:
+    virtual void timerEvent(QTimerEvent *event);
+
 protected Q_SLOTS:
     virtual void initImpl();
 
@@ -80,7 +112,7 @@ private Q_SLOTS:
     void resendFailedMessages();
     void publishIntrospection();
     void onStatusChanged(Astarte::MQTTClientWrapper::Status status);
-    void onMQTTMessageReceived(const QByteArray &topic, const QByteArray &payload);
+    void onMQTTMessageReceived(const QByteArray &message, int topicLength);
     void onPublishConfirmed(int messageId);
     void handleFailedPublish(const CacheMessage &cacheMessage);
     void handleConnectionFailed();
@@ -91,20 +123,119 @@ private Q_SLOTS:
     void onPairingFinished(Hemera::Operation *pOp);
     void onEndpointReady(Hemera::Operation *op);
 
+    void drainPublishQueues();
+    void flushBatches();
+
 private:
+    // Token bucket for a QoS class, a rate of 0 means unlimited
+    struct PublishBucket {
+        double rate;
+        double burst;
+        double tokens;
+        qint64 lastRefill;
+    };
+
+    // Publish lanes, in priority order. Queued messages are dequeued with weighted round robin,
+    // so fresh values are not stuck behind the backlog being replayed.
+    enum PublishLane {
+        ControlLane = 0,
+        PropertiesLane,
+        LiveLane,
+        ReplayLane,
+        PublishLaneCount
+    };
+
+    struct QueuedPublish {
+        QueuedPublish() : qos(MQTTClientWrapper::DefaultQoS), control(false), resync(false), syncControl(false) {}
+
+        CacheMessage message;
+        MQTTClientWrapper::MQTTQoS qos;
+        QByteArray topic;
+        // Control messages (introspection, emptyCache...) are not tracked by the cache
+        bool control;
+        // Sent again by sendProperties, superseded by the next synchronization
+        bool resync;
+        // Sent by synchronize, the device is in sync once all of them are confirmed
+        bool syncControl;
+    };
+
+    struct PendingWave {
+        Wave wave;
+        qint64 received;
+    };
+
+    // Datastream samples for a batched target, published together as a single document
+    struct PendingBatch {
+        Util::BSONSerializer serializer;
+        CacheMessage message;
+        MQTTClientWrapper::MQTTQoS qos;
+        QByteArray topic;
+        int count;
+        int timerId;
+    };
+
+    bool isBatched(const QByteArray &target) const;
+    bool isForeignThread() const;
+    void appendToBatch(const CacheMessage &cacheMessage, MQTTClientWrapper::MQTTQoS qos);
+    void flushBatch(const QByteArray &target);
+
+    bool canPublish(MQTTClientWrapper::MQTTQoS qos);
+    void publishCacheMessage(const CacheMessage &cacheMessage, MQTTClientWrapper::MQTTQoS qos, QByteArray *topic, PublishLane lane);
+    int publishControl(const QByteArray &topic, const QByteArray &payload, bool syncControl = false);
+    int enqueuePublish(const QueuedPublish &queued, PublishLane lane);
+    int publishNow(const QueuedPublish &queued);
+    void schedulePublishDrain();
+    void trackPendingWave(const Wave &wave);
+    bool takePendingWave(quint64 id, Wave *wave);
+    void expirePendingWaves();
+    void setSynced(bool synced);
+    void synchronize(bool fullResync);
+
     Astarte::Endpoint *m_astarteEndpoint;
     QWeakPointer<MQTTClientWrapper> m_mqttBroker;
-    QHash< quint64, Wave > m_waveStorage;
     QHash< quint64, QByteArray > m_commandTree;
     QHash< QByteArray, AstarteInterface > m_introspection;
+    QHash< QByteArray, AbstractWaveTarget* > m_waveTargets;
+    TransportThread *m_transportThread;
     QString m_configurationPath;
     QByteArray m_hardwareId;
     QString m_persistencyDir;
     QTimer *m_rebootTimer;
     bool m_synced;
+    qint64 m_syncGeneration;
     bool m_rebootWhenConnectionFails;
     int m_rebootDelayMinutes;
+    MQTTClientWrapper::LoopMode m_mqttLoopMode;
     bool m_isPairingForced;
+
+    PublishBucket m_publishBuckets[3];
+    QQueue< QueuedPublish > m_publishLanes[PublishLaneCount];
+    int m_laneWeights[PublishLaneCount];
+    int m_laneCredits[PublishLaneCount];
+    int m_currentLane;
+    QSet< int > m_inFlightIds;
+    QSet< int > m_syncControlIds;
+    int m_pendingSyncControls;
+    int m_maxInFlightMessages;
+    int m_retryDrainBatchSize;
+    bool m_retryDrainPending;
+    int m_publishTimerId;
+    quint64 m_throttledMessages;
+
+    QSet< QByteArray > m_batchedTargets;
+    QHash< QByteArray, PendingBatch > m_pendingBatches;
+    QHash< int, QByteArray > m_batchTimers;
+    int m_batchWindowms;
+    int m_batchMaxBytes;
+
+    // Inbound waves waiting for their rebound, by arrival. Bounded in count and time.
+    QMap< quint64, PendingWave > m_pendingWaves;
+    QHash< quint64, quint64 > m_pendingWaveArrivals;
+    quint64 m_waveArrivals;
+    int m_pendingWavesLimit;
+    int m_pendingWaveTimeoutms;
+    int m_pendingWavesTimerId;
+    quint64 m_droppedWaves;
 };
 }
 
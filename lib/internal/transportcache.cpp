@@ -20,27 +20,135 @@
 
 #include <QtCore/QDebug>
 #include <QtCore/QDir>
+#include <QtCore/QFile>
+#include <QtCore/QMap>
+#include <QtCore/QPair>
+#include <QtCore/QSet>
 #include <QtCore/QTimerEvent>
+#include <QtCore/QtEndian>
 
 #include "astarteinterface.h"
-#include "utils/transportdatabasemanager.h"
+#include "persistenceworker.h"
 
 #include "producerabstractinterface.h"
 
+#include <limits.h>
+
+#define REPLAY_PAGE_SIZE 500
+#define EXPIRY_SWEEP_BATCH 256
+// Expired messages on disk, which are not in memory yet, are deleted this often
+#define STORED_EXPIRY_SWEEP_INTERVAL_MS (10 * 60 * 1000)
+// Rough bookkeeping cost of a retry entry besides its target and payload
+#define RETRY_ENTRY_OVERHEAD 128
+
 namespace Astarte {
 
+struct PersistentEntry {
+    QByteArray payload;
+    qint64 syncGeneration;
+};
+
 class TransportCache::Private
 {
 public:
-    QHash< QByteArray, QByteArray > persistentEntries;
+    QHash< QByteArray, PersistentEntry > persistentEntries;
+    qint64 syncGeneration;
     QHash< int, CacheMessage> inFlightEntries;
     QHash< int, CacheMessage > retryEntries;
-    QHash< int, int > retryTimerToId;
     int retryIdCounter;
+    // Retry ids in replay order: by original timestamp, then by id
+    QMap< QPair< qint64, int >, int > retryOrder;
+    // Only entries which are not in the database count, the others can always be reloaded
+    qint64 retryMemory;
+
+    // Retry entries beyond the memory budget: length prefixed serialized messages, appended at the end
+    // and read back from spillReadOffset
+    QFile spillFile;
+    qint64 spillReadOffset;
+    int spillCount;
+    quint64 spilledTotal;
+    quint64 droppedTotal;
+
+    // Retry entries with an expiry, ordered by absolute expiry (msecs since epoch).
+    // A single timer is armed for the earliest one.
+    QMultiMap< qint64, int > expiryQueue;
+    QHash< int, qint64 > retryExpiry;
+    int expiryTimerId;
+    int storedExpiryTimerId;
+
+    // Every database access goes through the worker thread
+    PersistenceWorker *worker;
+    bool batchOpen;
+    int batchTimerId;
+    int pendingWrites;
+    // Cache message ids are handed out here, so inserts need not be waited for
+    qint64 nextCacheMessageId;
+    // Persistent entries whose row failed to be written, rewritten from scratch the next time
+    QSet< QByteArray > unpersistedTargets;
+
+    // Stored messages found in the database at startup are replayed in pages,
+    // replayCursor is the last database id loaded in memory.
+    qint64 replayCursor;
+    qint64 replayLastId;
+    // Retry ids of the last replay page still waiting to be sent
+    QSet< int > replayPageIds;
 
     Private()
     {
+        syncGeneration = 0;
         retryIdCounter = 0;
+        retryMemory = 0;
+        spillReadOffset = 0;
+        spillCount = 0;
+        spilledTotal = 0;
+        droppedTotal = 0;
+        expiryTimerId = 0;
+        storedExpiryTimerId = 0;
+        worker = 0;
+        batchOpen = false;
+        batchTimerId = 0;
+        pendingWrites = 0;
+        nextCacheMessageId = 1;
+        replayCursor = 0;
+        replayLastId = 0;
+    }
+
+    ~Private()
+    {
+        delete worker;
+    }
+
+    static qint64 entrySize(const CacheMessage &message)
+    {
+        return message.target().size() + message.payload().size() + RETRY_ENTRY_OVERHEAD;
+    }
+
+    int insertRetryEntry(const CacheMessage &message)
+    {
+        int id = retryIdCounter++;
+        retryEntries.insert(id, message);
+        retryOrder.insert(qMakePair(message.timestamp(), id), id);
+        if (message.dbId() <= 0) {
+            retryMemory += entrySize(message);
+        }
+        return id;
+    }
+
+    CacheMessage takeRetryEntry(int id)
+    {
+        QHash< int, CacheMessage >::iterator i = retryEntries.find(id);
+        if (i == retryEntries.end()) {
+            return CacheMessage();
+        }
+
+        CacheMessage message = i.value();
+        retryEntries.erase(i);
+        replayPageIds.remove(id);
+        retryOrder.remove(qMakePair(message.timestamp(), id));
+        if (message.dbId() <= 0) {
+            retryMemory -= entrySize(message);
+        }
+        return message;
     }
 };
 
@@ -48,6 +156,12 @@ static TransportCache* s_instance;
 
 static QString s_persistencyDir;
 
+static int s_maxBatchSize = 1;
+static int s_durabilityWindowMs = 0;
+
+static qint64 s_retryMemoryBudget = 0;
+static TransportCache::RetryOverflowPolicy s_retryOverflowPolicy = TransportCache::SpillRetryEntries;
+
 TransportCache::TransportCache(QObject *parent)
     : Hemera::AsyncInitObject(parent)
     , m_dbOk(false)
@@ -66,6 +180,7 @@ TransportCache *TransportCache::instance()
 
 TransportCache::~TransportCache()
 {
+    flushDatabaseWrites();
     delete d;
 }
 
@@ -73,11 +188,25 @@ void TransportCache::initImpl()
 {
     if (ensureDatabase()) {
 
-        d->persistentEntries = TransportDatabaseManager::Transactions::allPersistentEntries();
-        QList<CacheMessage> dbMessages = TransportDatabaseManager::Transactions::allCacheMessages();
-        Q_FOREACH (const CacheMessage &message, dbMessages) {
-           d->retryEntries.insert(d->retryIdCounter++, message);
+        QHash< QByteArray, qint64 > syncGenerations;
+        QHash< QByteArray, QByteArray > persistentEntries = d->worker->allPersistentEntries(&syncGenerations);
+        d->persistentEntries.reserve(persistentEntries.count());
+        for (QHash< QByteArray, QByteArray >::const_iterator i = persistentEntries.constBegin(); i != persistentEntries.constEnd(); ++i) {
+            PersistentEntry entry;
+            entry.payload = i.value();
+            entry.syncGeneration = syncGenerations.value(i.key());
+            d->persistentEntries.insert(i.key(), entry);
         }
+
+        // Housekeeping: drop expired messages, then replay only what was stored until now.
+        // Anything inserted from now on is tracked in memory already. The worker goes through
+        // its jobs in order, so the last id is read once the expired messages are gone.
+        d->worker->deleteExpiredCacheMessages(EXPIRY_SWEEP_BATCH);
+        d->storedExpiryTimerId = startTimer(STORED_EXPIRY_SWEEP_INTERVAL_MS);
+        d->replayLastId = d->worker->lastCacheMessageId();
+        d->nextCacheMessageId = d->replayLastId + 1;
+        loadReplayPage();
+
         setReady();
     } else {
         setInitError("Hemera::Literals::literal(Hemera::Literals::Errors::failedRequest())", QLatin1String("Could not open the persistence database"));
@@ -89,30 +218,137 @@ void TransportCache::setPersistencyDir(const QString &persistencyDir)
     s_persistencyDir = persistencyDir;
 }
 
+void TransportCache::setWriteBatching(int maxBatchSize, int durabilityWindowMs)
+{
+    s_maxBatchSize = qMax(1, maxBatchSize);
+    s_durabilityWindowMs = qMax(0, durabilityWindowMs);
+}
+
+void TransportCache::setRetryMemoryBudget(qint64 bytes, RetryOverflowPolicy policy)
+{
+    s_retryMemoryBudget = qMax(Q_INT64_C(0), bytes);
+    s_retryOverflowPolicy = policy;
+}
+
 bool TransportCache::ensureDatabase()
 {
     if (!m_dbOk) {
-        m_dbOk = TransportDatabaseManager::ensureDatabase(QString("%1/persistence.db").arg(s_persistencyDir),
-                                                          QString("%1/db/migrations").arg(QLatin1String("/usr/share/astarte-sdk")));
+        if (!d->worker) {
+            d->worker = new PersistenceWorker(QString("%1/persistence.db").arg(s_persistencyDir),
+                                              QString("%1/db/migrations").arg(QLatin1String("/usr/share/astarte-sdk")));
+            // Emitted from the worker thread, hence queued
+            connect(d->worker, SIGNAL(cacheMessageWriteFailed(qint64)), this, SLOT(onCacheMessageWriteFailed(qint64)));
+            connect(d->worker, SIGNAL(persistentEntryWriteFailed(QByteArray)), this, SLOT(onPersistentEntryWriteFailed(QByteArray)));
+            d->worker->start();
+        }
+        m_dbOk = d->worker->ensureDatabase();
     }
     return m_dbOk;
 }
 
+void TransportCache::beginDatabaseWrite()
+{
+    if (ensureDatabase() && !d->batchOpen && s_durabilityWindowMs > 0 && s_maxBatchSize > 1) {
+        d->worker->beginBatch();
+        d->batchOpen = true;
+    }
+}
+
+void TransportCache::endDatabaseWrite()
+{
+    if (!d->batchOpen || s_durabilityWindowMs <= 0 || s_maxBatchSize <= 1) {
+        return;
+    }
+
+    if (++d->pendingWrites >= s_maxBatchSize) {
+        flushDatabaseWrites();
+    } else if (!d->batchTimerId) {
+        d->batchTimerId = startTimer(s_durabilityWindowMs);
+    }
+}
+
+void TransportCache::flushDatabaseWrites()
+{
+    if (d->batchTimerId) {
+        killTimer(d->batchTimerId);
+        d->batchTimerId = 0;
+    }
+
+    d->pendingWrites = 0;
+    if (d->batchOpen) {
+        d->batchOpen = false;
+        connect(d->worker->commitBatch(), SIGNAL(finished(Hemera::Operation*)), this, SLOT(onDatabaseWritesFlushed(Hemera::Operation*)));
+    }
+}
+
+void TransportCache::onDatabaseWritesFlushed(Hemera::Operation *operation)
+{
+    if (operation->isError()) {
+        qWarning() << "Database write batch failed:" << operation->errorMessage();
+    }
+}
+
+void TransportCache::onCacheMessageWriteFailed(qint64 dbId)
+{
+    // The message is only in memory from now on: dropping it from there would lose it
+    qWarning() << "Could not store cache message" << dbId << ", keeping it in memory only";
+
+    for (QHash< int, CacheMessage >::iterator i = d->inFlightEntries.begin(); i != d->inFlightEntries.end(); ++i) {
+        if (i->dbId() == dbId) {
+            i->setDbId(0);
+        }
+    }
+    for (QHash< int, CacheMessage >::iterator i = d->retryEntries.begin(); i != d->retryEntries.end(); ++i) {
+        if (i->dbId() == dbId) {
+            i->setDbId(0);
+            // It counts against the budget from now on
+            d->retryMemory += Private::entrySize(*i);
+        }
+    }
+}
+
+void TransportCache::onPersistentEntryWriteFailed(const QByteArray &target)
+{
+    qWarning() << "Could not store persistent entry" << target << ", it will be rewritten with its next change";
+    d->unpersistedTargets.insert(target);
+}
+
 void TransportCache::insertOrUpdatePersistentEntry(const QByteArray &target, const QByteArray &payload)
 {
-    ensureDatabase();
-    if (d->persistentEntries.contains(target)) {
-        TransportDatabaseManager::Transactions::updatePersistentEntry(target, payload);
-    } else {
-        TransportDatabaseManager::Transactions::insertPersistentEntry(target, payload);
+    QHash< QByteArray, PersistentEntry >::iterator i = d->persistentEntries.find(target);
+    bool rewrite = d->unpersistedTargets.remove(target);
+    if (!rewrite && i != d->persistentEntries.end() && i->payload == payload && i->syncGeneration == d->syncGeneration) {
+        // Nothing to write
+        return;
+    }
+
+    beginDatabaseWrite();
+    if (i == d->persistentEntries.end() || rewrite) {
+        if (m_dbOk) {
+            if (rewrite) {
+                // Whatever the row holds, if anything, is not to be trusted
+                d->worker->deletePersistentEntry(target);
+            }
+            d->worker->insertPersistentEntry(target, payload, d->syncGeneration);
+        }
+        if (i == d->persistentEntries.end()) {
+            i = d->persistentEntries.insert(target, PersistentEntry());
+        }
+    } else if (m_dbOk) {
+        d->worker->updatePersistentEntry(target, payload, d->syncGeneration);
     }
-    d->persistentEntries.insert(target, payload);
+    endDatabaseWrite();
+    i->payload = payload;
+    i->syncGeneration = d->syncGeneration;
 }
 
 void TransportCache::removePersistentEntry(const QByteArray &target)
 {
-    ensureDatabase();
-    TransportDatabaseManager::Transactions::deletePersistentEntry(target);
+    beginDatabaseWrite();
+    if (m_dbOk) {
+        d->worker->deletePersistentEntry(target);
+    }
+    endDatabaseWrite();
     d->persistentEntries.remove(target);
 }
 
@@ -123,23 +359,59 @@ bool TransportCache::isCached(const QByteArray &target) const
 
 QByteArray TransportCache::persistentEntry(const QByteArray &target) const
 {
-    return d->persistentEntries.value(target);
+    QHash< QByteArray, PersistentEntry >::const_iterator i = d->persistentEntries.constFind(target);
+    return i != d->persistentEntries.constEnd() ? i->payload : QByteArray();
+}
+
+bool TransportCache::persistentEntryEquals(const QByteArray &target, const QByteArray &payload) const
+{
+    QHash< QByteArray, PersistentEntry >::const_iterator i = d->persistentEntries.constFind(target);
+    return i != d->persistentEntries.constEnd() && i->payload == payload;
 }
 
 QHash< QByteArray, QByteArray > TransportCache::allPersistentEntries() const
 {
-    return d->persistentEntries;
+    QHash< QByteArray, QByteArray > entries;
+    entries.reserve(d->persistentEntries.count());
+    for (QHash< QByteArray, PersistentEntry >::const_iterator i = d->persistentEntries.constBegin(); i != d->persistentEntries.constEnd(); ++i) {
+        entries.insert(i.key(), i->payload);
+    }
+
+    return entries;
+}
+
+int TransportCache::persistentEntriesCount() const
+{
+    return d->persistentEntries.count();
+}
+
+void TransportCache::visitPersistentEntries(PersistentEntryVisitor *visitor, bool staleOnly) const
+{
+    for (QHash< QByteArray, PersistentEntry >::const_iterator i = d->persistentEntries.constBegin(); i != d->persistentEntries.constEnd(); ++i) {
+        if (!staleOnly || i->syncGeneration < d->syncGeneration) {
+            visitor->visitPersistentEntry(i.key(), i->payload);
+        }
+    }
+}
+
+qint64 TransportCache::syncGeneration() const
+{
+    return d->syncGeneration;
+}
+
+void TransportCache::setSyncGeneration(qint64 syncGeneration)
+{
+    d->syncGeneration = syncGeneration;
 }
 
 void TransportCache::addInFlightEntry(int messageId, CacheMessage message)
 {
-    if (message.attributes().value("retention").toInt() == static_cast<int>(Discard)) {
+    if (message.retention() == Discard) {
         // QoS 0, discard it
         return;
     }
 
-    if (message.interfaceType() == AstarteInterface::Properties ||
-        message.attributes().value("retention").toInt() == static_cast<int>(Stored)) {
+    if (message.interfaceType() == AstarteInterface::Properties || message.retention() == Stored) {
 
         insertIntoDatabaseIfNotPresent(message);
     }
@@ -162,89 +434,356 @@ void TransportCache::resetInFlightEntries()
 
 void TransportCache::insertIntoDatabaseIfNotPresent(CacheMessage &message)
 {
-    if (!message.hasAttribute("dbId")) {
+    if (message.dbId() <= 0) {
         // We have to insert it in the db
 
-        ensureDatabase();
         QDateTime absoluteExpiry;
         // Check if we don't have an absolute expiry
-        if (!message.hasAttribute("absoluteExpiry")) {
+        if (message.absoluteExpiry() <= 0) {
             // If we actually have an expiry, convert it to an absolute one
-            if (message.hasAttribute("expiry")) {
-                int relativeExpiry = message.attribute("expiry").toInt();
-                if (relativeExpiry > 0) {
-                    absoluteExpiry = QDateTime::currentDateTime().addSecs(relativeExpiry);
-                    message.addAttribute("absoluteExpiry", QByteArray::number(absoluteExpiry.toMSecsSinceEpoch()));
-                    message.removeAttribute("expiry");
-                }
+            if (message.expiry() > 0) {
+                absoluteExpiry = QDateTime::currentDateTime().addSecs(message.expiry());
+                message.setAbsoluteExpiry(absoluteExpiry.toMSecsSinceEpoch());
+                message.setExpiry(0);
             }
         } else {
-            absoluteExpiry = QDateTime::fromMSecsSinceEpoch(message.attribute("absoluteExpiry").toLongLong());
+            absoluteExpiry = QDateTime::fromMSecsSinceEpoch(message.absoluteExpiry());
         }
 
-        int dbId = TransportDatabaseManager::Transactions::insertCacheMessage(message, absoluteExpiry);
-        message.addAttribute("dbId", QByteArray::number(dbId));
+        beginDatabaseWrite();
+        if (m_dbOk) {
+            message.setDbId(d->nextCacheMessageId++);
+            d->worker->insertCacheMessage(message, absoluteExpiry);
+        }
+        endDatabaseWrite();
     }
 }
 
 int TransportCache::addRetryEntry(CacheMessage message)
 {
-    if (message.attributes().value("retention").toInt() == static_cast<int>(Discard)) {
+    if (message.retention() == Discard) {
         // QoS 0, discard it
         return -1;
     }
-    if (message.interfaceType() == AstarteInterface::Properties ||
-        message.attributes().value("retention").toInt() == static_cast<int>(Stored)) {
+    if (message.interfaceType() == AstarteInterface::Properties || message.retention() == Stored) {
 
         insertIntoDatabaseIfNotPresent(message);
     }
-    int id = d->retryIdCounter++;
-    d->retryEntries.insert(id, message);
 
-    int relativeExpiryms = 0;
-    if (message.hasAttribute("absoluteExpiry")) {
-        QDateTime absoluteExpiry = QDateTime::fromMSecsSinceEpoch(message.attribute("absoluteExpiry").toLongLong());
-        relativeExpiryms = QDateTime::currentDateTime().msecsTo(absoluteExpiry);
-    } else if (message.hasAttribute("expiry")) {
-        relativeExpiryms = message.attribute("expiry").toInt() * 1000;
-    }
-    if (relativeExpiryms > 0) {
-        int timerId = startTimer(relativeExpiryms);
-        d->retryTimerToId.insert(timerId, id);
+    // Messages in the database can always be dropped from memory and reloaded, the budget is for the others
+    if (message.dbId() <= 0 && s_retryMemoryBudget > 0) {
+        qint64 size = Private::entrySize(message);
+        if (s_retryOverflowPolicy == SpillRetryEntries) {
+            // Once something is on disk, newer messages follow it there to keep the replay order
+            if ((d->spillCount > 0 || d->retryMemory + size > s_retryMemoryBudget) && spillRetryEntry(message)) {
+                return -1;
+            }
+        }
+
+        if (d->retryMemory + size > s_retryMemoryBudget && !dropOldestRetryEntries(size)) {
+            qWarning() << "Retry cache is full, dropping message for" << message.target();
+            ++d->droppedTotal;
+            return -1;
+        }
     }
 
+    int id = d->insertRetryEntry(message);
+    scheduleExpiry(id, message);
+
     return id;
 }
 
+bool TransportCache::spillRetryEntry(CacheMessage message)
+{
+    if (!d->spillFile.isOpen()) {
+        // Spilled messages are volatile, whatever a previous run left is stale
+        d->spillFile.setFileName(QString("%1/retry-spill.seg").arg(s_persistencyDir));
+        if (!d->spillFile.open(QIODevice::ReadWrite | QIODevice::Truncate)) {
+            qWarning() << "Could not open" << d->spillFile.fileName() << ", can't spill retry entries";
+            return false;
+        }
+    }
+
+    // Keep the deadline across the round trip to disk
+    if (message.absoluteExpiry() <= 0 && message.expiry() > 0) {
+        message.setAbsoluteExpiry(QDateTime::currentMSecsSinceEpoch() + message.expiry() * 1000LL);
+        message.setExpiry(0);
+    }
+
+    QByteArray record = message.serialize();
+    uchar header[4];
+    qToLittleEndian<quint32>(record.size(), header);
+
+    d->spillFile.seek(d->spillFile.size());
+    if (d->spillFile.write(reinterpret_cast<const char *>(header), sizeof(header)) != sizeof(header)
+            || d->spillFile.write(record) != record.size()) {
+        qWarning() << "Could not spill retry entry for" << message.target() << d->spillFile.errorString();
+        return false;
+    }
+
+    ++d->spillCount;
+    ++d->spilledTotal;
+    return true;
+}
+
+bool TransportCache::dropOldestRetryEntries(qint64 bytes)
+{
+    QList< int > victims;
+    qint64 freed = 0;
+    for (QMap< QPair< qint64, int >, int >::const_iterator i = d->retryOrder.constBegin();
+         i != d->retryOrder.constEnd() && d->retryMemory - freed + bytes > s_retryMemoryBudget; ++i) {
+        const CacheMessage &message = d->retryEntries[i.value()];
+        if (message.dbId() <= 0) {
+            victims.append(i.value());
+            freed += Private::entrySize(message);
+        }
+    }
+
+    if (d->retryMemory - freed + bytes > s_retryMemoryBudget) {
+        return false;
+    }
+
+    Q_FOREACH (int id, victims) {
+        qDebug() << "Retry cache is full, dropping oldest message for" << d->retryEntries.value(id).target();
+        removeRetryEntry(id);
+        ++d->droppedTotal;
+    }
+
+    return true;
+}
+
+void TransportCache::resetSpill()
+{
+    d->spillFile.resize(0);
+    d->spillReadOffset = 0;
+    d->spillCount = 0;
+}
+
+qint64 TransportCache::retryMemoryUsage() const
+{
+    return d->retryMemory;
+}
+
+int TransportCache::pendingSpilledRetryEntries() const
+{
+    return d->spillCount;
+}
+
+int TransportCache::loadSpilledRetryEntries()
+{
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    int loaded = 0;
+    bool truncated = false;
+    while (d->spillCount > 0 && loaded < REPLAY_PAGE_SIZE && (s_retryMemoryBudget <= 0 || d->retryMemory < s_retryMemoryBudget)) {
+        uchar header[4];
+        if (!d->spillFile.seek(d->spillReadOffset)
+            || d->spillFile.read(reinterpret_cast<char *>(header), sizeof(header)) != sizeof(header)) {
+            truncated = true;
+            break;
+        }
+        quint32 size = qFromLittleEndian<quint32>(header);
+        QByteArray record = d->spillFile.read(size);
+        if (static_cast<quint32>(record.size()) != size) {
+            truncated = true;
+            break;
+        }
+
+        d->spillReadOffset += sizeof(header) + size;
+        --d->spillCount;
+
+        CacheMessage message = CacheMessage::fromBinary(record);
+        if (message.absoluteExpiry() > 0 && message.absoluteExpiry() <= now) {
+            // Expired while on disk
+            continue;
+        }
+
+        int id = d->insertRetryEntry(message);
+        scheduleExpiry(id, message);
+        ++loaded;
+    }
+
+    // Whatever the reason of a short read, what follows can't be trusted: retrying would only spin
+    if (d->spillCount > 0 && (truncated || d->spillReadOffset >= d->spillFile.size())) {
+        qWarning() << "Retry spill file is truncated, dropping" << d->spillCount << "entries";
+        d->droppedTotal += d->spillCount;
+        d->spillCount = 0;
+    }
+    if (d->spillCount == 0 && d->spillFile.isOpen()) {
+        resetSpill();
+    }
+
+    return loaded;
+}
+
+quint64 TransportCache::spilledRetryEntries() const
+{
+    return d->spilledTotal;
+}
+
+quint64 TransportCache::droppedRetryEntries() const
+{
+    return d->droppedTotal;
+}
+
 void TransportCache::removeRetryEntry(int id)
 {
-    removeFromDatabase(d->retryEntries.value(id));
-    d->retryEntries.remove(id);
+    unscheduleExpiry(id);
+    removeFromDatabase(d->takeRetryEntry(id));
 }
 
 CacheMessage TransportCache::takeRetryEntry(int id)
 {
-    return d->retryEntries.take(id);
+    unscheduleExpiry(id);
+    return d->takeRetryEntry(id);
+}
+
+void TransportCache::scheduleExpiry(int id, const CacheMessage &message)
+{
+    qint64 absoluteExpiryms = message.absoluteExpiry();
+    if (absoluteExpiryms <= 0 && message.expiry() > 0) {
+        absoluteExpiryms = QDateTime::currentMSecsSinceEpoch() + message.expiry() * 1000LL;
+    }
+
+    if (absoluteExpiryms <= 0) {
+        return;
+    }
+
+    d->expiryQueue.insert(absoluteExpiryms, id);
+    d->retryExpiry.insert(id, absoluteExpiryms);
+
+    // Rearm only if this is the new earliest expiry
+    if (d->expiryQueue.constBegin().key() == absoluteExpiryms) {
+        rescheduleExpirySweep();
+    }
+}
+
+void TransportCache::unscheduleExpiry(int id)
+{
+    if (d->retryExpiry.contains(id)) {
+        d->expiryQueue.remove(d->retryExpiry.take(id), id);
+    }
+}
+
+void TransportCache::rescheduleExpirySweep()
+{
+    if (d->expiryTimerId) {
+        killTimer(d->expiryTimerId);
+        d->expiryTimerId = 0;
+    }
+
+    if (d->expiryQueue.isEmpty()) {
+        return;
+    }
+
+    qint64 delayms = d->expiryQueue.constBegin().key() - QDateTime::currentMSecsSinceEpoch();
+    d->expiryTimerId = startTimer(static_cast<int>(qBound(Q_INT64_C(0), delayms, Q_INT64_C(INT_MAX))));
+}
+
+void TransportCache::sweepExpiredEntries()
+{
+    // Delete at most EXPIRY_SWEEP_BATCH entries per round, in a single transaction
+    bool ownBatch = !d->batchOpen && ensureDatabase();
+    if (ownBatch) {
+        d->worker->beginBatch();
+        d->batchOpen = true;
+    }
+
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    int swept = 0;
+    while (!d->expiryQueue.isEmpty() && d->expiryQueue.constBegin().key() <= now && swept < EXPIRY_SWEEP_BATCH) {
+        removeRetryEntry(d->expiryQueue.constBegin().value());
+        ++swept;
+    }
+
+    if (ownBatch) {
+        flushDatabaseWrites();
+    }
+
+    // If anything expired is left, this fires again right away from the event loop
+    rescheduleExpirySweep();
 }
 
 QList< int > TransportCache::allRetryIds() const
 {
-    return d->retryEntries.keys();
+    return d->retryOrder.values();
+}
+
+QList< int > TransportCache::retryIds(int max) const
+{
+    QList< int > ids;
+    for (QMap< QPair< qint64, int >, int >::const_iterator i = d->retryOrder.constBegin(); i != d->retryOrder.constEnd() && ids.count() < max; ++i) {
+        ids.append(i.value());
+    }
+
+    return ids;
+}
+
+int TransportCache::retryEntriesCount() const
+{
+    return d->retryEntries.count();
+}
+
+bool TransportCache::hasPendingReplay() const
+{
+    return d->replayCursor < d->replayLastId;
+}
+
+bool TransportCache::isReplayPageDrained() const
+{
+    return d->replayPageIds.isEmpty();
+}
+
+int TransportCache::loadReplayPage()
+{
+    if (!hasPendingReplay()) {
+        return 0;
+    }
+
+    QList<CacheMessage> page = d->worker->cacheMessagesPage(d->replayCursor, d->replayLastId, REPLAY_PAGE_SIZE);
+    if (page.isEmpty()) {
+        d->replayCursor = d->replayLastId;
+        return 0;
+    }
+
+    Q_FOREACH (const CacheMessage &message, page) {
+        int id = d->insertRetryEntry(message);
+        d->replayPageIds.insert(id);
+        scheduleExpiry(id, message);
+    }
+    d->replayCursor = page.last().dbId();
+
+    return page.count();
+}
+
+void TransportCache::persistMessage(CacheMessage &message)
+{
+    if (message.retention() == Discard) {
+        return;
+    }
+
+    if (message.interfaceType() == AstarteInterface::Properties || message.retention() == Stored) {
+        insertIntoDatabaseIfNotPresent(message);
+    }
 }
 
 void TransportCache::removeFromDatabase(const CacheMessage &message)
 {
-    if (message.hasAttribute("dbId")) {
-        ensureDatabase();
-        TransportDatabaseManager::Transactions::deleteCacheMessage(message.attribute("dbId").toInt());
+    if (message.dbId() > 0) {
+        // Queued, confirmations do not wait for the database
+        beginDatabaseWrite();
+        d->worker->deleteCacheMessage(message.dbId());
+        endDatabaseWrite();
     }
 }
 
 void TransportCache::timerEvent(QTimerEvent *event)
 {
-    if (d->retryTimerToId.contains(event->timerId())) {
-        int messageId = d->retryTimerToId.take(event->timerId());
-        removeRetryEntry(messageId);
+    if (event->timerId() == d->batchTimerId) {
+        flushDatabaseWrites();
+    } else if (event->timerId() == d->expiryTimerId) {
+        sweepExpiredEntries();
+    } else if (event->timerId() == d->storedExpiryTimerId) {
+        d->worker->deleteExpiredCacheMessages(EXPIRY_SWEEP_BATCH);
     }
 }
 
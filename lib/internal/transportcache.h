@@ -23,6 +23,10 @@
 
 #include "cachemessage.h"
 
+namespace Hemera {
+class Operation;
+}
+
 namespace Astarte {
 
 class TransportCache : public Hemera::AsyncInitObject
@@ -31,18 +35,49 @@ class TransportCache : public Hemera::AsyncInitObject
     Q_DISABLE_COPY(TransportCache)
 
 public:
+    class PersistentEntryVisitor
+    {
+    public:
+        virtual ~PersistentEntryVisitor() {}
+        virtual void visitPersistentEntry(const QByteArray &target, const QByteArray &payload) = 0;
+    };
+
+    enum RetryOverflowPolicy {
+        SpillRetryEntries,
+        DropOldestRetryEntries
+    };
+
     static TransportCache *instance();
 
     static void setPersistencyDir(const QString &persistencyDir);
+    /// Groups database writes in transactions of at most maxBatchSize statements, committed
+    /// at most durabilityWindowMs after the first pending write. A window of 0 disables batching.
+    static void setWriteBatching(int maxBatchSize, int durabilityWindowMs);
+    /// Bounds the memory used by retry entries which are not in the database (e.g. volatile datastreams).
+    /// Beyond it they are spilled to an append-only file, or the oldest are dropped. 0 means unbounded.
+    static void setRetryMemoryBudget(qint64 bytes, RetryOverflowPolicy policy);
 
     virtual ~TransportCache();
 
+    /// Walks the persistent entries in place, or only the stale ones. The visitor must not modify the cache.
+    void visitPersistentEntries(PersistentEntryVisitor *visitor, bool staleOnly = false) const;
+
 public Q_SLOTS:
     void insertOrUpdatePersistentEntry(const QByteArray &target, const QByteArray &payload);
     void removePersistentEntry(const QByteArray &target);
 
     QByteArray persistentEntry(const QByteArray &target) const;
+    /// A copy of every entry, prefer visitPersistentEntries on hot paths
     QHash< QByteArray, QByteArray > allPersistentEntries() const;
+    int persistentEntriesCount() const;
+
+    /// Single lookup for "is target cached with exactly this payload"
+    bool persistentEntryEquals(const QByteArray &target, const QByteArray &payload) const;
+
+    // Entries are stamped with the current sync generation when the broker confirms them.
+    // Bumping the generation makes every entry stale, i.e. to be sent again.
+    qint64 syncGeneration() const;
+    void setSyncGeneration(qint64 syncGeneration);
 
     bool isCached(const QByteArray &target) const;
 
@@ -55,21 +90,58 @@ public Q_SLOTS:
 
     Astarte::CacheMessage takeRetryEntry(int id);
     QList<int> allRetryIds() const;
-
+    QList<int> retryIds(int max) const;
+    int retryEntriesCount() const;
+
+    bool hasPendingReplay() const;
+    /// Whether every message of the last replay page has left the retry set
+    bool isReplayPageDrained() const;
+    int loadReplayPage();
+
+    /// Memory used by the retry entries which are not in the database, what the budget applies to
+    qint64 retryMemoryUsage() const;
+    /// Spilled entries waiting on disk, loadSpilledRetryEntries brings them back while the budget allows
+    int pendingSpilledRetryEntries() const;
+    int loadSpilledRetryEntries();
+    /// Retry entries spilled to disk and dropped because of the memory budget, since startup
+    quint64 spilledRetryEntries() const;
+    quint64 droppedRetryEntries() const;
+
+    /// Stores properties and Stored messages which are not in the database yet, setting their dbId.
+    /// Messages waiting outside of the cache, e.g. in a publish queue, use it to survive a restart.
+    void persistMessage(Astarte::CacheMessage &message);
     void removeFromDatabase(const Astarte::CacheMessage &message);
 
+    void flushDatabaseWrites();
 
 protected:
     virtual void initImpl();
     virtual void timerEvent(QTimerEvent *event);
 
+private Q_SLOTS:
+    void onDatabaseWritesFlushed(Hemera::Operation *operation);
+    void onCacheMessageWriteFailed(qint64 dbId);
+    void onPersistentEntryWriteFailed(const QByteArray &target);
+
 private:
     explicit TransportCache(QObject *parent = 0);
 
     void insertIntoDatabaseIfNotPresent(Astarte::CacheMessage &message);
 
+    bool spillRetryEntry(Astarte::CacheMessage message);
+    bool dropOldestRetryEntries(qint64 bytes);
+    void resetSpill();
+
     bool ensureDatabase();
 
+    void beginDatabaseWrite();
+    void endDatabaseWrite();
+
+    void scheduleExpiry(int id, const Astarte::CacheMessage &message);
+    void unscheduleExpiry(int id);
+    void rescheduleExpirySweep();
+    void sweepExpiredEntries();
+
     bool m_dbOk;
 
     class Private;
@@ -0,0 +1,291 @@
+/*
+ * Copyright (C) 2017 Ispirata Srl
+ *
+ * This file is part of Astarte.
+ * Astarte is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Astarte is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Astarte.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "transportthread.h"
+
+#include "abstractwavetarget.h"
+#include "transport.h"
+
+#include "utils/hemeraoperation.h"
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QDebug>
+#include <QtCore/QEvent>
+
+namespace Astarte {
+
+// Wake ups are posted at most once per drain, whatever the number of queued items
+static const QEvent::Type CommandsEvent = static_cast<QEvent::Type>(QEvent::registerEventType());
+static const QEvent::Type InboundWavesEvent = static_cast<QEvent::Type>(QEvent::registerEventType());
+static const QEvent::Type InboundDrainedEvent = static_cast<QEvent::Type>(QEvent::registerEventType());
+
+// Lives on the transport thread, where it executes the queued commands and moves waiting waves to the ring
+class TransportCommandDrainer : public QObject
+{
+public:
+    explicit TransportCommandDrainer(TransportThread *thread) : m_thread(thread) {}
+
+    virtual bool event(QEvent *event)
+    {
+        if (event->type() == CommandsEvent) {
+            m_thread->executeCommands();
+            return true;
+        } else if (event->type() == InboundDrainedEvent) {
+            m_thread->refillInboundWaves();
+            return true;
+        }
+
+        return QObject::event(event);
+    }
+
+private:
+    TransportThread *m_thread;
+};
+
+TransportThread::TransportThread(const QString &configurationPath, const QByteArray &hardwareId, int inboundQueueSize, int inboundOverflowSize,
+                                 QObject *parent)
+    : QThread(parent)
+    , m_configurationPath(configurationPath)
+    , m_hardwareId(hardwareId)
+    , m_transport(0)
+    , m_commandDrainer(0)
+    , m_commandsWakeUp(0)
+    , m_inboundWaves(inboundQueueSize)
+    , m_inboundWakeUp(0)
+    , m_inboundBlocked(0)
+    , m_overflowSize(qMax(1, inboundOverflowSize))
+    , m_droppedInboundWaves(0)
+    , m_deliveringWaves(false)
+{
+}
+
+TransportThread::~TransportThread()
+{
+    if (isRunning()) {
+        quit();
+        wait();
+    }
+}
+
+Transport *TransportThread::transport() const
+{
+    return m_transport;
+}
+
+quint64 TransportThread::droppedInboundWaves() const
+{
+    QMutexLocker locker(&m_statsMutex);
+    return m_droppedInboundWaves;
+}
+
+void TransportThread::run()
+{
+    Transport *transport = new Transport(m_configurationPath, m_hardwareId);
+    transport->setTransportThread(this);
+    TransportCommandDrainer drainer(this);
+
+    // Only this thread waits for the transport, the owner's event loop carries on
+    Hemera::Operation *op = transport->init();
+    if (!op->synchronize()) {
+        Q_EMIT transportReady(false, op->errorName(), op->errorMessage());
+        delete transport;
+        return;
+    }
+
+    m_transport = transport;
+    m_commandDrainer = &drainer;
+    Q_EMIT transportReady(true, QString(), QString());
+
+    // Drains completed until now could not wake us up
+    if (!m_overflowWaves.isEmpty()) {
+        refillInboundWaves();
+    }
+
+    exec();
+
+    // Whatever was posted before stopping still reaches the transport
+    executeCommands();
+    m_commandDrainer = 0;
+    m_transport = 0;
+
+    // Flushes the pending batches
+    delete transport;
+}
+
+bool TransportThread::event(QEvent *event)
+{
+    if (event->type() == InboundWavesEvent) {
+        deliverWaves();
+        return true;
+    }
+
+    return QThread::event(event);
+}
+
+void TransportThread::postCommand(const Command &command)
+{
+    if (Q_UNLIKELY(!m_commandDrainer)) {
+        qWarning() << "The transport thread is not running, dropping command" << command.type;
+        return;
+    }
+
+    m_commands.enqueue(command);
+    if (m_commandsWakeUp.testAndSetOrdered(0, 1)) {
+        QCoreApplication::postEvent(m_commandDrainer, new QEvent(CommandsEvent));
+    }
+}
+
+void TransportThread::postCacheMessage(const CacheMessage &cacheMessage, MQTTClientWrapper::MQTTQoS qos)
+{
+    Command command;
+    command.type = Command::CacheMessageCommand;
+    command.cacheMessage = cacheMessage;
+    command.qos = qos;
+    postCommand(command);
+}
+
+void TransportThread::postRebound(const Rebound &rebound)
+{
+    Command command;
+    command.type = Command::ReboundCommand;
+    command.rebound = rebound;
+    postCommand(command);
+}
+
+void TransportThread::postIntrospection(const QHash< QByteArray, AstarteInterface > &introspection)
+{
+    Command command;
+    command.type = Command::IntrospectionCommand;
+    command.introspection = introspection;
+    postCommand(command);
+}
+
+void TransportThread::executeCommands()
+{
+    // Cleared before draining: whatever gets posted from now on wakes us up again
+    m_commandsWakeUp.fetchAndStoreOrdered(0);
+
+    Command command;
+    while (m_commands.dequeue(&command)) {
+        switch (command.type) {
+            case Command::CacheMessageCommand:
+                m_transport->cacheMessage(command.cacheMessage, command.qos, 0);
+                break;
+            case Command::ReboundCommand:
+                m_transport->rebound(command.rebound);
+                break;
+            case Command::IntrospectionCommand:
+                m_transport->setIntrospection(command.introspection);
+                break;
+        }
+    }
+}
+
+void TransportThread::registerWaveTarget(const QByteArray &interface, AbstractWaveTarget *target)
+{
+    if (m_waveTargets.contains(interface)) {
+        qWarning() << "Interface" << interface << "already has a wave target, replacing it";
+    }
+
+    m_waveTargets.insert(interface, target);
+}
+
+void TransportThread::unregisterWaveTarget(const QByteArray &interface, AbstractWaveTarget *target)
+{
+    // Only if it was not replaced in the meantime
+    QHash< QByteArray, AbstractWaveTarget* >::iterator i = m_waveTargets.find(interface);
+    if (i != m_waveTargets.end() && i.value() == target) {
+        m_waveTargets.erase(i);
+    }
+}
+
+void TransportThread::postWave(const QByteArray &interface, const Wave &wave)
+{
+    InboundWave inbound;
+    inbound.interface = interface;
+    inbound.wave = wave;
+
+    // Never wait for the owner: it is its slowness we are protecting the transport from. Waves which
+    // don't fit, or which would overtake the ones already waiting, wait here.
+    if (!m_overflowWaves.isEmpty() || !m_inboundWaves.tryEnqueue(inbound)) {
+        // When full, the oldest wave goes, as in the pending wave table
+        if (m_overflowWaves.count() >= m_overflowSize) {
+            InboundWave dropped = m_overflowWaves.dequeue();
+            qWarning() << "Inbound overflow queue full, dropping wave" << dropped.wave.id() << "for" << dropped.interface;
+            QMutexLocker locker(&m_statsMutex);
+            ++m_droppedInboundWaves;
+        }
+        m_overflowWaves.enqueue(inbound);
+        refillInboundWaves();
+        return;
+    }
+
+    if (m_inboundWakeUp.testAndSetOrdered(0, 1)) {
+        QCoreApplication::postEvent(this, new QEvent(InboundWavesEvent));
+    }
+}
+
+void TransportThread::refillInboundWaves()
+{
+    // Set before trying, so that a drain completing in the meantime is not missed
+    m_inboundBlocked.fetchAndStoreOrdered(1);
+
+    while (!m_overflowWaves.isEmpty() && m_inboundWaves.tryEnqueue(m_overflowWaves.head())) {
+        m_overflowWaves.dequeue();
+    }
+
+    if (m_inboundWakeUp.testAndSetOrdered(0, 1)) {
+        QCoreApplication::postEvent(this, new QEvent(InboundWavesEvent));
+    }
+
+    // Nothing waits anymore, no need to hear about the next drain
+    if (m_overflowWaves.isEmpty()) {
+        m_inboundBlocked.fetchAndStoreOrdered(0);
+    }
+}
+
+void TransportThread::deliverWaves()
+{
+    m_inboundWakeUp.fetchAndStoreOrdered(0);
+
+    // A target spinning a nested event loop must not get the wave it is handling again
+    if (m_deliveringWaves) {
+        return;
+    }
+    m_deliveringWaves = true;
+
+    // Delivered in place, the slot is released only afterwards
+    while (InboundWave *inbound = m_inboundWaves.front()) {
+        AbstractWaveTarget *target = m_waveTargets.value(inbound->interface);
+        if (target) {
+            target->handleReceivedWave(inbound->interface, inbound->wave);
+        } else {
+            qDebug() << "No target for interface" << inbound->interface << ", dropping wave" << inbound->wave.id();
+        }
+        m_inboundWaves.pop();
+    }
+
+    m_deliveringWaves = false;
+
+    // There is room again for the waves waiting on the transport thread
+    if (m_commandDrainer && m_inboundBlocked.testAndSetOrdered(1, 0)) {
+        QCoreApplication::postEvent(m_commandDrainer, new QEvent(InboundDrainedEvent));
+    }
+}
+
+}
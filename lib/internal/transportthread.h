@@ -0,0 +1,148 @@
+/*
+ * Copyright (C) 2017 Ispirata Srl
+ *
+ * This file is part of Astarte.
+ * Astarte is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Astarte is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Astarte.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ASTARTE_TRANSPORT_THREAD_H
+#define ASTARTE_TRANSPORT_THREAD_H
+
+#include "astarteinterface.h"
+#include "cachemessage.h"
+#include "mqttclientwrapper.h"
+#include "rebound.h"
+#include "wave.h"
+
+#include "utils/spscqueue.h"
+
+#include <QtCore/QAtomicInt>
+#include <QtCore/QHash>
+#include <QtCore/QMutex>
+#include <QtCore/QQueue>
+#include <QtCore/QThread>
+
+class AbstractWaveTarget;
+
+namespace Astarte {
+
+class Transport;
+class TransportCommandDrainer;
+
+/**
+ * Runs a Transport, and with it the cache, the persistence and MQTT, on a thread of its own, so that
+ * slow slots in the application can't delay publish confirmations and keepalives.
+ *
+ * The thread creating it is the owner: it talks to the transport through a lock-free command queue,
+ * and gets inbound waves back through a bounded queue, delivered to the registered wave targets on
+ * its own event loop. Both queues are single producer, single consumer: only the owner thread may
+ * post commands or register targets. When the owner does not keep up with inbound waves, they wait on
+ * the transport thread in a bounded overflow queue, which drops the oldest ones once full: the MQTT
+ * loop keeps running whatever the owner does.
+ */
+class TransportThread : public QThread
+{
+    Q_OBJECT
+    Q_DISABLE_COPY(TransportThread)
+
+public:
+    TransportThread(const QString &configurationPath, const QByteArray &hardwareId, int inboundQueueSize, int inboundOverflowSize,
+                    QObject *parent = 0);
+    /// Stops the thread. Commands posted before are still executed.
+    virtual ~TransportThread();
+
+    /// The transport lives in this thread, and is valid once transportReady has been emitted successfully
+    Transport *transport() const;
+
+    /// Inbound waves dropped because the owner thread was not keeping up, since startup
+    quint64 droppedInboundWaves() const;
+
+    // Owner thread side
+    void postCacheMessage(const CacheMessage &cacheMessage, MQTTClientWrapper::MQTTQoS qos);
+    void postRebound(const Rebound &rebound);
+    void postIntrospection(const QHash< QByteArray, AstarteInterface > &introspection);
+    void registerWaveTarget(const QByteArray &interface, AbstractWaveTarget *target);
+    void unregisterWaveTarget(const QByteArray &interface, AbstractWaveTarget *target);
+
+    // Transport thread side
+    void postWave(const QByteArray &interface, const Wave &wave);
+
+Q_SIGNALS:
+    void transportReady(bool ok, const QString &errorName, const QString &errorMessage);
+
+protected:
+    virtual void run();
+    virtual bool event(QEvent *event);
+
+private:
+    struct Command {
+        enum Type {
+            CacheMessageCommand,
+            ReboundCommand,
+            IntrospectionCommand
+        };
+
+        // Rebound has no default constructor
+        Command() : type(CacheMessageCommand), qos(MQTTClientWrapper::DefaultQoS), rebound(quint64(0)) {}
+
+        Type type;
+        CacheMessage cacheMessage;
+        MQTTClientWrapper::MQTTQoS qos;
+        Rebound rebound;
+        QHash< QByteArray, AstarteInterface > introspection;
+    };
+
+    struct InboundWave {
+        // A view, the wave keeps the bytes alive
+        QByteArray interface;
+        Wave wave;
+    };
+
+    friend class TransportCommandDrainer;
+
+    void postCommand(const Command &command);
+    void executeCommands();
+    void deliverWaves();
+    void refillInboundWaves();
+
+    QString m_configurationPath;
+    QByteArray m_hardwareId;
+
+    // Set by the transport thread before transportReady
+    Transport *m_transport;
+    QObject *m_commandDrainer;
+
+    Util::SpscQueue< Command > m_commands;
+    QAtomicInt m_commandsWakeUp;
+
+    Util::BoundedSpscQueue< InboundWave > m_inboundWaves;
+    QAtomicInt m_inboundWakeUp;
+    // Set by the transport thread while waves wait for room, the owner posts a wake up once it has drained
+    QAtomicInt m_inboundBlocked;
+
+    // Only touched by the transport thread: waves which did not fit, in order
+    QQueue< InboundWave > m_overflowWaves;
+    int m_overflowSize;
+
+    mutable QMutex m_statsMutex;
+    quint64 m_droppedInboundWaves;
+
+    // Only touched by the owner thread
+    QHash< QByteArray, AbstractWaveTarget* > m_waveTargets;
+    bool m_deliveringWaves;
+};
+
+}
+
+#endif // ASTARTE_TRANSPORT_THREAD_H
@@ -37,7 +37,7 @@ public:
     WaveData(quint64 id, const QByteArray &method, const QByteArray &target, const ByteArrayHash &attributes, const QByteArray &payload)
         : id(id), method(method), target(target), attributes(attributes), payload(payload) { }
     WaveData(const WaveData &other)
-        : QSharedData(other), id(other.id), method(other.method), interface(other.interface), target(other.target), attributes(other.attributes), payload(other.payload) { }
+        : QSharedData(other), id(other.id), method(other.method), interface(other.interface), target(other.target), attributes(other.attributes), payload(other.payload), buffer(other.buffer) { }
     ~WaveData() { }
 
     quint64 id;
@@ -46,6 +46,13 @@ public:
     QByteArray target;
     ByteArrayHash attributes;
     QByteArray payload;
+    // Backing storage of target and payload, when they are views
+    QByteArray buffer;
+
+    bool isView(const QByteArray &data) const
+    {
+        return data.constData() >= buffer.constData() && data.constData() < buffer.constData() + buffer.size();
+    }
 };
 
 Wave::Wave()
@@ -174,6 +181,24 @@ void Wave::setTarget(const QByteArray& t)
     d->target = t;
 }
 
+void Wave::removeTargetPrefix(int length)
+{
+    if (d->isView(d->target)) {
+        d->target = QByteArray::fromRawData(d->target.constData() + length, d->target.size() - length);
+    } else {
+        d->target = d->target.mid(length);
+    }
+}
+
+Wave Wave::fromBuffer(const QByteArray &buffer, int targetOffset, int targetLength, int payloadOffset, int payloadLength)
+{
+    Wave w;
+    w.d->buffer = buffer;
+    w.d->target = QByteArray::fromRawData(buffer.constData() + targetOffset, targetLength);
+    w.d->payload = QByteArray::fromRawData(buffer.constData() + payloadOffset, payloadLength);
+    return w;
+}
+
 QByteArray Wave::serialize() const
 {
     Util::BSONSerializer s;
@@ -183,12 +208,11 @@ QByteArray Wave::serialize() const
     s.appendASCIIString("i", d->interface);
     s.appendASCIIString("t", d->target);
     if (!d->attributes.isEmpty()) {
-        Util::BSONSerializer sa;
+        s.beginSubdocument("a");
         for (ByteArrayHash::const_iterator i = d->attributes.constBegin(); i != d->attributes.constEnd(); ++i) {
-            sa.appendASCIIString(i.key(), i.value());
+            s.appendASCIIString(i.key(), i.value());
         }
-        sa.appendEndOfDocument();
-        s.appendDocument("a", sa.document());
+        s.endSubdocument();
     }
     s.appendBinaryValue("p", d->payload);
     s.appendEndOfDocument();
@@ -143,9 +143,18 @@ public:
     QByteArray payload() const;
     void setPayload(const QByteArray &p);
 
+    /// Drops the first length bytes of the target. Views are narrowed in place, other targets are copied.
+    void removeTargetPrefix(int length);
+
     QByteArray serialize() const;
     static Wave fromBinary(const QByteArray &data);
 
+    /**
+     * A wave whose target and payload are views on buffer, which the wave keeps alive: as for
+     * Util::BSONDocument::byteArrayView, what target() and payload() return must not outlive it.
+     */
+    static Wave fromBuffer(const QByteArray &buffer, int targetOffset, int targetLength, int payloadOffset, int payloadLength);
+
 private:
     Wave(quint64 id);
 
@@ -18,10 +18,10 @@ PKGCONFIG += openssl
 
 macx {
     INCLUDEPATH += /usr/local/Cellar/openssl/1.0.2l/include
-    LIBS += -L/usr/local/Cellar/openssl/1.0.2l/lib -lcrypto -lssl -L/usr/local/Cellar/mosquitto/1.4.14/lib -lmosquittopp
+    LIBS += -L/usr/local/Cellar/openssl/1.0.2l/lib -lcrypto -lssl -L/usr/local/Cellar/mosquitto/1.4.14/lib -lmosquittopp -lz
 }
 unix:!macx {
-    LIBS += -lmosquittopp
+    LIBS += -lmosquittopp -lz
 }
 
 # You can also make your code fail to compile if you use deprecated APIs.
@@ -42,6 +42,8 @@ SOURCES += \
     internal/mqttclientwrapper.cpp \
     internal/transport.cpp \
     internal/transportcache.cpp \
+    internal/persistenceworker.cpp \
+    internal/transportthread.cpp \
     utils/hemeraasyncinitobject.cpp \
     internal/cachemessage.cpp \
     internal/wave.cpp \
@@ -54,6 +56,10 @@ SOURCES += \
     utils/astartegenericconsumer.cpp \
     utils/astartegenericproducer.cpp \
     utils/validateinterfaceoperation.cpp \
+    utils/pathmatcher.cpp \
+    utils/payloadcompressor.cpp \
+    utils/segmentedlog.cpp \
+    astartesendhandle.cpp \
     astartedevicesdk.cpp
 
 HEADERS += \
@@ -75,6 +81,8 @@ HEADERS += \
     internal/httpendpoint_p.h \
     internal/transport.h \
     internal/transportcache.h \
+    internal/persistenceworker.h \
+    internal/transportthread.h \
     utils/hemeraasyncinitobject.h \
     utils/hemeraasyncinitobject_p.h \
     internal/cachemessage.h \
@@ -89,6 +97,12 @@ HEADERS += \
     utils/astartegenericconsumer.h \
     utils/astartegenericproducer.h \
     utils/validateinterfaceoperation.h \
+    utils/pathmatcher.h \
+    utils/payloadcompressor.h \
+    utils/segmentedlog.h \
+    utils/spscqueue.h \
+    astartesendhandle.h \
+    astartesendhandle_p.h \
     astartedevicesdk.h \
     astartedevicesdk_p.h \
     astartedevicesdk_global.h
@@ -108,7 +122,8 @@ db_migrations.files = db/migrations/*
 
 header_files.files = \
     astartedevicesdk.h \
-    astartedevicesdk_global.h
+    astartedevicesdk_global.h \
+    astartesendhandle.h
 header_utils_files.files = \
     utils/hemeraasyncinitobject.h \
     utils/hemeraoperation.h
@@ -37,6 +37,10 @@ AstarteGenericConsumer::~AstarteGenericConsumer()
 void AstarteGenericConsumer::setMappingToTokens(const QHash<QByteArray, QByteArrayList> &mappingToTokens)
 {
     m_mappingToTokens = mappingToTokens;
+
+    // Build the dispatch automaton when the interface is loaded rather than on the first wave
+    m_mappings = m_mappingToTokens.keys();
+    setDispatchMappings(m_mappings);
 }
 
 void AstarteGenericConsumer::setMappingToType(const QHash<QByteArray, QVariant::Type> &mappingToType)
@@ -53,97 +57,67 @@ void AstarteGenericConsumer::populateTokensAndStates()
 {
 }
 
-ConsumerAbstractAdaptor::DispatchResult AstarteGenericConsumer::dispatch(int i, const QByteArray &payload, const QList<QByteArray> &inputTokens)
+ConsumerAbstractAdaptor::DispatchResult AstarteGenericConsumer::dispatch(int i, const QByteArray &payload, const QByteArray &target)
 {
-    QHash<QByteArray, QByteArrayList>::const_iterator it;
-
-    for (it = m_mappingToTokens.constBegin(); it != m_mappingToTokens.constEnd(); it++) {
-        if (inputTokens.size() != it.value().size()) {
-            continue;
-        }
+    if (i < 0) {
+        return IndexNotFound;
+    }
 
-        bool mappingMatch = true;
-        for (int itt = 0; itt < inputTokens.size(); ++itt) {
-            if (inputTokens.at(itt).startsWith("%{")) {
-                continue;
-            }
+    const QByteArray &matchedMapping = m_mappings.at(i);
 
-            if (inputTokens.at(itt) != it.value().at(itt)) {
-                mappingMatch = false;
-            }
+    if (payload.isEmpty()) {
+        if (m_mappingToAllowUnset.value(matchedMapping)) {
+            parent()->d->unsetValue(interface(), target);
+            return Success;
+        } else {
+            return CouldNotConvertPayload;
         }
+    }
 
-        if (!mappingMatch) {
-            continue;
+    switch (m_mappingToType.value(matchedMapping)) {
+        case QMetaType::Bool: {
+            bool value;
+            if (!payloadToValue(payload, &value)) return CouldNotConvertPayload;
+            parent()->d->receiveValue(interface(), target, value);
+            return Success;
         }
-
-        QByteArray matchedMapping = it.key();
-
-        QByteArray joinedInputTokens;
-        Q_FOREACH (const QByteArray &inputToken, inputTokens) {
-            joinedInputTokens += inputToken;
-            joinedInputTokens += '/';
+        case QMetaType::Int: {
+            int value;
+            if (!payloadToValue(payload, &value)) return CouldNotConvertPayload;
+            parent()->d->receiveValue(interface(), target, value);
+            return Success;
         }
-
-        QByteArray path = QByteArray("/%1").replace("%1", joinedInputTokens);
-
-        if (payload.isEmpty()) {
-            if (m_mappingToAllowUnset.value(matchedMapping)) {
-                parent()->d->unsetValue(interface(), path);
-                return Success;
-            } else {
-                return CouldNotConvertPayload;
-            }
+        case QMetaType::LongLong: {
+            qint64 value;
+            if (!payloadToValue(payload, &value)) return CouldNotConvertPayload;
+            parent()->d->receiveValue(interface(), target, value);
+            return Success;
         }
-
-        switch (m_mappingToType.value(matchedMapping)) {
-            case QMetaType::Bool: {
-                bool value;
-                if (!payloadToValue(payload, &value)) return CouldNotConvertPayload;
-                parent()->d->receiveValue(interface(), path, value);
-                return Success;
-            }
-            case QMetaType::Int: {
-                int value;
-                if (!payloadToValue(payload, &value)) return CouldNotConvertPayload;
-                parent()->d->receiveValue(interface(), path, value);
-                return Success;
-            }
-            case QMetaType::LongLong: {
-                qint64 value;
-                if (!payloadToValue(payload, &value)) return CouldNotConvertPayload;
-                parent()->d->receiveValue(interface(), path, value);
-                return Success;
-            }
-            case QMetaType::QByteArray: {
-                QByteArray value;
-                if (!payloadToValue(payload, &value)) return CouldNotConvertPayload;
-                parent()->d->receiveValue(interface(), path, value);
-                return Success;
-            }
-            case QMetaType::Double: {
-                double value;
-                if (!payloadToValue(payload, &value)) return CouldNotConvertPayload;
-                parent()->d->receiveValue(interface(), path, value);
-                return Success;
-            }
-            case QMetaType::QString: {
-                QString value;
-                if (!payloadToValue(payload, &value)) return CouldNotConvertPayload;
-                parent()->d->receiveValue(interface(), path, value);
-                return Success;
-            }
-            case QMetaType::QDateTime: {
-                QDateTime value;
-                if (!payloadToValue(payload, &value)) return CouldNotConvertPayload;
-                parent()->d->receiveValue(interface(), path, value);
-                return Success;
-            }
-            default:
-                return CouldNotConvertPayload;
+        case QMetaType::QByteArray: {
+            QByteArray value;
+            if (!payloadToValue(payload, &value)) return CouldNotConvertPayload;
+            parent()->d->receiveValue(interface(), target, value);
+            return Success;
+        }
+        case QMetaType::Double: {
+            double value;
+            if (!payloadToValue(payload, &value)) return CouldNotConvertPayload;
+            parent()->d->receiveValue(interface(), target, value);
+            return Success;
         }
+        case QMetaType::QString: {
+            QString value;
+            if (!payloadToValue(payload, &value)) return CouldNotConvertPayload;
+            parent()->d->receiveValue(interface(), target, value);
+            return Success;
+        }
+        case QMetaType::QDateTime: {
+            QDateTime value;
+            if (!payloadToValue(payload, &value)) return CouldNotConvertPayload;
+            parent()->d->receiveValue(interface(), target, value);
+            return Success;
+        }
+        default:
+            return CouldNotConvertPayload;
     }
-
-    // If we're here, mapping not found
-    return IndexNotFound;
 }
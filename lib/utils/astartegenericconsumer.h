@@ -42,12 +42,13 @@ public:
 
 protected:
     virtual void populateTokensAndStates();
-    virtual ConsumerAbstractAdaptor::DispatchResult dispatch(int i, const QByteArray &payload, const QList<QByteArray> &inputTokens);
+    virtual ConsumerAbstractAdaptor::DispatchResult dispatch(int i, const QByteArray &payload, const QByteArray &target);
 
 private:
     inline AstarteDeviceSDK *parent() const { return static_cast<AstarteDeviceSDK *>(QObject::parent()); }
 
     QHash<QByteArray, QByteArrayList> m_mappingToTokens;
+    QByteArrayList m_mappings;
     QHash<QByteArray, QVariant::Type> m_mappingToType;
     QHash<QByteArray, bool> m_mappingToAllowUnset;
 };
@@ -20,6 +20,8 @@
 
 #include "internal/transport.h"
 
+#include "astartesendhandle_p.h"
+
 #include "utils/bsondocument.h"
 #include "utils/bsonserializer.h"
 #include "utils/utils.h"
@@ -54,65 +56,187 @@ QHash<QByteArray, QByteArrayList> AstarteGenericProducer::mappingToTokens() cons
 
 bool AstarteGenericProducer::sendData(const QVariant &value, const QByteArray &target, const QDateTime &timestamp, const QVariantHash &metadata)
 {
-    QByteArrayList targetTokens = target.mid(1).split('/');
-    QHash<QByteArray, QByteArrayList>::const_iterator it;
+    int mappingIndex = dispatchIndex(target);
+    if (mappingIndex < 0) {
+        qWarning() << "Can't find valid mapping for " << target;
+        return false;
+    }
 
-    for (it = m_mappingToTokens.constBegin(); it != m_mappingToTokens.constEnd(); it++) {
-        if (!Utils::verifyPathMatch(targetTokens, it.value())) {
-            continue;
-        }
+    const QByteArray &matchedMapping = m_mappings.at(mappingIndex);
 
-        QByteArray matchedMapping = it.key();
+    if (!value.canConvert(m_mappingToType.value(matchedMapping))) {
+        qWarning() << "Invalid type for value in sendDataOnEndpoint, expected " << m_mappingToType.value(matchedMapping) << "got" << value.type();
+        return false;
+    }
 
-        if (!value.canConvert(m_mappingToType.value(matchedMapping))) {
-            qWarning() << "Invalid type for value in sendDataOnEndpoint, expected " << m_mappingToType.value(matchedMapping) << "got" << value.type();
+    QVariant converted = value;
+    converted.convert(m_mappingToType.value(matchedMapping));
+    switch (converted.type()) {
+        case QVariant::Bool:
+            sendMappingData(value.toBool(), target, matchedMapping, timestamp, metadata);
+            return true;
+        case QVariant::ByteArray:
+            sendMappingData(value.toByteArray(), target, matchedMapping, timestamp, metadata);
+            return true;
+        case QVariant::DateTime:
+            sendMappingData(value.toDateTime(), target, matchedMapping, timestamp, metadata);
+            return true;
+        case QVariant::Double:
+            sendMappingData(value.toDouble(), target, matchedMapping, timestamp, metadata);
+            return true;
+        case QVariant::Int:
+            sendMappingData(value.toInt(), target, matchedMapping, timestamp, metadata);
+            return true;
+        case QVariant::LongLong:
+            sendMappingData(value.toLongLong(), target, matchedMapping, timestamp, metadata);
+            return true;
+        case QVariant::String:
+            sendMappingData(value.toString(), target, matchedMapping, timestamp, metadata);
+            return true;
+        default:
+            qWarning() << "Can't find valid type for " << target;
             return false;
-        }
+    }
+}
 
-        QHash<QByteArray, QByteArray> attributes;
-        attributes.insert("interfaceType", QByteArray::number(static_cast<int>(m_interfaceType)));
-        if (m_mappingToRetention.contains(matchedMapping)) {
-            attributes.insert("retention", QByteArray::number(static_cast<int>(m_mappingToRetention.value(matchedMapping))));
-            if (m_mappingToExpiry.contains(matchedMapping)) {
-                attributes.insert("expiry", QByteArray::number(m_mappingToExpiry.value(matchedMapping)));
-            }
-        }
+template <typename T>
+void AstarteGenericProducer::sendMappingData(const T &value, const QByteArray &target, const QByteArray &mapping, const QDateTime &timestamp,
+                                             const QVariantHash &metadata)
+{
+    QHash<QByteArray, Util::PayloadCompressor>::const_iterator compressor = m_mappingToCompressor.constFind(mapping);
+    if (compressor == m_mappingToCompressor.constEnd()) {
+        sendDataOnEndpoint(value, target, mappingAttributes(mapping), timestamp, metadata);
+        return;
+    }
 
-        if (m_mappingToReliability.contains(matchedMapping)) {
-            attributes.insert("reliability", QByteArray::number(static_cast<int>(m_mappingToReliability.value(matchedMapping))));
-        }
+    sendRawDataOnEndpoint(compressor.value().compress(serializeValue(value, timestamp, metadata)), target, mappingAttributes(mapping));
+}
 
-        QVariant converted = value;
-        converted.convert(m_mappingToType.value(matchedMapping));
-        switch (converted.type()) {
-            case QVariant::Bool:
-                sendDataOnEndpoint(value.toBool(), target, attributes, timestamp, metadata);
-                return true;
-            case QVariant::ByteArray:
-                sendDataOnEndpoint(value.toByteArray(), target, attributes, timestamp, metadata);
-                return true;
-            case QVariant::DateTime:
-                sendDataOnEndpoint(value.toDateTime(), target, attributes, timestamp, metadata);
-                return true;
-            case QVariant::Double:
-                sendDataOnEndpoint(value.toDouble(), target, attributes, timestamp, metadata);
-                return true;
-            case QVariant::Int:
-                sendDataOnEndpoint(value.toInt(), target, attributes, timestamp, metadata);
-                return true;
-            case QVariant::LongLong:
-                sendDataOnEndpoint(value.toLongLong(), target, attributes, timestamp, metadata);
-                return true;
-            case QVariant::String:
-                sendDataOnEndpoint(value.toString(), target, attributes, timestamp, metadata);
-                return true;
-            default:
-                qWarning() << "Can't find valid type for " << target;
-        }
+template <typename T>
+bool AstarteGenericProducer::sendTypedData(const T &value, QVariant::Type type, const QByteArray &target, const QDateTime &timestamp,
+                                           const QVariantHash &metadata)
+{
+    int mappingIndex = dispatchIndex(target);
+    if (mappingIndex < 0) {
+        qWarning() << "Can't find valid mapping for " << target;
+        return false;
+    }
+
+    const QByteArray &matchedMapping = m_mappings.at(mappingIndex);
+    if (m_mappingToType.value(matchedMapping) != type) {
+        // Not the mapping type, let QVariant attempt the conversion
+        return sendData(QVariant(value), target, timestamp, metadata);
+    }
+
+    sendMappingData(value, target, matchedMapping, timestamp, metadata);
+    return true;
+}
+
+bool AstarteGenericProducer::sendData(double value, const QByteArray &target, const QDateTime &timestamp, const QVariantHash &metadata)
+{
+    return sendTypedData(value, QVariant::Double, target, timestamp, metadata);
+}
+
+bool AstarteGenericProducer::sendData(int value, const QByteArray &target, const QDateTime &timestamp, const QVariantHash &metadata)
+{
+    return sendTypedData(value, QVariant::Int, target, timestamp, metadata);
+}
+
+bool AstarteGenericProducer::sendData(qint64 value, const QByteArray &target, const QDateTime &timestamp, const QVariantHash &metadata)
+{
+    return sendTypedData(value, QVariant::LongLong, target, timestamp, metadata);
+}
+
+bool AstarteGenericProducer::sendData(bool value, const QByteArray &target, const QDateTime &timestamp, const QVariantHash &metadata)
+{
+    return sendTypedData(value, QVariant::Bool, target, timestamp, metadata);
+}
+
+bool AstarteGenericProducer::sendData(const QString &value, const QByteArray &target, const QDateTime &timestamp, const QVariantHash &metadata)
+{
+    return sendTypedData(value, QVariant::String, target, timestamp, metadata);
+}
+
+bool AstarteGenericProducer::sendData(const QByteArray &value, const QByteArray &target, const QDateTime &timestamp, const QVariantHash &metadata)
+{
+    return sendTypedData(value, QVariant::ByteArray, target, timestamp, metadata);
+}
+
+bool AstarteGenericProducer::sendData(const QDateTime &value, const QByteArray &target, const QDateTime &timestamp, const QVariantHash &metadata)
+{
+    return sendTypedData(value, QVariant::DateTime, target, timestamp, metadata);
+}
+
+AstarteSendHandle AstarteGenericProducer::sendHandle(const QByteArray &target)
+{
+    int mappingIndex = dispatchIndex(target);
+    if (mappingIndex < 0) {
+        qWarning() << "Can't find valid mapping for " << target;
+        return AstarteSendHandle();
     }
 
-    qWarning() << "Can't find valid mapping for " << target;
-    return false;
+    const QByteArray &matchedMapping = m_mappings.at(mappingIndex);
+
+    AstarteSendHandleData *data = new AstarteSendHandleData;
+    data->producer = this;
+    data->interface = interface();
+    data->path = target;
+    data->type = m_mappingToType.value(matchedMapping);
+    data->message.setTarget('/' + data->interface + target);
+    data->message.setAttributes(mappingAttributes(matchedMapping));
+    data->message.setInterfaceType(m_interfaceType);
+    data->qos = Astarte::Transport::publishQoS(m_interfaceType, data->message.reliability());
+    data->compressor = m_mappingToCompressor.value(matchedMapping);
+
+    return AstarteSendHandle(data);
+}
+
+template <typename T>
+bool AstarteGenericProducer::sendHandleData(const AstarteSendHandle &handle, const T &value, QVariant::Type type, const QDateTime &timestamp,
+                                            const QVariantHash &metadata)
+{
+    if (handle.d->type != type) {
+        // Not the mapping type, let QVariant attempt the conversion
+        return sendData(QVariant(value), handle.d->path, timestamp, metadata);
+    }
+
+    sendRawDataOnHandle(handle.d->compressor.compress(serializeValue(value, timestamp, metadata)), handle.d.data());
+    return true;
+}
+
+bool AstarteGenericProducer::sendData(const AstarteSendHandle &handle, double value, const QDateTime &timestamp, const QVariantHash &metadata)
+{
+    return sendHandleData(handle, value, QVariant::Double, timestamp, metadata);
+}
+
+bool AstarteGenericProducer::sendData(const AstarteSendHandle &handle, int value, const QDateTime &timestamp, const QVariantHash &metadata)
+{
+    return sendHandleData(handle, value, QVariant::Int, timestamp, metadata);
+}
+
+bool AstarteGenericProducer::sendData(const AstarteSendHandle &handle, qint64 value, const QDateTime &timestamp, const QVariantHash &metadata)
+{
+    return sendHandleData(handle, value, QVariant::LongLong, timestamp, metadata);
+}
+
+bool AstarteGenericProducer::sendData(const AstarteSendHandle &handle, bool value, const QDateTime &timestamp, const QVariantHash &metadata)
+{
+    return sendHandleData(handle, value, QVariant::Bool, timestamp, metadata);
+}
+
+bool AstarteGenericProducer::sendData(const AstarteSendHandle &handle, const QString &value, const QDateTime &timestamp, const QVariantHash &metadata)
+{
+    return sendHandleData(handle, value, QVariant::String, timestamp, metadata);
+}
+
+bool AstarteGenericProducer::sendData(const AstarteSendHandle &handle, const QByteArray &value, const QDateTime &timestamp, const QVariantHash &metadata)
+{
+    return sendHandleData(handle, value, QVariant::ByteArray, timestamp, metadata);
+}
+
+bool AstarteGenericProducer::sendData(const AstarteSendHandle &handle, const QDateTime &value, const QDateTime &timestamp, const QVariantHash &metadata)
+{
+    return sendHandleData(handle, value, QVariant::DateTime, timestamp, metadata);
 }
 
 bool AstarteGenericProducer::sendData(const QVariantHash &value, const QByteArray &target, const QDateTime &timestamp, const QVariantHash &metadata)
@@ -136,9 +260,31 @@ bool AstarteGenericProducer::sendData(const QVariantHash &value, const QByteArra
     return true;
 }
 
+QHash<QByteArray, QByteArray> AstarteGenericProducer::mappingAttributes(const QByteArray &mapping) const
+{
+    QHash<QByteArray, QByteArray> attributes;
+    attributes.insert("interfaceType", QByteArray::number(static_cast<int>(m_interfaceType)));
+    if (m_mappingToRetention.contains(mapping)) {
+        attributes.insert("retention", QByteArray::number(static_cast<int>(m_mappingToRetention.value(mapping))));
+        if (m_mappingToExpiry.contains(mapping)) {
+            attributes.insert("expiry", QByteArray::number(m_mappingToExpiry.value(mapping)));
+        }
+    }
+
+    if (m_mappingToReliability.contains(mapping)) {
+        attributes.insert("reliability", QByteArray::number(static_cast<int>(m_mappingToReliability.value(mapping))));
+    }
+
+    return attributes;
+}
+
 void AstarteGenericProducer::setMappingToTokens(const QHash<QByteArray, QByteArrayList> &mappingToTokens)
 {
     m_mappingToTokens = mappingToTokens;
+
+    // Compile the mappings once, paths are then resolved in a single pass
+    m_mappings = m_mappingToTokens.keys();
+    setDispatchMappings(m_mappings);
 }
 
 void AstarteGenericProducer::setMappingToType(const QHash<QByteArray, QVariant::Type> &mappingToType)
@@ -161,12 +307,22 @@ void AstarteGenericProducer::setMappingToExpiry(const QHash<QByteArray, int> &ma
     m_mappingToExpiry = mappingToExpiry;
 }
 
+void AstarteGenericProducer::setMappingToCompressor(const QHash<QByteArray, Util::PayloadCompressor> &mappingToCompressor)
+{
+    m_mappingToCompressor = mappingToCompressor;
+}
+
 void AstarteGenericProducer::populateTokensAndStates()
 {
 }
 
 ProducerAbstractInterface::DispatchResult AstarteGenericProducer::dispatch(int i, const QByteArray &payload,
-                                                                           const QList<QByteArray> &inputTokens)
+                                                                           const QByteArray &target)
 {
-    return IndexNotFound;
+    if (i < 0) {
+        return IndexNotFound;
+    }
+
+    qWarning() << "Received error for" << interface() << m_mappings.at(i) << "on" << target << ":" << payload;
+    return Success;
 }
@@ -23,6 +23,9 @@
 
 #include "astarteinterface.h"
 #include "astartedevicesdk.h"
+#include "astartesendhandle.h"
+
+#include "utils/payloadcompressor.h"
 
 namespace Astarte {
 class Transport;
@@ -43,11 +46,30 @@ public:
     bool sendData(const QVariantHash &value, const QByteArray &target, const QDateTime &timestamp,
                   const QVariantHash &metadata);
 
+    bool sendData(double value, const QByteArray &target, const QDateTime &timestamp, const QVariantHash &metadata);
+    bool sendData(int value, const QByteArray &target, const QDateTime &timestamp, const QVariantHash &metadata);
+    bool sendData(qint64 value, const QByteArray &target, const QDateTime &timestamp, const QVariantHash &metadata);
+    bool sendData(bool value, const QByteArray &target, const QDateTime &timestamp, const QVariantHash &metadata);
+    bool sendData(const QString &value, const QByteArray &target, const QDateTime &timestamp, const QVariantHash &metadata);
+    bool sendData(const QByteArray &value, const QByteArray &target, const QDateTime &timestamp, const QVariantHash &metadata);
+    bool sendData(const QDateTime &value, const QByteArray &target, const QDateTime &timestamp, const QVariantHash &metadata);
+
+    AstarteSendHandle sendHandle(const QByteArray &target);
+
+    bool sendData(const AstarteSendHandle &handle, double value, const QDateTime &timestamp, const QVariantHash &metadata);
+    bool sendData(const AstarteSendHandle &handle, int value, const QDateTime &timestamp, const QVariantHash &metadata);
+    bool sendData(const AstarteSendHandle &handle, qint64 value, const QDateTime &timestamp, const QVariantHash &metadata);
+    bool sendData(const AstarteSendHandle &handle, bool value, const QDateTime &timestamp, const QVariantHash &metadata);
+    bool sendData(const AstarteSendHandle &handle, const QString &value, const QDateTime &timestamp, const QVariantHash &metadata);
+    bool sendData(const AstarteSendHandle &handle, const QByteArray &value, const QDateTime &timestamp, const QVariantHash &metadata);
+    bool sendData(const AstarteSendHandle &handle, const QDateTime &value, const QDateTime &timestamp, const QVariantHash &metadata);
+
     void setMappingToTokens(const QHash<QByteArray, QByteArrayList> &mappingToTokens);
     void setMappingToType(const QHash<QByteArray, QVariant::Type> &mappingToType);
     void setMappingToRetention(const QHash<QByteArray, Retention> &m_mappingToRetention);
     void setMappingToReliability(const QHash<QByteArray, Reliability> &m_mappingToReliability);
     void setMappingToExpiry(const QHash<QByteArray, int> &m_mappingToExpiry);
+    void setMappingToCompressor(const QHash<QByteArray, Util::PayloadCompressor> &mappingToCompressor);
 
     QByteArrayList mappings() const;
     QHash<QByteArray, QVariant::Type> mappingToType() const;
@@ -55,14 +77,27 @@ public:
 
 protected:
     virtual void populateTokensAndStates();
-    virtual ProducerAbstractInterface::DispatchResult dispatch(int i, const QByteArray &payload, const QList<QByteArray> &inputTokens);
+    virtual ProducerAbstractInterface::DispatchResult dispatch(int i, const QByteArray &payload, const QByteArray &target);
 
 private:
+    template <typename T>
+    bool sendTypedData(const T &value, QVariant::Type type, const QByteArray &target, const QDateTime &timestamp,
+                       const QVariantHash &metadata);
+    template <typename T>
+    void sendMappingData(const T &value, const QByteArray &target, const QByteArray &mapping, const QDateTime &timestamp,
+                         const QVariantHash &metadata);
+    template <typename T>
+    bool sendHandleData(const AstarteSendHandle &handle, const T &value, QVariant::Type type, const QDateTime &timestamp,
+                        const QVariantHash &metadata);
+    QHash<QByteArray, QByteArray> mappingAttributes(const QByteArray &mapping) const;
+
     QHash<QByteArray, QByteArrayList> m_mappingToTokens;
+    QByteArrayList m_mappings;
     QHash<QByteArray, QVariant::Type> m_mappingToType;
     QHash<QByteArray, Retention> m_mappingToRetention;
     QHash<QByteArray, Reliability> m_mappingToReliability;
     QHash<QByteArray, int> m_mappingToExpiry;
+    QHash<QByteArray, Util::PayloadCompressor> m_mappingToCompressor;
 
     AstarteInterface::Type m_interfaceType;
 };
@@ -54,47 +54,46 @@ static uint64_t read_uint64(const void *u)
     return le64toh((uint64_t) b[0] | ((uint64_t) b[1] << 8) | ((uint64_t) b[2] << 16) | ((uint64_t) b[3] << 24) | ((uint64_t) b[4] << 32) | ((uint64_t) b[5] << 40) | ((uint64_t) b[6] << 48) | ((uint64_t) b[7] << 56));
 }
 
-static unsigned int bson_next_item_offset(unsigned int offset, unsigned int keyLen, const void *document)
+/* Returns the length of the value starting at valueOffset, or 0 if it is unknown or does not fit in docLen */
+static unsigned int bson_value_length(uint8_t elementType, unsigned int valueOffset, const char *docBytes, unsigned int docLen)
 {
-    const char *docBytes = (const char *) document;
-    uint8_t elementType = (uint8_t) docBytes[offset];
-
-    /* offset <- type (uint8_t) + key (const char *) + '\0' (char) */
-    offset += 1 + keyLen + 1;
+    unsigned int valueLen;
 
     switch (elementType) {
-        case TYPE_STRING: {
-            uint32_t stringLen = read_uint32(docBytes + offset);
-            offset += stringLen + 4;
-        }
-        break;
-
-        case TYPE_DOCUMENT: {
-            uint32_t docLen = read_uint32(docBytes + offset);
-            offset += docLen;
-        }
-        break;
-
+        case TYPE_STRING:
+        case TYPE_DOCUMENT:
         case TYPE_BINARY: {
-            uint32_t binLen = read_uint32(docBytes + offset);
-            offset += 4 + 1 + binLen; /* int32 (len) + byte (subtype) + binLen */
+            if (valueOffset + 4 > docLen) {
+                return 0;
+            }
+            uint32_t len = read_uint32(docBytes + valueOffset);
+            if (elementType == TYPE_STRING) {
+                valueLen = 4 + len; /* int32 (len) + string, including its '\0' */
+            } else if (elementType == TYPE_DOCUMENT) {
+                valueLen = len; /* the length includes itself */
+            } else {
+                valueLen = 4 + 1 + len; /* int32 (len) + byte (subtype) + binLen */
+            }
+            if (len > docLen) {
+                return 0;
+            }
         }
         break;
 
         case TYPE_INT32: {
-           offset += sizeof(int32_t);
+            valueLen = sizeof(int32_t);
         }
         break;
 
         case TYPE_DOUBLE:
         case TYPE_DATETIME:
         case TYPE_INT64: {
-            offset += sizeof(int64_t);
+            valueLen = sizeof(int64_t);
         }
         break;
 
         case TYPE_BOOLEAN: {
-            offset += 1;
+            valueLen = 1;
         }
         break;
 
@@ -104,71 +103,11 @@ static unsigned int bson_next_item_offset(unsigned int offset, unsigned int keyL
         }
     }
 
-    return offset;
-}
-
-static const void *bson_key_lookup(const char *key, const void *document, uint8_t *type)
-{
-    const char *docBytes = (const char *) document;
-    uint32_t docLen = read_uint32(document);
-
-    /* TODO: it would be nice to check len validity here */
-
-    unsigned int offset = 4;
-    while (offset + 1 < docLen) {
-       uint8_t elementType = (uint8_t) docBytes[offset];
-       int keyLen = strnlen(docBytes + offset + 1, docLen - offset);
-
-       if (!strncmp(key, docBytes + offset + 1, docLen - offset)) {
-           if (type) {
-               *type = elementType;
-           }
-           return (void *) (docBytes + offset + 1 + keyLen + 1);
-       }
-
-       unsigned int newOffset = bson_next_item_offset(offset, keyLen, document);
-       if (!newOffset) {
-           return NULL;
-       }
-       offset = newOffset;
-    }
-
-    return NULL;
-}
-
-static void *bson_next_item(const void *document, const void *current_item)
-{
-    const char *docBytes = (const char *) document;
-    uint32_t docLen = read_uint32(document);
-    unsigned int offset = ((const char *) current_item) - docBytes;
-
-    if (offset + 1 >= docLen) {
-        return NULL;
-    }
-
-    int keyLen = strnlen(docBytes + offset + 1, docLen - offset);
-    unsigned int newOffset = bson_next_item_offset(offset, keyLen, document);
-
-    if (!newOffset) {
-        return NULL;
-    }
-
-    if (newOffset + 1 >= docLen) {
-        return NULL;
+    if (valueLen == 0 || valueOffset + valueLen > docLen) {
+        return 0;
     }
 
-    return ((char *) docBytes) + newOffset;
-}
-
-static const void *bson_first_item(const void *document)
-{
-    const char *docBytes = (const char *) document;
-    return docBytes + 4;
-}
-
-static const char *bson_key(const void *item)
-{
-    return ((const char *) item) + 1;
+    return valueLen;
 }
 
 static const char *bson_value_to_string(const void *valuePtr, uint32_t *len)
@@ -290,13 +229,73 @@ static int32_t bson_document_size(const void *document)
 
 BSONDocument::BSONDocument(const QByteArray &document)
     : m_doc(document)
+    , m_offset(0)
+    , m_length(document.count())
+{
+    buildIndex();
+}
+
+BSONDocument::BSONDocument(const QByteArray &document, int offset, int length)
+    : m_doc(document)
+    , m_offset(offset)
+    , m_length(length)
 {
+    buildIndex();
+}
+
+void BSONDocument::buildIndex()
+{
+    // Walk the document once, every accessor then only goes through the index
+    if (m_length < 5) {
+        return;
+    }
+
+    const char *docBytes = data();
+    unsigned int docLen = read_uint32(docBytes);
+    if (docLen > (unsigned int) m_length) {
+        return;
+    }
+
+    unsigned int offset = 4;
+    while (offset + 1 < docLen) {
+        Element e;
+        e.type = (uint8_t) docBytes[offset];
+        e.keyOffset = offset + 1;
+        e.keyLength = strnlen(docBytes + e.keyOffset, docLen - e.keyOffset);
+        e.valueOffset = e.keyOffset + e.keyLength + 1;
+
+        unsigned int valueLen = bson_value_length(e.type, e.valueOffset, docBytes, docLen);
+        if (!valueLen) {
+            break;
+        }
+        e.valueLength = valueLen;
+
+        m_index.append(e);
+        offset = e.valueOffset + valueLen;
+    }
+
+    m_index.squeeze();
+}
+
+const BSONDocument::Element *BSONDocument::element(const char *name) const
+{
+    int nameLength = strlen(name);
+    const char *docBytes = data();
+    const Element *elements = m_index.constData();
+
+    for (int i = 0; i < m_index.count(); ++i) {
+        if (elements[i].keyLength == nameLength && !memcmp(docBytes + elements[i].keyOffset, name, nameLength)) {
+            return elements + i;
+        }
+    }
+
+    return 0;
 }
 
 int BSONDocument::size() const
 {
-    if (Q_LIKELY(m_doc.count() >= 4)) {
-        return bson_document_size(m_doc.constData());
+    if (Q_LIKELY(m_length >= 4)) {
+        return bson_document_size(data());
     }
 
     return 0;
@@ -304,30 +303,33 @@ int BSONDocument::size() const
 
 bool BSONDocument::isValid() const
 {
-    return !m_doc.isEmpty() && bson_check_validity(m_doc.constData(), m_doc.count());
+    return m_length > 0 && bson_check_validity(data(), m_length);
 }
 
 bool BSONDocument::contains(const char *name) const
 {
-    return bson_key_lookup(name, m_doc.constData(), 0);
+    return element(name);
 }
 
 QVariant BSONDocument::value(const char *name, QVariant defaultValue) const
 {
-    uint8_t type;
-    const void *value = bson_key_lookup(name, m_doc.constData(), &type);
+    const Element *e = element(name);
 
-    if (Q_UNLIKELY(!value)) {
+    if (Q_UNLIKELY(!e)) {
         return defaultValue;
     }
 
-    switch (type) {
+    const void *value = data() + e->valueOffset;
+
+    switch (e->type) {
         case TYPE_DOUBLE:
             return QVariant(bson_value_to_double(value));
 
-        case TYPE_STRING:
-            return QVariant(QString::fromUtf8(bson_value_to_string(value, 0)));
-
+        case TYPE_STRING: {
+            uint32_t len = 0;
+            const char *string = bson_value_to_string(value, &len);
+            return QVariant(QString::fromUtf8(string, len));
+        }
         case TYPE_DOCUMENT: {
             uint32_t len = 0;
             const char *subdocumentData = (const char *) bson_value_to_document(value, &len);
@@ -357,17 +359,17 @@ QVariant BSONDocument::value(const char *name, QVariant defaultValue) const
 
 double BSONDocument::doubleValue(const char *name, double defaultValue) const
 {
-    uint8_t type;
-    const void *value = bson_key_lookup(name, m_doc.constData(), &type);
+    const Element *e = element(name);
 
-    if (Q_LIKELY(value)) {
-        if (type == TYPE_DOUBLE) {
+    if (Q_LIKELY(e)) {
+        const void *value = data() + e->valueOffset;
+        if (e->type == TYPE_DOUBLE) {
             return bson_value_to_double(value);
 
-        } else if (type == TYPE_INT64) {
+        } else if (e->type == TYPE_INT64) {
             return bson_value_to_int64(value);
 
-        } else if (type == TYPE_INT32) {
+        } else if (e->type == TYPE_INT32) {
             return bson_value_to_int32(value);
         }
     }
@@ -375,42 +377,51 @@ double BSONDocument::doubleValue(const char *name, double defaultValue) const
     return defaultValue;
 }
 
-QByteArray BSONDocument::byteArrayValue(const char *name, const QByteArray &defaultValue) const
+QByteArray BSONDocument::byteArrayView(const char *name) const
 {
-    uint8_t type;
-    const void *value = bson_key_lookup(name, m_doc.constData(), &type);
+    const Element *e = element(name);
 
-    const char *data;
-    if (value && (type == TYPE_STRING)) {
-        data = bson_value_to_string(value, 0);
-        return QByteArray(data);
+    if (e && (e->type == TYPE_STRING)) {
+        uint32_t len = 0;
+        const char *string = bson_value_to_string(data() + e->valueOffset, &len);
+        return QByteArray::fromRawData(string, len);
 
-    } else if (value && (type == TYPE_BINARY)) {
+    } else if (e && (e->type == TYPE_BINARY)) {
         uint32_t len = 0;
-        data = bson_value_to_binary(value, &len);
-        return QByteArray(data, len);
+        const char *binary = bson_value_to_binary(data() + e->valueOffset, &len);
+        return QByteArray::fromRawData(binary, len);
     }
 
-    return defaultValue;
+    return QByteArray();
+}
+
+QByteArray BSONDocument::byteArrayValue(const char *name, const QByteArray &defaultValue) const
+{
+    QByteArray view = byteArrayView(name);
+    if (view.isNull()) {
+        return defaultValue;
+    }
+
+    // Detach from our data
+    return QByteArray(view.constData(), view.count());
 }
 
 QString BSONDocument::stringValue(const char *name, const QString &defaultValue) const
 {
-    QByteArray encoded = byteArrayValue(name);
+    QByteArray encoded = byteArrayView(name);
     if (encoded.isEmpty()) {
         return defaultValue;
     } else {
-        return QString::fromUtf8(encoded);
+        return QString::fromUtf8(encoded.constData(), encoded.count());
     }
 }
 
 QDateTime BSONDocument::dateTimeValue(const char *name, const QDateTime &defaultValue) const
 {
-    uint8_t type;
-    const void *value = bson_key_lookup(name, m_doc.constData(), &type);
+    const Element *e = element(name);
 
-    if (Q_LIKELY(value && (type == TYPE_DATETIME))) {
-        return QDateTime::fromMSecsSinceEpoch(bson_value_to_int64(value)).toLocalTime();
+    if (Q_LIKELY(e && (e->type == TYPE_DATETIME))) {
+        return QDateTime::fromMSecsSinceEpoch(bson_value_to_int64(data() + e->valueOffset)).toLocalTime();
     }
 
     return defaultValue;
@@ -418,11 +429,10 @@ QDateTime BSONDocument::dateTimeValue(const char *name, const QDateTime &default
 
 int32_t BSONDocument::int32Value(const char *name, int32_t defaultValue) const
 {
-    uint8_t type;
-    const void *value = bson_key_lookup(name, m_doc.constData(), &type);
+    const Element *e = element(name);
 
-    if (Q_LIKELY(value && (type == TYPE_INT32))) {
-        return bson_value_to_int32(value);
+    if (Q_LIKELY(e && (e->type == TYPE_INT32))) {
+        return bson_value_to_int32(data() + e->valueOffset);
     }
 
     return defaultValue;
@@ -430,14 +440,13 @@ int32_t BSONDocument::int32Value(const char *name, int32_t defaultValue) const
 
 int64_t BSONDocument::int64Value(const char *name, int64_t defaultValue) const
 {
-    uint8_t type;
-    const void *value = bson_key_lookup(name, m_doc.constData(), &type);
+    const Element *e = element(name);
 
-    if (Q_LIKELY(value)) {
-        if (type == TYPE_INT64) {
-            return bson_value_to_int64(value);
-        } else if (type == TYPE_INT32) {
-            return bson_value_to_int32(value);
+    if (Q_LIKELY(e)) {
+        if (e->type == TYPE_INT64) {
+            return bson_value_to_int64(data() + e->valueOffset);
+        } else if (e->type == TYPE_INT32) {
+            return bson_value_to_int32(data() + e->valueOffset);
         }
     }
 
@@ -446,11 +455,10 @@ int64_t BSONDocument::int64Value(const char *name, int64_t defaultValue) const
 
 bool BSONDocument::booleanValue(const char *name, bool defaultValue) const
 {
-    uint8_t type;
-    const void *value = bson_key_lookup(name, m_doc.constData(), &type);
+    const Element *e = element(name);
 
-    if (Q_LIKELY(value && (type == TYPE_BOOLEAN))) {
-        return bson_value_to_int8(value) == '\1';
+    if (Q_LIKELY(e && (e->type == TYPE_BOOLEAN))) {
+        return bson_value_to_int8(data() + e->valueOffset) == '\1';
     }
 
     return defaultValue;
@@ -458,15 +466,10 @@ bool BSONDocument::booleanValue(const char *name, bool defaultValue) const
 
 BSONDocument BSONDocument::subdocument(const char *name) const
 {
-    uint8_t type;
-    const void *value = bson_key_lookup(name, m_doc.constData(), &type);
+    const Element *e = element(name);
 
-    if (Q_LIKELY(value && (type == TYPE_DOCUMENT))) {
-        uint32_t len = 0;
-        const char *subdocumentData = (const char *) bson_value_to_document(value, &len);
-        if (len) {
-            return BSONDocument(QByteArray(subdocumentData, len));
-        }
+    if (Q_LIKELY(e && (e->type == TYPE_DOCUMENT) && e->valueLength)) {
+        return BSONDocument(m_doc, m_offset + e->valueOffset, e->valueLength);
     }
 
     return BSONDocument(QByteArray());
@@ -475,9 +478,21 @@ BSONDocument BSONDocument::subdocument(const char *name) const
 QHash<QByteArray, QByteArray> BSONDocument::byteArrayValuesHash() const
 {
     QHash<QByteArray, QByteArray> tmp;
+    tmp.reserve(m_index.count());
 
-    for (const void *item = bson_first_item(m_doc.constData()); item != 0; item = bson_next_item(m_doc.constData(), item)) {
-        tmp.insert(QByteArray(bson_key(item)), byteArrayValue(bson_key(item)));
+    const char *docBytes = data();
+    for (QVector<Element>::const_iterator i = m_index.constBegin(); i != m_index.constEnd(); ++i) {
+        QByteArray key(docBytes + i->keyOffset, i->keyLength);
+        uint32_t len = 0;
+        if (i->type == TYPE_STRING) {
+            const char *string = bson_value_to_string(docBytes + i->valueOffset, &len);
+            tmp.insert(key, QByteArray(string, len));
+        } else if (i->type == TYPE_BINARY) {
+            const char *binary = bson_value_to_binary(docBytes + i->valueOffset, &len);
+            tmp.insert(key, QByteArray(binary, len));
+        } else {
+            tmp.insert(key, QByteArray());
+        }
     }
 
     return tmp;
@@ -485,7 +500,11 @@ QHash<QByteArray, QByteArray> BSONDocument::byteArrayValuesHash() const
 
 QByteArray BSONDocument::toByteArray() const
 {
-    return m_doc;
+    if (m_offset == 0 && m_length == m_doc.count()) {
+        return m_doc;
+    }
+
+    return m_doc.mid(m_offset, m_length);
 }
 
 } // Utils
@@ -23,6 +23,7 @@
 #include <QtCore/QDateTime>
 #include <QtCore/QHash>
 #include <QtCore/QVariant>
+#include <QtCore/QVector>
 
 namespace Util
 {
@@ -45,13 +46,36 @@ class BSONDocument
         int64_t int64Value(const char *name, int64_t defaultValue = 0) const;
         bool booleanValue(const char *name, bool defaultValue = false) const;
 
+        /// Like byteArrayValue, but without copying: the returned array points into this
+        /// document's data and must not outlive it.
+        QByteArray byteArrayView(const char *name) const;
+
+        /// Subdocuments share this document's data, no bytes are copied.
         BSONDocument subdocument(const char *name) const;
         QHash<QByteArray, QByteArray> byteArrayValuesHash() const;
 
         QByteArray toByteArray() const;
 
     private:
+        // One entry per top-level element, offsets are relative to data()
+        struct Element {
+            int keyOffset;
+            int keyLength;
+            int valueOffset;
+            int valueLength;
+            uint8_t type;
+        };
+
+        BSONDocument(const QByteArray &document, int offset, int length);
+
+        void buildIndex();
+        const Element *element(const char *name) const;
+        inline const char *data() const { return m_doc.constData() + m_offset; }
+
         const QByteArray m_doc;
+        int m_offset;
+        int m_length;
+        QVector<Element> m_index;
 };
 
 } // Util
@@ -22,6 +22,7 @@
 #include <QtCore/QDebug>
 
 #include <stdint.h>
+#include <string.h>
 #if defined(__APPLE__)
   #include "apple_endian.h"
 #else
@@ -31,6 +32,7 @@
 #define BSON_TYPE_DOUBLE    '\x01'
 #define BSON_TYPE_STRING    '\x02'
 #define BSON_TYPE_DOCUMENT  '\x03'
+#define BSON_TYPE_ARRAY     '\x04'
 #define BSON_TYPE_BINARY    '\x05'
 #define BSON_TYPE_BOOLEAN   '\x08'
 #define BSON_TYPE_DATETIME  '\x09'
@@ -39,39 +41,6 @@
 
 #define BSON_SUBTYPE_DEFAULT_BINARY '\0'
 
-#define INT32_TO_BYTES(value, buf) \
-    union data32 { \
-        int64_t sval; \
-        uint64_t uval; \
-        char valBuf[4]; \
-    }; \
-    data32 d32; \
-    d32.sval = (value); \
-    d32.uval = htole32(d32.uval); \
-    buf = d32.valBuf;
-
-#define INT64_TO_BYTES(value, buf) \
-    union data64 { \
-        int64_t sval; \
-        uint64_t uval; \
-        char valBuf[8]; \
-    }; \
-    data64 d64; \
-    d64.sval = (value); \
-    d64.uval = htole64(d64.uval); \
-    buf = d64.valBuf;
-
-#define DOUBLE_TO_BYTES(value, buf) \
-    union data64 { \
-        double dval; \
-        uint64_t uval; \
-        char valBuf[8]; \
-    }; \
-    data64 d64; \
-    d64.dval = (value); \
-    d64.uval = htole64(d64.uval); \
-    buf = d64.valBuf;
-
 namespace Util
 {
 
@@ -80,72 +49,142 @@ BSONSerializer::BSONSerializer()
 {
 }
 
+BSONSerializer::BSONSerializer(int reserveSize)
+    : m_doc(QByteArray("\0\0\0\0", 4))
+{
+    reserve(reserveSize);
+}
+
 QByteArray BSONSerializer::document() const
 {
     return m_doc;
 }
 
+int BSONSerializer::size() const
+{
+    return m_doc.count();
+}
+
+void BSONSerializer::reserve(int size)
+{
+    m_doc.reserve(size);
+}
+
+void BSONSerializer::appendLittleEndian32(uint32_t value)
+{
+    uint32_t le = htole32(value);
+    m_doc.append(reinterpret_cast<const char *>(&le), sizeof(uint32_t));
+}
+
+void BSONSerializer::appendLittleEndian64(uint64_t value)
+{
+    uint64_t le = htole64(value);
+    m_doc.append(reinterpret_cast<const char *>(&le), sizeof(uint64_t));
+}
+
+void BSONSerializer::writeSizeAt(int offset)
+{
+    // Patch the size of the (sub)document starting at offset, in place
+    uint32_t le = htole32(static_cast<uint32_t>(m_doc.count() - offset));
+    memcpy(m_doc.data() + offset, &le, sizeof(uint32_t));
+}
+
+void BSONSerializer::appendElementHeader(char type, const char *name)
+{
+    m_doc.append(type);
+    m_doc.append(name, strlen(name) + 1);
+}
+
 void BSONSerializer::appendEndOfDocument()
 {
+    if (Q_UNLIKELY(!m_openSubdocuments.isEmpty())) {
+        qWarning() << "BSONSerializer: closing the document with" << m_openSubdocuments.count() << "open subdocuments";
+    }
+
     m_doc.append('\0');
+    writeSizeAt(0);
+}
+
+void BSONSerializer::beginSubdocument(const char *name)
+{
+    appendElementHeader(BSON_TYPE_DOCUMENT, name);
+    m_openSubdocuments.append(m_doc.count());
+    m_doc.append("\0\0\0\0", 4);
+}
 
-    char *sizeBuf;
-    INT32_TO_BYTES(m_doc.count(), sizeBuf)
+void BSONSerializer::endSubdocument()
+{
+    if (Q_UNLIKELY(m_openSubdocuments.isEmpty())) {
+        qWarning() << "BSONSerializer: endSubdocument called without a matching beginSubdocument";
+        return;
+    }
 
-    m_doc.replace(0, 4, QByteArray(sizeBuf, sizeof(int32_t)));
+    m_doc.append('\0');
+    writeSizeAt(m_openSubdocuments.last());
+    m_openSubdocuments.remove(m_openSubdocuments.count() - 1);
 }
 
-void BSONSerializer::appendDoubleValue(const char *name, double value)
+void BSONSerializer::beginArray(const char *name)
 {
-    char *valBuf;
-    DOUBLE_TO_BYTES(value, valBuf)
+    appendElementHeader(BSON_TYPE_ARRAY, name);
+    m_openSubdocuments.append(m_doc.count());
+    m_doc.append("\0\0\0\0", 4);
+}
 
-    m_doc.append(BSON_TYPE_DOUBLE);
-    m_doc.append(name, strlen(name) + 1);
-    m_doc.append(valBuf, 8);
+void BSONSerializer::endArray()
+{
+    // Arrays are framed exactly like documents
+    endSubdocument();
 }
 
-void BSONSerializer::appendInt32Value(const char *name, int32_t value)
+void BSONSerializer::appendElements(const QByteArray &document)
 {
-    char *valBuf;
-    INT32_TO_BYTES(value, valBuf)
+    // Skip the size header and the trailing terminator
+    if (Q_UNLIKELY(document.count() < 5)) {
+        qWarning() << "BSONSerializer: can't append the elements of an invalid document";
+        return;
+    }
 
-    m_doc.append(BSON_TYPE_INT32);
-    m_doc.append(name, strlen(name) + 1);
-    m_doc.append(valBuf, sizeof(int32_t));
+    m_doc.append(document.constData() + 4, document.count() - 5);
 }
 
-void BSONSerializer::appendInt64Value(const char *name, int64_t value)
+void BSONSerializer::appendDoubleValue(const char *name, double value)
 {
-    char *valBuf;
-    INT64_TO_BYTES(value, valBuf)
+    union {
+        double dval;
+        uint64_t uval;
+    } d64;
+    d64.dval = value;
+
+    appendElementHeader(BSON_TYPE_DOUBLE, name);
+    appendLittleEndian64(d64.uval);
+}
 
-    m_doc.append(BSON_TYPE_INT64);
-    m_doc.append(name, strlen(name) + 1);
-    m_doc.append(valBuf, sizeof(int64_t));
+void BSONSerializer::appendInt32Value(const char *name, int32_t value)
+{
+    appendElementHeader(BSON_TYPE_INT32, name);
+    appendLittleEndian32(static_cast<uint32_t>(value));
 }
 
-void BSONSerializer::appendBinaryValue(const char *name, const QByteArray &value)
+void BSONSerializer::appendInt64Value(const char *name, int64_t value)
 {
-    char *lenBuf;
-    INT32_TO_BYTES(value.count(), lenBuf)
+    appendElementHeader(BSON_TYPE_INT64, name);
+    appendLittleEndian64(static_cast<uint64_t>(value));
+}
 
-    m_doc.append(BSON_TYPE_BINARY);
-    m_doc.append(name, strlen(name) + 1);
-    m_doc.append(lenBuf, sizeof(int32_t));
+void BSONSerializer::appendBinaryValue(const char *name, const QByteArray &value)
+{
+    appendElementHeader(BSON_TYPE_BINARY, name);
+    appendLittleEndian32(value.count());
     m_doc.append(BSON_SUBTYPE_DEFAULT_BINARY);
     m_doc.append(value);
 }
 
 void BSONSerializer::appendASCIIString(const char *name, const QByteArray &string)
 {
-    char *lenBuf;
-    INT32_TO_BYTES(string.count() + 1, lenBuf)
-
-    m_doc.append(BSON_TYPE_STRING);
-    m_doc.append(name, strlen(name) + 1);
-    m_doc.append(lenBuf, sizeof(int32_t));
-    m_doc.append(string.constData());
+    appendElementHeader(BSON_TYPE_STRING, name);
+    appendLittleEndian32(string.count() + 1);
+    m_doc.append(string.constData(), string.size());
     m_doc.append('\0');
 }
 
@@ -157,18 +196,14 @@ void BSONSerializer::appendString(const char *name, const QString &string)
 void BSONSerializer::appendDateTime(const char *name, const QDateTime &dateTime)
 {
     int64_t millis = dateTime.toUTC().toMSecsSinceEpoch();
-    char *valBuf;
-    INT64_TO_BYTES(millis, valBuf)
 
-    m_doc.append(BSON_TYPE_DATETIME);
-    m_doc.append(name, strlen(name) + 1);
-    m_doc.append(valBuf, sizeof(int64_t));
+    appendElementHeader(BSON_TYPE_DATETIME, name);
+    appendLittleEndian64(static_cast<uint64_t>(millis));
 }
 
 void BSONSerializer::appendBooleanValue(const char *name, bool value)
 {
-    m_doc.append(BSON_TYPE_BOOLEAN);
-    m_doc.append(name, strlen(name) + 1);
+    appendElementHeader(BSON_TYPE_BOOLEAN, name);
     m_doc.append(value ? '\1' : '\0');
 }
 
@@ -203,33 +238,25 @@ void BSONSerializer::appendValue(const char *name, const QVariant &value)
 
 void BSONSerializer::appendDocument(const char *name, const QVariantHash &document)
 {
-    BSONSerializer subDocument;
+    beginSubdocument(name);
     for (QVariantHash::const_iterator i = document.constBegin(); i != document.constEnd(); ++i) {
-        subDocument.appendValue(i.key().toLatin1().constData(), i.value());
+        appendValue(i.key().toLatin1().constData(), i.value());
     }
-    subDocument.appendEndOfDocument();
-    appendDocument(name, subDocument.document());
+    endSubdocument();
 }
 
 void BSONSerializer::appendDocument(const char *name, const QVariantMap &document)
 {
-    BSONSerializer subDocument;
+    beginSubdocument(name);
     for (QVariantMap::const_iterator i = document.constBegin(); i != document.constEnd(); ++i) {
-        subDocument.appendValue(i.key().toLatin1().constData(), i.value());
+        appendValue(i.key().toLatin1().constData(), i.value());
     }
-    subDocument.appendEndOfDocument();
-    appendDocument(name, subDocument.document());
-}
-
-void BSONSerializer::beginSubdocument(const char *name)
-{
-    m_doc.append(BSON_TYPE_DOCUMENT);
-    m_doc.append(name, strlen(name) + 1);
+    endSubdocument();
 }
 
 void BSONSerializer::appendDocument(const char *name, const QByteArray &document)
 {
-    beginSubdocument(name);
+    appendElementHeader(BSON_TYPE_DOCUMENT, name);
     m_doc.append(document);
 }
 
@@ -23,6 +23,9 @@
 #include <QtCore/QDateTime>
 #include <QtCore/QVariantHash>
 #include <QtCore/QVariantMap>
+#include <QtCore/QVector>
+
+#include <stdint.h>
 
 namespace Util
 {
@@ -31,11 +34,31 @@ class BSONSerializer
 {
     public:
         BSONSerializer();
+        explicit BSONSerializer(int reserveSize);
 
         QByteArray document() const;
+        /// Bytes written so far
+        int size() const;
+
+        /// Preallocates room for a document of the given size in bytes
+        void reserve(int size);
 
         void appendEndOfDocument();
 
+        /**
+         * Starts a nested document, written in place: every value appended until the matching
+         * endSubdocument is a member of it. Subdocuments can be nested.
+         */
+        void beginSubdocument(const char *name);
+        void endSubdocument();
+
+        /// Same as beginSubdocument for an array, its members are named "0", "1"...
+        void beginArray(const char *name);
+        void endArray();
+
+        /// Appends the members of an encoded document to the current (sub)document
+        void appendElements(const QByteArray &document);
+
         void appendDoubleValue(const char *name, double value);
         void appendInt32Value(const char *name, int32_t value);
         void appendInt64Value(const char *name, int64_t value);
@@ -51,8 +74,13 @@ class BSONSerializer
         void appendDocument(const char *name, const QVariantMap &document);
 
     private:
-        void beginSubdocument(const char *name);
+        void appendElementHeader(char type, const char *name);
+        void appendLittleEndian32(uint32_t value);
+        void appendLittleEndian64(uint64_t value);
+        void writeSizeAt(int offset);
+
         QByteArray m_doc;
+        QVector<int> m_openSubdocuments;
 };
 
 }
@@ -0,0 +1,229 @@
+/*
+ * Copyright (C) 2017 Ispirata Srl
+ *
+ * This file is part of Astarte.
+ * Astarte is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Astarte is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Astarte.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "pathmatcher.h"
+
+#include <QtCore/QDebug>
+#include <QtCore/QHash>
+#include <QtCore/QMap>
+#include <QtCore/QtAlgorithms>
+
+#include <string.h>
+
+namespace Util
+{
+
+struct TrieNode {
+    TrieNode() : parameter(-1), mappingIndex(-1), literalCount(0) {}
+
+    QMap<QByteArray, int> literals;
+    int parameter;
+    int mappingIndex;
+    // Literal tokens on the way to this node: when several mappings match, the most literal one wins
+    int literalCount;
+};
+
+static int compareToken(const QByteArray &edgeToken, const char *token, int tokenLength)
+{
+    int cmp = memcmp(edgeToken.constData(), token, qMin(edgeToken.count(), tokenLength));
+    if (cmp) {
+        return cmp;
+    }
+
+    return edgeToken.count() - tokenLength;
+}
+
+static QByteArray nodeSetKey(const QVector<int> &nodes)
+{
+    return QByteArray(reinterpret_cast<const char *>(nodes.constData()), nodes.count() * sizeof(int));
+}
+
+PathMatcher::PathMatcher()
+{
+}
+
+void PathMatcher::clear()
+{
+    m_states.clear();
+}
+
+bool PathMatcher::isEmpty() const
+{
+    return m_states.isEmpty();
+}
+
+void PathMatcher::compile(const QList<QByteArray> &mappings)
+{
+    m_states.clear();
+
+    if (mappings.isEmpty()) {
+        return;
+    }
+
+    // Build a token trie first, parametric tokens share a single edge per node
+    QVector<TrieNode> trie(1);
+    for (int m = 0; m < mappings.count(); ++m) {
+        int node = 0;
+        Q_FOREACH (const QByteArray &token, mappings.at(m).mid(1).split('/')) {
+            bool parametric = token.startsWith("%{");
+            int next = parametric ? trie.at(node).parameter : trie.at(node).literals.value(token, -1);
+            if (next < 0) {
+                next = trie.count();
+                TrieNode child;
+                child.literalCount = trie.at(node).literalCount + (parametric ? 0 : 1);
+                trie.append(child);
+                if (parametric) {
+                    trie[node].parameter = next;
+                } else {
+                    trie[node].literals.insert(token, next);
+                }
+            }
+            node = next;
+        }
+
+        if (trie.at(node).mappingIndex >= 0) {
+            qWarning() << "Mapping" << mappings.at(m) << "is ambiguous with" << mappings.at(trie.at(node).mappingIndex);
+        } else {
+            trie[node].mappingIndex = m;
+        }
+    }
+
+    // Then turn it into a DFA: each state is the set of trie nodes reachable with the tokens seen so far
+    QHash<QByteArray, int> stateIds;
+    QList< QVector<int> > stateNodes;
+
+    stateNodes.append(QVector<int>(1, 0));
+    stateIds.insert(nodeSetKey(stateNodes.first()), 0);
+    m_states.append(State());
+
+    for (int s = 0; s < stateNodes.count(); ++s) {
+        QMap< QByteArray, QVector<int> > literalTargets;
+        QVector<int> parameterTargets;
+        int mappingIndex = -1;
+        int bestLiteralCount = -1;
+
+        Q_FOREACH (int n, stateNodes.at(s)) {
+            const TrieNode &node = trie.at(n);
+            for (QMap<QByteArray, int>::const_iterator i = node.literals.constBegin(); i != node.literals.constEnd(); ++i) {
+                literalTargets[i.key()].append(i.value());
+            }
+            if (node.parameter >= 0) {
+                parameterTargets.append(node.parameter);
+            }
+            if (node.mappingIndex >= 0 && node.literalCount > bestLiteralCount) {
+                mappingIndex = node.mappingIndex;
+                bestLiteralCount = node.literalCount;
+            }
+        }
+
+        State state;
+        state.mappingIndex = mappingIndex;
+
+        // A literal token also follows every parametric edge of the set
+        for (QMap< QByteArray, QVector<int> >::const_iterator i = literalTargets.constBegin(); i != literalTargets.constEnd(); ++i) {
+            QVector<int> targets = i.value() + parameterTargets;
+            qSort(targets);
+
+            QByteArray key = nodeSetKey(targets);
+            if (!stateIds.contains(key)) {
+                stateIds.insert(key, stateNodes.count());
+                stateNodes.append(targets);
+                m_states.append(State());
+            }
+
+            Edge edge;
+            edge.token = i.key();
+            edge.next = stateIds.value(key);
+            state.edges.append(edge);
+        }
+
+        if (!parameterTargets.isEmpty()) {
+            qSort(parameterTargets);
+
+            QByteArray key = nodeSetKey(parameterTargets);
+            if (!stateIds.contains(key)) {
+                stateIds.insert(key, stateNodes.count());
+                stateNodes.append(parameterTargets);
+                m_states.append(State());
+            }
+            state.parameterNext = stateIds.value(key);
+        }
+
+        m_states[s] = state;
+    }
+
+    m_states.squeeze();
+}
+
+int PathMatcher::transition(int state, const char *token, int tokenLength) const
+{
+    const State &s = m_states.at(state);
+
+    // Edges are sorted by token (QMap order), binary search them
+    int low = 0;
+    int high = s.edges.count() - 1;
+    while (low <= high) {
+        int middle = (low + high) / 2;
+        int cmp = compareToken(s.edges.at(middle).token, token, tokenLength);
+        if (cmp == 0) {
+            return s.edges.at(middle).next;
+        } else if (cmp < 0) {
+            low = middle + 1;
+        } else {
+            high = middle - 1;
+        }
+    }
+
+    // Parameters never match empty tokens
+    return tokenLength > 0 ? s.parameterNext : -1;
+}
+
+int PathMatcher::match(const QByteArray &path) const
+{
+    return match(path.constData(), path.count());
+}
+
+int PathMatcher::match(const char *path, int length) const
+{
+    if (Q_UNLIKELY(m_states.isEmpty())) {
+        return -1;
+    }
+
+    int state = 0;
+    int tokenStart = (length > 0 && path[0] == '/') ? 1 : 0;
+    while (true) {
+        int tokenEnd = tokenStart;
+        while (tokenEnd < length && path[tokenEnd] != '/') {
+            ++tokenEnd;
+        }
+
+        state = transition(state, path + tokenStart, tokenEnd - tokenStart);
+        if (state < 0) {
+            return -1;
+        }
+
+        if (tokenEnd >= length) {
+            break;
+        }
+        tokenStart = tokenEnd + 1;
+    }
+
+    return m_states.at(state).mappingIndex;
+}
+
+} // Util
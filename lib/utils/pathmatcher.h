@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2017 Ispirata Srl
+ *
+ * This file is part of Astarte.
+ * Astarte is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Astarte is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Astarte.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PATH_MATCHER_H_
+#define _PATH_MATCHER_H_
+
+#include <QtCore/QByteArray>
+#include <QtCore/QList>
+#include <QtCore/QVector>
+
+namespace Util
+{
+
+/**
+ * Matches paths against a set of interface mappings, such as /%{sensor_id}/value.
+ *
+ * The mappings are compiled once into a deterministic automaton with one transition per
+ * path token: a parametric token (%{...}) matches any non-empty token, literal tokens take
+ * precedence over it. Matching a path is a single pass over its bytes and does not allocate.
+ */
+class PathMatcher
+{
+    public:
+        PathMatcher();
+
+        /// Compiles the matcher, the index of each mapping in the list is what match returns
+        void compile(const QList<QByteArray> &mappings);
+        void clear();
+        bool isEmpty() const;
+
+        /// @returns The index of the mapping matching path, or -1 if none does
+        int match(const QByteArray &path) const;
+        int match(const char *path, int length) const;
+
+    private:
+        struct Edge {
+            QByteArray token;
+            int next;
+        };
+
+        struct State {
+            State() : parameterNext(-1), mappingIndex(-1) {}
+
+            QVector<Edge> edges;
+            int parameterNext;
+            int mappingIndex;
+        };
+
+        int transition(int state, const char *token, int tokenLength) const;
+
+        QVector<State> m_states;
+};
+
+} // Util
+
+#endif
@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2017 Ispirata Srl
+ *
+ * This file is part of Astarte.
+ * Astarte is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Astarte is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Astarte.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "payloadcompressor.h"
+
+#include "bsonserializer.h"
+
+#include <QtCore/QDebug>
+
+#include <string.h>
+#include <zlib.h>
+
+// zlib only looks at the last 32KB of a preset dictionary
+#define MAX_DICTIONARY_SIZE 32768
+// BSON framing around the compressed stream
+#define COMPRESSED_DOCUMENT_OVERHEAD 13
+
+namespace Util
+{
+
+PayloadCompressor::PayloadCompressor()
+    : m_enabled(false)
+    , m_threshold(0)
+{
+}
+
+PayloadCompressor::PayloadCompressor(int threshold, const QByteArray &dictionary)
+    : m_enabled(true)
+    , m_threshold(qMax(0, threshold))
+    , m_dictionary(dictionary.right(MAX_DICTIONARY_SIZE))
+{
+}
+
+bool PayloadCompressor::isEnabled() const
+{
+    return m_enabled;
+}
+
+int PayloadCompressor::threshold() const
+{
+    return m_threshold;
+}
+
+QByteArray PayloadCompressor::dictionary() const
+{
+    return m_dictionary;
+}
+
+QByteArray PayloadCompressor::compress(const QByteArray &document) const
+{
+    if (!m_enabled || document.count() < m_threshold) {
+        return document;
+    }
+
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (Q_UNLIKELY(deflateInit(&stream, Z_DEFAULT_COMPRESSION) != Z_OK)) {
+        qWarning() << "Could not initialize payload compression";
+        return document;
+    }
+
+    if (!m_dictionary.isEmpty() && Q_UNLIKELY(deflateSetDictionary(&stream, reinterpret_cast<const Bytef *>(m_dictionary.constData()),
+                                                                     m_dictionary.count()) != Z_OK)) {
+        qWarning() << "Could not set the payload compression dictionary";
+        deflateEnd(&stream);
+        return document;
+    }
+
+    QByteArray compressed;
+    compressed.resize(deflateBound(&stream, document.count()));
+    stream.next_in = const_cast<Bytef *>(reinterpret_cast<const Bytef *>(document.constData()));
+    stream.avail_in = document.count();
+    stream.next_out = reinterpret_cast<Bytef *>(compressed.data());
+    stream.avail_out = compressed.count();
+
+    int result = deflate(&stream, Z_FINISH);
+    deflateEnd(&stream);
+    if (Q_UNLIKELY(result != Z_STREAM_END)) {
+        qWarning() << "Payload compression failed, sending it uncompressed";
+        return document;
+    }
+    compressed.resize(stream.total_out);
+
+    // Incompressible data, don't make the receiver pay for nothing
+    if (compressed.count() + COMPRESSED_DOCUMENT_OVERHEAD >= document.count()) {
+        return document;
+    }
+
+    BSONSerializer serializer(compressed.count() + COMPRESSED_DOCUMENT_OVERHEAD);
+    serializer.appendBinaryValue("z", compressed);
+    serializer.appendEndOfDocument();
+    return serializer.document();
+}
+
+} // Util
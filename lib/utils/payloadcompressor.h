@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2017 Ispirata Srl
+ *
+ * This file is part of Astarte.
+ * Astarte is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Astarte is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Astarte.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _PAYLOAD_COMPRESSOR_H_
+#define _PAYLOAD_COMPRESSOR_H_
+
+#include <QtCore/QByteArray>
+
+namespace Util
+{
+
+/**
+ * Optional zlib compression of serialized payloads.
+ *
+ * A compressed payload is a BSON document with a single binary "z" member holding the zlib
+ * stream of the original document. With a preset dictionary, trained on typical payloads of the
+ * mapping, even short repetitive payloads compress well: the receiver needs the same dictionary,
+ * which the zlib stream identifies by its Adler-32 checksum.
+ */
+class PayloadCompressor
+{
+    public:
+        /// A disabled compressor, compress returns its input
+        PayloadCompressor();
+        explicit PayloadCompressor(int threshold, const QByteArray &dictionary = QByteArray());
+
+        bool isEnabled() const;
+        int threshold() const;
+        QByteArray dictionary() const;
+
+        /// @returns The compressed document, or document itself if smaller than threshold or not worth compressing
+        QByteArray compress(const QByteArray &document) const;
+
+    private:
+        bool m_enabled;
+        int m_threshold;
+        QByteArray m_dictionary;
+};
+
+} // Util
+
+#endif
@@ -0,0 +1,566 @@
+/*
+ * Copyright (C) 2017 Ispirata Srl
+ *
+ * This file is part of Astarte.
+ * Astarte is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Astarte is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Astarte.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "segmentedlog.h"
+
+#include <QtCore/QDateTime>
+#include <QtCore/QDebug>
+#include <QtCore/QDir>
+#include <QtCore/QFileInfo>
+#include <QtCore/QStringList>
+#include <QtCore/QtEndian>
+
+#include <stdio.h>
+#include <unistd.h>
+#include <zlib.h>
+
+// length, crc, id, expiry
+#define HEADER_SIZE 24
+// id (or minus the cursor), crc
+#define ACKNOWLEDGEMENT_SIZE 12
+// The acknowledgements file is rewritten once it holds this many stale records
+#define ACKNOWLEDGEMENTS_COMPACTION_THRESHOLD 4096
+
+#define SPARE_SEGMENT "spare.seg"
+#define ACKNOWLEDGEMENTS_FILE "acknowledgements"
+
+namespace Util
+{
+
+static quint32 recordCrc(const uchar *header, const QByteArray &data)
+{
+    // Covers id, expiry and data. A corrupted length makes the data, and thus the crc, wrong
+    uLong crc = crc32(0L, Z_NULL, 0);
+    crc = crc32(crc, header + 8, HEADER_SIZE - 8);
+    crc = crc32(crc, reinterpret_cast<const Bytef *>(data.constData()), data.size());
+    return crc;
+}
+
+static void encodeHeader(const QByteArray &data, qint64 id, qint64 expiry, uchar *raw)
+{
+    qToLittleEndian<quint32>(data.size(), raw);
+    qToLittleEndian<quint64>(id, raw + 8);
+    qToLittleEndian<quint64>(expiry, raw + 16);
+    qToLittleEndian<quint32>(recordCrc(raw, data), raw + 4);
+}
+
+static void appendAcknowledgement(QByteArray *content, qint64 value)
+{
+    uchar raw[ACKNOWLEDGEMENT_SIZE];
+    qToLittleEndian<quint64>(value, raw);
+    qToLittleEndian<quint32>(crc32(crc32(0L, Z_NULL, 0), raw, 8), raw + 8);
+    content->append(reinterpret_cast<const char *>(raw), ACKNOWLEDGEMENT_SIZE);
+}
+
+SegmentedLog::SegmentedLog(const QString &directory, qint64 segmentSize)
+    : m_directory(directory)
+    , m_segmentSize(segmentSize)
+    , m_open(false)
+    , m_nextId(1)
+    , m_acknowledgementRecords(0)
+    , m_cursor(1)
+{
+}
+
+SegmentedLog::~SegmentedLog()
+{
+    if (m_open) {
+        sync();
+    }
+}
+
+bool SegmentedLog::isOpen() const
+{
+    return m_open;
+}
+
+QString SegmentedLog::segmentPath(qint64 baseId) const
+{
+    return QString("%1/%2.seg").arg(m_directory).arg(baseId, 20, 10, QLatin1Char('0'));
+}
+
+bool SegmentedLog::open()
+{
+    if (m_open) {
+        return true;
+    }
+
+    QDir dir(m_directory);
+    if (!dir.exists() && !dir.mkpath(dir.absolutePath())) {
+        qWarning() << "Could not create log directory" << m_directory;
+        return false;
+    }
+
+    m_segments.clear();
+    m_nextId = 1;
+    Q_FOREACH (const QString &name, dir.entryList(QStringList() << QLatin1String("*.seg"), QDir::Files)) {
+        bool ok;
+        qint64 baseId = QFileInfo(name).baseName().toLongLong(&ok);
+        if (ok && baseId > 0) {
+            m_segments.insert(baseId, 0);
+        }
+    }
+
+    QMap<qint64, qint64>::iterator segment = m_segments.begin();
+    while (segment != m_segments.end()) {
+        qint64 count = 0;
+        qint64 size = segment.key() >= m_nextId ? scanSegment(segment.key(), &count) : 0;
+        if (count == 0) {
+            // Empty, or overlapping the previous segment: nothing to recover in there
+            QFile::remove(segmentPath(segment.key()));
+            segment = m_segments.erase(segment);
+            continue;
+        }
+
+        segment.value() = size;
+        m_nextId = segment.key() + count;
+        ++segment;
+    }
+
+    qint64 recoveredNextId = m_nextId;
+    if (!loadAcknowledgements()) {
+        return false;
+    }
+
+    // Ids are never reused, even when every segment is gone. Records in a segment have contiguous ids
+    m_nextId = qMax(m_nextId, m_cursor);
+    if (m_segments.isEmpty() || m_nextId != recoveredNextId) {
+        m_segments.insert(m_nextId, 0);
+    }
+
+    QMap<qint64, qint64>::iterator head = m_segments.end() - 1;
+    m_head.setFileName(segmentPath(head.key()));
+    if (!m_head.open(QIODevice::ReadWrite) || !m_head.resize(head.value()) || !m_head.seek(head.value())) {
+        qWarning() << "Could not open log segment" << m_head.fileName() << m_head.errorString();
+        return false;
+    }
+
+    m_open = true;
+    recycleSegments();
+
+    qDebug() << "Recovered" << m_nextId - m_cursor - m_acknowledged.count() << "pending records in" << m_directory;
+    return true;
+}
+
+qint64 SegmentedLog::scanSegment(qint64 baseId, qint64 *count) const
+{
+    *count = 0;
+
+    QFile file(segmentPath(baseId));
+    if (!file.open(QIODevice::ReadOnly)) {
+        qWarning() << "Could not open log segment" << file.fileName() << file.errorString();
+        return 0;
+    }
+
+    qint64 fileSize = file.size();
+    qint64 offset = 0;
+    uchar raw[HEADER_SIZE];
+    while (offset + HEADER_SIZE <= fileSize) {
+        if (file.read(reinterpret_cast<char *>(raw), HEADER_SIZE) != HEADER_SIZE) {
+            break;
+        }
+
+        quint32 length = qFromLittleEndian<quint32>(raw);
+        qint64 id = qFromLittleEndian<quint64>(raw + 8);
+        // A recycled segment still holds older records past the new ones: their ids don't follow
+        if (id != baseId + *count || offset + HEADER_SIZE + length > fileSize) {
+            break;
+        }
+
+        QByteArray data = file.read(length);
+        if (static_cast<quint32>(data.size()) != length || recordCrc(raw, data) != qFromLittleEndian<quint32>(raw + 4)) {
+            break;
+        }
+
+        offset += HEADER_SIZE + length;
+        ++*count;
+    }
+
+    if (offset < fileSize) {
+        qDebug() << "Ignoring" << fileSize - offset << "bytes past the last valid record of" << file.fileName();
+    }
+
+    return offset;
+}
+
+bool SegmentedLog::loadAcknowledgements()
+{
+    m_acknowledgements.setFileName(QString("%1/" ACKNOWLEDGEMENTS_FILE).arg(m_directory));
+    m_acknowledged.clear();
+    m_cursor = 1;
+
+    QFile file(m_acknowledgements.fileName());
+    if (file.open(QIODevice::ReadOnly)) {
+        QByteArray content = file.readAll();
+        const uchar *raw = reinterpret_cast<const uchar *>(content.constData());
+        for (int offset = 0; offset + ACKNOWLEDGEMENT_SIZE <= content.size(); offset += ACKNOWLEDGEMENT_SIZE) {
+            if (crc32(crc32(0L, Z_NULL, 0), raw + offset, 8) != qFromLittleEndian<quint32>(raw + offset + 8)) {
+                qDebug() << "Ignoring torn acknowledgements in" << file.fileName();
+                break;
+            }
+
+            qint64 value = qFromLittleEndian<quint64>(raw + offset);
+            if (value < 0) {
+                m_cursor = qMax(m_cursor, -value);
+            } else {
+                m_acknowledged.insert(value);
+            }
+        }
+    }
+
+    if (!m_segments.isEmpty()) {
+        m_cursor = qMax(m_cursor, m_segments.constBegin().key());
+    }
+    while (m_cursor < m_nextId && m_acknowledged.remove(m_cursor)) {
+        ++m_cursor;
+    }
+
+    // Acknowledgements of records lost with a torn segment would otherwise hide the new ones
+    QSet<qint64>::iterator i = m_acknowledged.begin();
+    while (i != m_acknowledged.end()) {
+        if (*i < m_cursor || *i >= m_nextId) {
+            i = m_acknowledged.erase(i);
+        } else {
+            ++i;
+        }
+    }
+
+    return writeAcknowledgements();
+}
+
+bool SegmentedLog::writeAcknowledgements()
+{
+    QByteArray content;
+    appendAcknowledgement(&content, -m_cursor);
+    Q_FOREACH (qint64 id, m_acknowledged) {
+        appendAcknowledgement(&content, id);
+    }
+
+    QString path = m_acknowledgements.fileName();
+    QFile file(path + QLatin1String(".new"));
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) || file.write(content) != content.size()
+            || !file.flush() || ::fsync(file.handle()) != 0) {
+        qWarning() << "Could not write" << file.fileName() << file.errorString();
+        return false;
+    }
+    file.close();
+
+    m_acknowledgements.close();
+    // Atomically replaces the old file, QFile::rename refuses to overwrite
+    if (::rename(QFile::encodeName(file.fileName()).constData(), QFile::encodeName(path).constData()) != 0) {
+        qWarning() << "Could not replace" << path;
+        return false;
+    }
+
+    if (!m_acknowledgements.open(QIODevice::WriteOnly | QIODevice::Append)) {
+        qWarning() << "Could not open" << path << m_acknowledgements.errorString();
+        return false;
+    }
+
+    m_acknowledgementRecords = 1 + m_acknowledged.count();
+    return true;
+}
+
+bool SegmentedLog::rotate()
+{
+    if (m_head.isOpen()) {
+        // Segments are synced only while they are the head one
+        m_head.flush();
+        ::fsync(m_head.handle());
+        m_head.close();
+    }
+
+    QString path = segmentPath(m_nextId);
+    QString spare = QString("%1/" SPARE_SEGMENT).arg(m_directory);
+    if (QFile::exists(spare) && !QFile::rename(spare, path)) {
+        qWarning() << "Could not recycle" << spare;
+    }
+
+    // No truncation: a recycled segment is overwritten in place, its stale records are told apart by their ids
+    m_head.setFileName(path);
+    if (!m_head.open(QIODevice::ReadWrite)) {
+        qWarning() << "Could not open log segment" << path << m_head.errorString();
+        return false;
+    }
+
+    m_segments.insert(m_nextId, 0);
+    return true;
+}
+
+void SegmentedLog::recycleSegments()
+{
+    // Every record of a segment is acknowledged once the next one starts at or below the cursor.
+    // The head segment is never recycled.
+    while (m_segments.count() > 1 && (m_segments.constBegin() + 1).key() <= m_cursor) {
+        qint64 baseId = m_segments.constBegin().key();
+        QString path = segmentPath(baseId);
+        QString spare = QString("%1/" SPARE_SEGMENT).arg(m_directory);
+
+        // Keep one spare around so rotating does not need to allocate a new file
+        if (QFile::exists(spare) || !QFile::rename(path, spare)) {
+            if (!QFile::remove(path)) {
+                qWarning() << "Could not remove log segment" << path;
+            }
+        }
+
+        m_segments.erase(m_segments.begin());
+        if (m_readPosition.baseId == baseId) {
+            m_readPosition = Position();
+        }
+        if (m_expiryPosition.baseId == baseId) {
+            m_expiryPosition = Position();
+        }
+    }
+}
+
+qint64 SegmentedLog::append(const QByteArray &data, qint64 expiry, qint64 id)
+{
+    if (Q_UNLIKELY(!m_open)) {
+        return -1;
+    }
+
+    bool skip = false;
+    if (id > 0 && id != m_nextId) {
+        if (id < m_nextId) {
+            qWarning() << "Can't append record" << id << "to" << m_directory << ", next id is" << m_nextId;
+            return -1;
+        }
+
+        // Ids are contiguous within a segment, skipping some starts a new one. Nothing will ever
+        // be appended with the skipped ones, they must not hold the cursor back.
+        qint64 skipped = m_nextId;
+        m_nextId = id;
+        for (; skipped < id; ++skipped) {
+            acknowledge(skipped);
+        }
+        skip = true;
+    }
+
+    qint64 headSize = (m_segments.constEnd() - 1).value();
+    if (skip || !m_head.isOpen() || (headSize > 0 && headSize + HEADER_SIZE + data.size() > m_segmentSize)) {
+        if (!rotate()) {
+            return -1;
+        }
+        headSize = 0;
+    }
+
+    uchar header[HEADER_SIZE];
+    encodeHeader(data, m_nextId, expiry, header);
+
+    if (m_head.write(reinterpret_cast<const char *>(header), HEADER_SIZE) != HEADER_SIZE
+            || m_head.write(data) != data.size() || !m_head.flush()) {
+        qWarning() << "Could not append to log segment" << m_head.fileName() << m_head.errorString();
+        // The next append overwrites whatever made it to the file
+        m_head.seek(headSize);
+        return -1;
+    }
+
+    (m_segments.end() - 1).value() = headSize + HEADER_SIZE + data.size();
+    return m_nextId++;
+}
+
+bool SegmentedLog::acknowledge(qint64 id)
+{
+    if (Q_UNLIKELY(!m_open) || id >= m_nextId) {
+        return false;
+    }
+
+    if (id < m_cursor || m_acknowledged.contains(id)) {
+        return true;
+    }
+
+    QByteArray record;
+    appendAcknowledgement(&record, id);
+    if (m_acknowledgements.write(record) != record.size() || !m_acknowledgements.flush()) {
+        qWarning() << "Could not write acknowledgement to" << m_acknowledgements.fileName() << m_acknowledgements.errorString();
+        return false;
+    }
+    ++m_acknowledgementRecords;
+
+    m_acknowledged.insert(id);
+    bool advanced = false;
+    while (m_acknowledged.remove(m_cursor)) {
+        ++m_cursor;
+        advanced = true;
+    }
+
+    if (advanced) {
+        recycleSegments();
+    }
+
+    if (m_acknowledgementRecords > ACKNOWLEDGEMENTS_COMPACTION_THRESHOLD
+            && m_acknowledgementRecords > 2 * (m_acknowledged.count() + 1)) {
+        writeAcknowledgements();
+    }
+
+    return true;
+}
+
+SegmentedLog::Position SegmentedLog::locate(qint64 id, const Position &hint) const
+{
+    if (m_segments.isEmpty()) {
+        return Position();
+    }
+
+    QMap<qint64, qint64>::const_iterator segment = m_segments.upperBound(id);
+    if (segment != m_segments.constBegin()) {
+        --segment;
+    }
+
+    if (hint.baseId == segment.key() && hint.id <= id) {
+        return hint;
+    }
+
+    Position position;
+    position.baseId = segment.key();
+    position.id = segment.key();
+    return position;
+}
+
+bool SegmentedLog::advance(QFile &file, Position *position, Header *header)
+{
+    while (position->offset >= m_segments.value(position->baseId, 0)) {
+        QMap<qint64, qint64>::const_iterator next = m_segments.upperBound(position->baseId);
+        if (next == m_segments.constEnd()) {
+            return false;
+        }
+
+        position->baseId = next.key();
+        position->offset = 0;
+        position->id = next.key();
+        file.close();
+    }
+
+    if (!file.isOpen()) {
+        file.setFileName(segmentPath(position->baseId));
+        if (!file.open(QIODevice::ReadOnly)) {
+            qWarning() << "Could not open log segment" << file.fileName() << file.errorString();
+            return false;
+        }
+    }
+
+    // Records were validated when recovering or written by us, no need to check their crc again
+    uchar raw[HEADER_SIZE];
+    if (!file.seek(position->offset) || file.read(reinterpret_cast<char *>(raw), HEADER_SIZE) != HEADER_SIZE) {
+        qWarning() << "Could not read log segment" << file.fileName() << file.errorString();
+        return false;
+    }
+
+    header->length = qFromLittleEndian<quint32>(raw);
+    header->crc = qFromLittleEndian<quint32>(raw + 4);
+    header->id = qFromLittleEndian<quint64>(raw + 8);
+    header->expiry = qFromLittleEndian<quint64>(raw + 16);
+    return true;
+}
+
+QList<SegmentedLog::Record> SegmentedLog::read(qint64 fromId, qint64 toId, int limit)
+{
+    QList<Record> records;
+
+    qint64 start = qMax(fromId + 1, m_cursor);
+    if (Q_UNLIKELY(!m_open) || start > toId || start >= m_nextId || limit <= 0) {
+        return records;
+    }
+
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    QList<qint64> expired;
+
+    QFile file;
+    Position position = locate(start, m_readPosition);
+    Header header;
+    while (records.count() < limit && advance(file, &position, &header) && header.id <= toId) {
+        if (header.id >= start && !m_acknowledged.contains(header.id)) {
+            if (header.expiry > 0 && header.expiry <= now) {
+                expired.append(header.id);
+            } else {
+                Record record;
+                record.id = header.id;
+                record.expiry = header.expiry;
+                record.data = file.read(header.length);
+                if (static_cast<quint32>(record.data.size()) != header.length) {
+                    qWarning() << "Could not read log segment" << file.fileName() << file.errorString();
+                    break;
+                }
+                records.append(record);
+            }
+        }
+
+        position.offset += HEADER_SIZE + header.length;
+        position.id = header.id + 1;
+    }
+    m_readPosition = position;
+
+    Q_FOREACH (qint64 id, expired) {
+        acknowledge(id);
+    }
+
+    return records;
+}
+
+int SegmentedLog::acknowledgeExpired(qint64 now, int limit)
+{
+    if (Q_UNLIKELY(!m_open)) {
+        return 0;
+    }
+
+    QList<qint64> expired;
+
+    // Resumes where the previous sweep stopped, and starts over once it reaches the end
+    QFile file;
+    Position position = locate(qMax(m_cursor, m_expiryPosition.id), m_expiryPosition);
+    Header header;
+    bool more = true;
+    while (expired.count() < limit && (more = advance(file, &position, &header))) {
+        if (header.id >= m_cursor && header.expiry > 0 && header.expiry <= now && !m_acknowledged.contains(header.id)) {
+            expired.append(header.id);
+        }
+
+        position.offset += HEADER_SIZE + header.length;
+        position.id = header.id + 1;
+    }
+    m_expiryPosition = more ? position : Position();
+
+    Q_FOREACH (qint64 id, expired) {
+        acknowledge(id);
+    }
+
+    return expired.count();
+}
+
+qint64 SegmentedLog::lastId() const
+{
+    return m_nextId - 1;
+}
+
+bool SegmentedLog::sync()
+{
+    bool ok = true;
+    if (m_head.isOpen()) {
+        ok = m_head.flush() && ::fsync(m_head.handle()) == 0;
+    }
+    if (m_acknowledgements.isOpen()) {
+        ok = m_acknowledgements.flush() && ::fsync(m_acknowledgements.handle()) == 0 && ok;
+    }
+
+    if (!ok) {
+        qWarning() << "Could not sync log" << m_directory;
+    }
+    return ok;
+}
+
+} // Util
@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2017 Ispirata Srl
+ *
+ * This file is part of Astarte.
+ * Astarte is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Astarte is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Astarte.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SEGMENTED_LOG_H_
+#define _SEGMENTED_LOG_H_
+
+#include <QtCore/QByteArray>
+#include <QtCore/QFile>
+#include <QtCore/QList>
+#include <QtCore/QMap>
+#include <QtCore/QSet>
+#include <QtCore/QString>
+
+namespace Util
+{
+
+/**
+ * Append-only FIFO store of opaque records, split into segment files.
+ *
+ * Records get increasing ids and are framed by their length and a CRC32. Acknowledgements live in
+ * a separate file, as a cursor (every id below it is acknowledged) plus the ids acknowledged out
+ * of order above it. Segments holding only acknowledged records are recycled for new ones.
+ * Opening the log scans the segments and drops everything from the first torn or corrupted record.
+ */
+class SegmentedLog
+{
+    public:
+        struct Record {
+            qint64 id;
+            qint64 expiry;
+            QByteArray data;
+        };
+
+        explicit SegmentedLog(const QString &directory, qint64 segmentSize = 4 * 1024 * 1024);
+        ~SegmentedLog();
+
+        bool open();
+        bool isOpen() const;
+
+        /// @p expiry is in msecs since the epoch, 0 means never. @p id, if given, must not be lower than
+        /// the next one, ids in between are skipped. @returns The record id, or -1 on failure
+        qint64 append(const QByteArray &data, qint64 expiry = 0, qint64 id = -1);
+        bool acknowledge(qint64 id);
+        /// Acknowledges at most limit records expired at @p now. @returns How many were acknowledged
+        int acknowledgeExpired(qint64 now, int limit);
+
+        /// @returns The id of the last appended record, 0 if nothing was ever appended
+        qint64 lastId() const;
+        /// @returns At most limit pending and not expired records with fromId < id <= toId, in id order
+        QList<Record> read(qint64 fromId, qint64 toId, int limit);
+
+        /// Makes appends and acknowledgements durable
+        bool sync();
+
+    private:
+        Q_DISABLE_COPY(SegmentedLog)
+
+        struct Header {
+            quint32 length;
+            quint32 crc;
+            qint64 id;
+            qint64 expiry;
+        };
+
+        struct Position {
+            Position() : baseId(-1), offset(0), id(0) {}
+
+            qint64 baseId;
+            qint64 offset;
+            qint64 id;
+        };
+
+        QString segmentPath(qint64 baseId) const;
+        qint64 scanSegment(qint64 baseId, qint64 *count) const;
+        bool loadAcknowledgements();
+        bool writeAcknowledgements();
+        bool rotate();
+        void recycleSegments();
+        bool advance(QFile &file, Position *position, Header *header);
+        Position locate(qint64 id, const Position &hint) const;
+
+        QString m_directory;
+        qint64 m_segmentSize;
+        bool m_open;
+
+        // Size of each segment by base id, the last one is open for appending
+        QMap<qint64, qint64> m_segments;
+        QFile m_head;
+        qint64 m_nextId;
+
+        QFile m_acknowledgements;
+        int m_acknowledgementRecords;
+        qint64 m_cursor;
+        QSet<qint64> m_acknowledged;
+
+        // Where the last read stopped, so paging through the log does not scan it from the start
+        Position m_readPosition;
+        Position m_expiryPosition;
+};
+
+} // Util
+
+#endif
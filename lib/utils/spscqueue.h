@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2017 Ispirata Srl
+ *
+ * This file is part of Astarte.
+ * Astarte is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Astarte is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Astarte.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SPSC_QUEUE_H_
+#define _SPSC_QUEUE_H_
+
+#include <QtCore/QAtomicInt>
+#include <QtCore/QAtomicPointer>
+
+// Qt4 atomics have no plain acquire load: fetchAndAddAcquire(0) is used in its place.
+
+namespace Util
+{
+
+/**
+ * Unbounded lock-free queue for exactly one producer thread and one consumer thread.
+ *
+ * A linked list with a dummy head: the producer only touches the tail, the consumer only the head,
+ * and the node between them is published with a release store.
+ */
+template <typename T>
+class SpscQueue
+{
+    public:
+        SpscQueue() : m_head(new Node), m_tail(m_head) {}
+
+        ~SpscQueue()
+        {
+            while (m_head) {
+                Node *next = m_head->next;
+                delete m_head;
+                m_head = next;
+            }
+        }
+
+        /// Producer thread only
+        void enqueue(const T &value)
+        {
+            Node *node = new Node;
+            node->value = value;
+            m_tail->next.fetchAndStoreRelease(node);
+            m_tail = node;
+        }
+
+        /// Consumer thread only. @returns false if the queue is empty
+        bool dequeue(T *value)
+        {
+            Node *next = m_head->next.fetchAndAddAcquire(0);
+            if (!next) {
+                return false;
+            }
+
+            *value = next->value;
+            // next becomes the dummy, it must not keep the value alive
+            next->value = T();
+            delete m_head;
+            m_head = next;
+
+            return true;
+        }
+
+    private:
+        Q_DISABLE_COPY(SpscQueue)
+
+        struct Node {
+            Node() : next(0) {}
+
+            T value;
+            QAtomicPointer<Node> next;
+        };
+
+        // Consumer side
+        Node *m_head;
+        // Producer side
+        Node *m_tail;
+};
+
+/**
+ * Fixed capacity lock-free ring for exactly one producer thread and one consumer thread.
+ *
+ * Enqueueing on a full ring fails instead of blocking, it is up to the producer to decide what to drop.
+ * The consumer works on values in place, through front and pop. Every T is default constructed
+ * along with the queue.
+ */
+template <typename T>
+class BoundedSpscQueue
+{
+    public:
+        explicit BoundedSpscQueue(int capacity)
+            : m_size(qMax(1, capacity) + 1)
+            , m_slots(new T[m_size])
+            , m_empty()
+            , m_head(0)
+            , m_tail(0)
+        {
+        }
+
+        ~BoundedSpscQueue()
+        {
+            delete [] m_slots;
+        }
+
+        int capacity() const
+        {
+            return m_size - 1;
+        }
+
+        /// Producer thread only. @returns false if the queue is full
+        bool tryEnqueue(const T &value)
+        {
+            // Only the producer writes the tail
+            int tail = m_tail;
+            int next = (tail + 1) % m_size;
+            if (next == m_head.fetchAndAddAcquire(0)) {
+                return false;
+            }
+
+            m_slots[tail] = value;
+            m_tail.fetchAndStoreRelease(next);
+
+            return true;
+        }
+
+        /// Consumer thread only. @returns The oldest value, which stays in place until pop, or 0 if the queue is empty
+        T *front()
+        {
+            // Only the consumer writes the head
+            int head = m_head;
+            if (head == m_tail.fetchAndAddAcquire(0)) {
+                return 0;
+            }
+
+            return &m_slots[head];
+        }
+
+        /// Consumer thread only, releases the value front returned
+        void pop()
+        {
+            int head = m_head;
+            // Copying an empty value rather than constructing one keeps T's constructor off this path
+            m_slots[head] = m_empty;
+            m_head.fetchAndStoreRelease((head + 1) % m_size);
+        }
+
+    private:
+        Q_DISABLE_COPY(BoundedSpscQueue)
+
+        // One slot is always left empty, to tell a full ring from an empty one
+        const int m_size;
+        T * const m_slots;
+        const T m_empty;
+        QAtomicInt m_head;
+        QAtomicInt m_tail;
+};
+
+} // Util
+
+#endif
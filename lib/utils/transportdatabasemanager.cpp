@@ -18,9 +18,13 @@
 
 #include "transportdatabasemanager.h"
 
+#include "segmentedlog.h"
+
 #include <QtCore/QDebug>
 #include <QtCore/QDir>
 #include <QtCore/QFile>
+#include <QtCore/QPair>
+#include <QtCore/QStringList>
 
 #include <QtSql/QSqlDatabase>
 #include <QtSql/QSqlError>
@@ -30,6 +34,7 @@
 
 #define TARGET_VALUE 0
 #define PAYLOAD_VALUE 1
+#define SYNC_GENERATION_VALUE 2
 
 #define EXPIRY_VALUE 0
 
@@ -38,6 +43,218 @@
 
 namespace TransportDatabaseManager {
 
+enum PreparedStatement {
+    InsertPersistentEntryStatement = 0,
+    UpdatePersistentEntryStatement,
+    DeletePersistentEntryStatement,
+    InsertCacheMessageStatement,
+    DeleteCacheMessageStatement,
+    PreparedStatementCount
+};
+
+static bool s_batchOpen = false;
+static QList< QPair< QString, QString > > s_pragmas;
+static QSqlQuery *s_preparedStatements[PreparedStatementCount] = { 0 };
+
+static QString s_logDirectory;
+static qint64 s_logSegmentSize = 0;
+static Util::SegmentedLog *s_log = 0;
+
+// Returns a query prepared once for the whole lifetime of the connection, so hot paths
+// only have to bind their values.
+static QSqlQuery *preparedStatement(PreparedStatement statement)
+{
+    if (Q_LIKELY(s_preparedStatements[statement])) {
+        return s_preparedStatements[statement];
+    }
+
+    QString queryString;
+    switch (statement) {
+        case InsertPersistentEntryStatement:
+            queryString = QLatin1String("INSERT INTO persistent_entries (target, payload, sync_generation) "
+                                        "VALUES (:target, :payload, :sync_generation)");
+            break;
+        case UpdatePersistentEntryStatement:
+            queryString = QLatin1String("UPDATE persistent_entries SET payload=:payload, sync_generation=:sync_generation "
+                                        "WHERE target=:target");
+            break;
+        case DeletePersistentEntryStatement:
+            queryString = QLatin1String("DELETE FROM persistent_entries WHERE target=:target");
+            break;
+        case InsertCacheMessageStatement:
+            queryString = QLatin1String("INSERT INTO cachemessages (id, cachemessage, expiry) "
+                                        "VALUES (:id, :cachemessage, :expiry)");
+            break;
+        case DeleteCacheMessageStatement:
+            queryString = QLatin1String("DELETE FROM cachemessages WHERE id=:id");
+            break;
+        default:
+            return 0;
+    }
+
+    QSqlQuery *query = new QSqlQuery;
+    if (!query->prepare(queryString)) {
+        qWarning() << "Could not prepare statement" << queryString << query->lastError();
+        delete query;
+        return 0;
+    }
+
+    s_preparedStatements[statement] = query;
+    return query;
+}
+
+static void applyPragmas()
+{
+    typedef QPair< QString, QString > Pragma;
+    QSqlQuery pragmaQuery;
+    Q_FOREACH (const Pragma &pragma, s_pragmas) {
+        if (!pragmaQuery.exec(QString("PRAGMA %1=%2").arg(pragma.first, pragma.second))) {
+            qWarning() << "Could not set pragma" << pragma.first << "to" << pragma.second << pragmaQuery.lastError();
+        } else if (pragmaQuery.next()) {
+            qDebug() << "Pragma" << pragma.first << "is now" << pragmaQuery.value(0).toString();
+        }
+    }
+}
+
+// Both end up in the PRAGMA statement as they are, so only known pragmas and values get there
+static bool isValidPragma(const QString &pragma, const QString &value)
+{
+    static const char *integerPragmas[] = { "cache_size", "mmap_size", "page_size", "wal_autocheckpoint", "busy_timeout", 0 };
+    for (int i = 0; integerPragmas[i]; ++i) {
+        if (pragma == QLatin1String(integerPragmas[i])) {
+            bool ok;
+            value.toLongLong(&ok);
+            return ok;
+        }
+    }
+
+    QStringList keywords;
+    if (pragma == QLatin1String("journal_mode")) {
+        keywords << QLatin1String("DELETE") << QLatin1String("TRUNCATE") << QLatin1String("PERSIST")
+                 << QLatin1String("MEMORY") << QLatin1String("WAL") << QLatin1String("OFF");
+    } else if (pragma == QLatin1String("synchronous")) {
+        keywords << QLatin1String("OFF") << QLatin1String("NORMAL") << QLatin1String("FULL") << QLatin1String("EXTRA")
+                 << QLatin1String("0") << QLatin1String("1") << QLatin1String("2") << QLatin1String("3");
+    } else if (pragma == QLatin1String("temp_store")) {
+        keywords << QLatin1String("DEFAULT") << QLatin1String("FILE") << QLatin1String("MEMORY")
+                 << QLatin1String("0") << QLatin1String("1") << QLatin1String("2");
+    } else {
+        return false;
+    }
+
+    return keywords.contains(value.toUpper());
+}
+
+bool setPragma(const QString &pragma, const QString &value)
+{
+    QString trimmedValue = value.trimmed();
+    if (!isValidPragma(pragma, trimmedValue)) {
+        qWarning() << "Ignoring unsupported pragma" << pragma << "=" << value;
+        return false;
+    }
+
+    // Setting a pragma again replaces its value
+    for (int i = 0; i < s_pragmas.count(); ++i) {
+        if (s_pragmas.at(i).first == pragma) {
+            s_pragmas[i].second = trimmedValue;
+            return true;
+        }
+    }
+
+    s_pragmas.append(qMakePair(pragma, trimmedValue));
+    return true;
+}
+
+void setStoredMessagesLog(const QString &directory, qint64 segmentSize)
+{
+    s_logDirectory = directory;
+    s_logSegmentSize = segmentSize;
+}
+
+// Returns the cache messages log, or 0 if they live in the database
+static Util::SegmentedLog *storedMessagesLog()
+{
+    if (Q_LIKELY(s_log) || s_logDirectory.isEmpty()) {
+        return s_log;
+    }
+
+    Util::SegmentedLog *log = new Util::SegmentedLog(s_logDirectory, s_logSegmentSize);
+    if (!log->open()) {
+        qWarning() << "Could not open the cache messages log in" << s_logDirectory << ", using the database instead";
+        delete log;
+        s_logDirectory.clear();
+        return 0;
+    }
+    s_log = log;
+
+    // Move over what the database still holds, so switching backend does not lose messages
+    if (!ensureDatabase()) {
+        return s_log;
+    }
+
+    QSqlQuery query;
+    query.setForwardOnly(true);
+    if (!query.exec(QLatin1String("SELECT id, cachemessage, expiry FROM cachemessages ORDER BY id"))) {
+        qWarning() << "Astarte::CacheMessages migration query failed!" << query.lastError();
+        return s_log;
+    }
+
+    // Rows keep their database id, so whatever an interrupted migration already moved is
+    // recognized and not appended twice
+    int moved = 0;
+    qint64 lastMovedId = 0;
+    while (query.next()) {
+        qint64 id = query.value(0).toLongLong();
+        if (id > s_log->lastId()) {
+            QDateTime expiry = query.value(2).toDateTime();
+            if (s_log->append(query.value(1).toByteArray(), expiry.isValid() ? expiry.toMSecsSinceEpoch() : 0, id) < 0) {
+                qWarning() << "Could not move Astarte::CacheMessages to the log, leaving them in the database";
+                break;
+            }
+            ++moved;
+        }
+        lastMovedId = id;
+    }
+    query.finish();
+
+    if (lastMovedId > 0 && s_log->sync()) {
+        // Rows are moved in id order, everything up to the last one is in the log
+        QSqlQuery deleteQuery;
+        deleteQuery.prepare(QLatin1String("DELETE FROM cachemessages WHERE id <= :id"));
+        deleteQuery.bindValue(QLatin1String(":id"), lastMovedId);
+        if (!deleteQuery.exec()) {
+            qWarning() << "Could not delete migrated Astarte::CacheMessages!" << deleteQuery.lastError();
+        }
+        qDebug() << "Moved" << moved << "Astarte::CacheMessages to the log";
+    }
+
+    return s_log;
+}
+
+void closeDatabase()
+{
+    commitBatch();
+
+    for (int i = 0; i < PreparedStatementCount; ++i) {
+        delete s_preparedStatements[i];
+        s_preparedStatements[i] = 0;
+    }
+
+    delete s_log;
+    s_log = 0;
+
+    QString connectionName;
+    {
+        QSqlDatabase db = QSqlDatabase::database(QLatin1String(QSqlDatabase::defaultConnection), false);
+        if (!db.isValid()) {
+            return;
+        }
+        connectionName = db.connectionName();
+        db.close();
+    }
+    QSqlDatabase::removeDatabase(connectionName);
+}
+
 bool ensureDatabase(const QString &dbPath, const QString &migrationsDirPath)
 {
     if (QSqlDatabase::database().isValid()) {
@@ -79,6 +296,8 @@ bool ensureDatabase(const QString &dbPath, const QString &migrationsDirPath)
         }
     }
 
+    applyPragmas();
+
     QSqlQuery migrationQuery;
 
     // Ok. Let's query our migrations.
@@ -156,43 +375,96 @@ bool ensureDatabase(const QString &dbPath, const QString &migrationsDirPath)
     return true;
 }
 
-bool Transactions::insertPersistentEntry(const QByteArray &target, const QByteArray &payload)
+bool beginBatch()
 {
+    if (s_batchOpen) {
+        return true;
+    }
+
     if (!ensureDatabase()) {
         return false;
     }
 
-    QSqlQuery query;
-    query.prepare(QLatin1String("INSERT INTO persistent_entries (target, payload) "
-                                 "VALUES (:target, :payload)"));
-    query.bindValue(QLatin1String(":target"), QLatin1String(target));
-    query.bindValue(QLatin1String(":payload"), payload);
+    if (!QSqlDatabase::database().transaction()) {
+        qWarning() << "Could not begin write batch!" << QSqlDatabase::database().lastError();
+        return false;
+    }
 
-    if (!query.exec()) {
-        qWarning() << "Insert persistent entry query failed!" << query.lastError();
+    s_batchOpen = true;
+    return true;
+}
+
+bool commitBatch()
+{
+    if (!s_batchOpen) {
+        return true;
+    }
+
+    s_batchOpen = false;
+
+    if (s_log) {
+        s_log->sync();
+    }
+
+    if (!QSqlDatabase::database().commit()) {
+        qWarning() << "Could not commit write batch, rolling it back!" << QSqlDatabase::database().lastError();
+        QSqlDatabase::database().rollback();
         return false;
     }
 
     return true;
 }
 
-bool Transactions::updatePersistentEntry(const QByteArray &target, const QByteArray &payload)
+bool isBatchOpen()
+{
+    return s_batchOpen;
+}
+
+bool Transactions::insertPersistentEntry(const QByteArray &target, const QByteArray &payload, qint64 syncGeneration)
 {
     if (!ensureDatabase()) {
         return false;
     }
 
-    QSqlQuery query;
-    query.prepare(QLatin1String("UPDATE persistent_entries SET payload=:payload "
-                                 "WHERE target=:target"));
-    query.bindValue(QLatin1String(":target"), QLatin1String(target));
-    query.bindValue(QLatin1String(":payload"), payload);
+    QSqlQuery *query = preparedStatement(InsertPersistentEntryStatement);
+    if (!query) {
+        return false;
+    }
 
-    if (!query.exec()) {
-        qWarning() << "Update persistent entry query failed!" << query.lastError();
+    query->bindValue(QLatin1String(":target"), QLatin1String(target));
+    query->bindValue(QLatin1String(":payload"), payload);
+    query->bindValue(QLatin1String(":sync_generation"), syncGeneration);
+
+    if (!query->exec()) {
+        qWarning() << "Insert persistent entry query failed!" << query->lastError();
+        return false;
+    }
+
+    query->finish();
+    return true;
+}
+
+bool Transactions::updatePersistentEntry(const QByteArray &target, const QByteArray &payload, qint64 syncGeneration)
+{
+    if (!ensureDatabase()) {
+        return false;
+    }
+
+    QSqlQuery *query = preparedStatement(UpdatePersistentEntryStatement);
+    if (!query) {
         return false;
     }
 
+    query->bindValue(QLatin1String(":target"), QLatin1String(target));
+    query->bindValue(QLatin1String(":payload"), payload);
+    query->bindValue(QLatin1String(":sync_generation"), syncGeneration);
+
+    if (!query->exec()) {
+        qWarning() << "Update persistent entry query failed!" << query->lastError();
+        return false;
+    }
+
+    query->finish();
     return true;
 }
 
@@ -202,19 +474,23 @@ bool Transactions::deletePersistentEntry(const QByteArray &target)
         return false;
     }
 
-    QSqlQuery query;
-    query.prepare(QLatin1String("DELETE FROM persistent_entries WHERE target=:target"));
-    query.bindValue(QLatin1String(":target"), QLatin1String(target));
+    QSqlQuery *query = preparedStatement(DeletePersistentEntryStatement);
+    if (!query) {
+        return false;
+    }
 
-    if (!query.exec()) {
-        qWarning() << "Delete persistent entry " << target << " query failed!" << query.lastError();
+    query->bindValue(QLatin1String(":target"), QLatin1String(target));
+
+    if (!query->exec()) {
+        qWarning() << "Delete persistent entry " << target << " query failed!" << query->lastError();
         return false;
     }
 
+    query->finish();
     return true;
 }
 
-QHash<QByteArray, QByteArray> Transactions::allPersistentEntries()
+QHash<QByteArray, QByteArray> Transactions::allPersistentEntries(QHash<QByteArray, qint64> *syncGenerations)
 {
     QHash<QByteArray, QByteArray> ret;
 
@@ -223,7 +499,7 @@ QHash<QByteArray, QByteArray> Transactions::allPersistentEntries()
     }
 
     QSqlQuery query;
-    query.prepare(QLatin1String("SELECT target, payload FROM persistent_entries"));
+    query.prepare(QLatin1String("SELECT target, payload, sync_generation FROM persistent_entries"));
 
     if (!query.exec()) {
         qWarning() << "All persistent entries query failed!" << query.lastError();
@@ -232,77 +508,153 @@ QHash<QByteArray, QByteArray> Transactions::allPersistentEntries()
 
     while (query.next()) {
         ret.insert(query.value(TARGET_VALUE).toByteArray(), query.value(PAYLOAD_VALUE).toByteArray());
+        if (syncGenerations) {
+            syncGenerations->insert(query.value(TARGET_VALUE).toByteArray(), query.value(SYNC_GENERATION_VALUE).toLongLong());
+        }
     }
 
     return ret;
 }
 
-int Transactions::insertCacheMessage(const Astarte::CacheMessage &cacheMessage, const QDateTime &expiry)
+qint64 Transactions::insertCacheMessage(const Astarte::CacheMessage &cacheMessage, const QDateTime &expiry)
 {
+    if (Util::SegmentedLog *log = storedMessagesLog()) {
+        qint64 id = log->append(cacheMessage.serialize(), expiry.isValid() ? expiry.toMSecsSinceEpoch() : 0, cacheMessage.dbId());
+        // Outside of a batch every insert is durable on its own, as with the database
+        if (id >= 0 && !s_batchOpen) {
+            log->sync();
+        }
+        return id;
+    }
+
     if (!ensureDatabase()) {
         return -1;
     }
 
-    QSqlQuery query;
-    query.prepare(QLatin1String("INSERT INTO cachemessages (cachemessage, expiry) "
-                                 "VALUES (:cachemessage, :expiry)"));
-    query.bindValue(QLatin1String(":cachemessage"), cacheMessage.serialize());
-    query.bindValue(QLatin1String(":expiry"), expiry);
+    QSqlQuery *query = preparedStatement(InsertCacheMessageStatement);
+    if (!query) {
+        return -1;
+    }
 
-    if (!query.exec()) {
-        qWarning() << "Insert Astarte::CacheMessage query failed!" << query.lastError();
+    // A null id lets the database pick the next one
+    query->bindValue(QLatin1String(":id"), cacheMessage.dbId() > 0 ? QVariant(cacheMessage.dbId()) : QVariant(QVariant::LongLong));
+    query->bindValue(QLatin1String(":cachemessage"), cacheMessage.serialize());
+    query->bindValue(QLatin1String(":expiry"), expiry);
+
+    if (!query->exec()) {
+        qWarning() << "Insert Astarte::CacheMessage query failed!" << query->lastError();
         return -1;
     }
 
-    return query.lastInsertId().toInt();
+    qint64 id = query->lastInsertId().toLongLong();
+    query->finish();
+    return id;
 }
 
-bool Transactions::deleteCacheMessage(int id)
+bool Transactions::deleteCacheMessage(qint64 id)
 {
+    if (Util::SegmentedLog *log = storedMessagesLog()) {
+        // Not synced: losing an acknowledgement in a crash only means sending the message again
+        return log->acknowledge(id);
+    }
+
     if (!ensureDatabase()) {
         return false;
     }
 
-    QSqlQuery query;
-    query.prepare(QLatin1String("DELETE FROM cachemessages WHERE id=:id"));
-    query.bindValue(QLatin1String(":id"), id);
+    QSqlQuery *query = preparedStatement(DeleteCacheMessageStatement);
+    if (!query) {
+        return false;
+    }
 
-    if (!query.exec()) {
-        qWarning() << "Delete Astarte::CacheMessage query failed!" << query.lastError();
+    query->bindValue(QLatin1String(":id"), id);
+
+    if (!query->exec()) {
+        qWarning() << "Delete Astarte::CacheMessage query failed!" << query->lastError();
         return false;
     }
 
+    query->finish();
     return true;
 }
 
-QList<Astarte::CacheMessage> Transactions::allCacheMessages()
+int Transactions::deleteExpiredCacheMessages(int limit)
 {
-    QList<Astarte::CacheMessage> ret;
+    if (Util::SegmentedLog *log = storedMessagesLog()) {
+        return log->acknowledgeExpired(QDateTime::currentMSecsSinceEpoch(), limit);
+    }
 
     if (!ensureDatabase()) {
-        return ret;
+        return -1;
     }
 
-    // Housekeeping: delete expired Astarte::CacheMessages
+    // Bounded, so a huge backlog of expired messages does not end up in a single huge transaction
     QSqlQuery query;
-    query.prepare(QLatin1String("DELETE FROM cachemessages WHERE expiry < :now"));
+    query.prepare(QLatin1String("DELETE FROM cachemessages WHERE id IN "
+                                "(SELECT id FROM cachemessages WHERE expiry < :now LIMIT :limit)"));
     query.bindValue(QLatin1String(":now"), QDateTime::currentDateTime());
+    query.bindValue(QLatin1String(":limit"), limit);
 
     if (!query.exec()) {
         qWarning() << "Delete expired Astarte::CacheMessages query failed!" << query.lastError();
+        return -1;
+    }
+
+    return query.numRowsAffected();
+}
+
+qint64 Transactions::lastCacheMessageId()
+{
+    if (Util::SegmentedLog *log = storedMessagesLog()) {
+        return log->lastId();
+    }
+
+    if (!ensureDatabase()) {
+        return 0;
+    }
+
+    QSqlQuery query;
+    if (!query.exec(QLatin1String("SELECT max(id) FROM cachemessages")) || !query.next()) {
+        qWarning() << "Last Astarte::CacheMessage id query failed!" << query.lastError();
+        return 0;
+    }
+
+    return query.value(0).toLongLong();
+}
+
+QList<Astarte::CacheMessage> Transactions::cacheMessagesPage(qint64 fromId, qint64 toId, int limit)
+{
+    QList<Astarte::CacheMessage> ret;
+
+    if (Util::SegmentedLog *log = storedMessagesLog()) {
+        Q_FOREACH (const Util::SegmentedLog::Record &record, log->read(fromId, toId, limit)) {
+            Astarte::CacheMessage c = Astarte::CacheMessage::fromBinary(record.data);
+            c.setDbId(record.id);
+            ret.append(c);
+        }
         return ret;
     }
 
-    query.prepare(QLatin1String("SELECT id, cachemessage FROM cachemessages"));
+    if (!ensureDatabase()) {
+        return ret;
+    }
+
+    QSqlQuery query;
+    query.setForwardOnly(true);
+    query.prepare(QLatin1String("SELECT id, cachemessage FROM cachemessages "
+                                "WHERE id > :fromId AND id <= :toId ORDER BY id LIMIT :limit"));
+    query.bindValue(QLatin1String(":fromId"), fromId);
+    query.bindValue(QLatin1String(":toId"), toId);
+    query.bindValue(QLatin1String(":limit"), limit);
 
     if (!query.exec()) {
-        qWarning() << "All Astarte::CacheMessages query failed!" << query.lastError();
+        qWarning() << "Astarte::CacheMessages page query failed!" << query.lastError();
         return ret;
     }
 
     while (query.next()) {
         Astarte::CacheMessage c = Astarte::CacheMessage::fromBinary(query.value(CACHEMESSAGE_VALUE).toByteArray());
-        c.addAttribute("dbId", QByteArray::number(query.value(ID_VALUE).toInt()));
+        c.setDbId(query.value(ID_VALUE).toLongLong());
         ret.append(c);
     }
 
@@ -28,17 +28,40 @@
 namespace TransportDatabaseManager
 {
     bool ensureDatabase(const QString &dbPath = QString(), const QString &migrationsDirPath = QString());
+    // Commits the open batch and releases the connection, along with its prepared statements.
+    // Must be called from the thread which used the database.
+    void closeDatabase();
+
+    // SQLite pragmas (journal_mode, synchronous, temp_store, cache_size, mmap_size, page_size,
+    // wal_autocheckpoint, busy_timeout) applied whenever the database is opened. Must be set before
+    // the first call to ensureDatabase. Unknown pragmas or values are refused.
+    bool setPragma(const QString &pragma, const QString &value);
+
+    // Keeps cache messages in an append-only segmented log in directory instead of the database,
+    // which suits their FIFO lifecycle better. Must be set before the first call to ensureDatabase.
+    void setStoredMessagesLog(const QString &directory, qint64 segmentSize);
+
+    // Write batching: every statement executed between beginBatch and commitBatch
+    // is committed (and synced to disk) as a single transaction.
+    bool beginBatch();
+    bool commitBatch();
+    bool isBatchOpen();
 
 namespace Transactions
 {
-    bool insertPersistentEntry(const QByteArray &target, const QByteArray &payload);
-    bool updatePersistentEntry(const QByteArray &target, const QByteArray &payload);
+    // syncGeneration is the property sync generation in which the broker confirmed the payload
+    bool insertPersistentEntry(const QByteArray &target, const QByteArray &payload, qint64 syncGeneration);
+    bool updatePersistentEntry(const QByteArray &target, const QByteArray &payload, qint64 syncGeneration);
     bool deletePersistentEntry(const QByteArray &target);
-    QHash<QByteArray, QByteArray> allPersistentEntries();
+    QHash<QByteArray, QByteArray> allPersistentEntries(QHash<QByteArray, qint64> *syncGenerations = 0);
 
-    int insertCacheMessage(const Astarte::CacheMessage &cacheMessage, const QDateTime &expiry = QDateTime());
-    bool deleteCacheMessage(int id);
-    QList<Astarte::CacheMessage> allCacheMessages();
+    // Inserted with the message dbId, if it has one
+    qint64 insertCacheMessage(const Astarte::CacheMessage &cacheMessage, const QDateTime &expiry = QDateTime());
+    bool deleteCacheMessage(qint64 id);
+    int deleteExpiredCacheMessages(int limit);
+    qint64 lastCacheMessageId();
+    // Returns at most limit messages with fromId < id <= toId, in id order.
+    QList<Astarte::CacheMessage> cacheMessagesPage(qint64 fromId, qint64 toId, int limit);
 }
 
 }
@@ -10,7 +10,35 @@ DEFINES += QT4SDK_LIBRARY
 
 QMAKE_MACOSX_DEPLOYMENT_TARGET = 10.9
 
-SUBDIRS = lib astarte-validate-interface
+SUBDIRS = lib astarte-validate-interface \
+    astarte-compression-benchmark \
+    astarte-storage-benchmark \
+    astarte-inbound-benchmark \
+    astarte-persistence-benchmark \
+    astarte-bson-benchmark \
+    astarte-mapping-benchmark \
+    astarte-batching-benchmark
 
 astarte-validate-interface.subdir = tools/astarte-validate-interface
 astarte-validate-interface.depends = lib
+
+astarte-compression-benchmark.subdir = tools/astarte-compression-benchmark
+astarte-compression-benchmark.depends = lib
+
+astarte-storage-benchmark.subdir = tools/astarte-storage-benchmark
+astarte-storage-benchmark.depends = lib
+
+astarte-inbound-benchmark.subdir = tools/astarte-inbound-benchmark
+astarte-inbound-benchmark.depends = lib
+
+astarte-persistence-benchmark.subdir = tools/astarte-persistence-benchmark
+astarte-persistence-benchmark.depends = lib
+
+astarte-bson-benchmark.subdir = tools/astarte-bson-benchmark
+astarte-bson-benchmark.depends = lib
+
+astarte-mapping-benchmark.subdir = tools/astarte-mapping-benchmark
+astarte-mapping-benchmark.depends = lib
+
+astarte-batching-benchmark.subdir = tools/astarte-batching-benchmark
+astarte-batching-benchmark.depends = lib
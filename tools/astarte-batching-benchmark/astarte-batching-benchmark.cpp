@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2017 Ispirata Srl
+ *
+ * This file is part of Astarte.
+ * Astarte is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Astarte is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Astarte.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// Compares publishing datastream samples one by one with coalescing them into batches, as Transport
+// does for batchedInterfaces: { "b": [ { "v": ..., "t": ... }, ... ] }, flushed when batchWindowMs
+// expires or the document reaches batchMaxBytes. A stream of samples at a steady rate is replayed
+// on a simulated clock, payloads are built with the same serializer calls as the SDK, and every
+// publish is costed as an MQTT 3.1.1 PUBLISH packet plus the acknowledgements its QoS needs.
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QDateTime>
+#include <QtCore/QDebug>
+#include <QtCore/QStringList>
+#include <QtCore/QTextStream>
+
+#include "utils/bsonserializer.h"
+
+// The topic of a datastream mapping, <realm>/<hardware id>/<interface><path>
+#define SAMPLE_TOPIC "test/f0VMRgIBAQAAAAAAAAAAAA/com.example.Sensors/room1/temperature"
+
+// Sample rates, in samples per second
+static const int sampleRates[] = { 1, 10, 100, 1000, 0 };
+
+struct BenchmarkResult {
+    qint64 publishes;
+    qint64 payloadBytes;
+    qint64 wireBytes;
+};
+
+// A sample without an explicit timestamp, as the producer serializes it
+static QByteArray sample(int i)
+{
+    Util::BSONSerializer serializer;
+    serializer.appendDoubleValue("v", 20.0 + (i % 100) / 10.0);
+    serializer.appendEndOfDocument();
+    return serializer.document();
+}
+
+static int publishWireSize(int payloadSize, int qos)
+{
+    int remainingLength = 2 + int(sizeof(SAMPLE_TOPIC) - 1) + (qos > 0 ? 2 : 0) + payloadSize;
+    int lengthBytes = 1;
+    for (int length = remainingLength; length >= 128; length /= 128) {
+        ++lengthBytes;
+    }
+
+    // PUBACK for QoS 1, PUBREC, PUBREL and PUBCOMP for QoS 2
+    return 1 + lengthBytes + remainingLength + (qos == 1 ? 4 : qos == 2 ? 12 : 0);
+}
+
+static void publish(const QByteArray &payload, int qos, BenchmarkResult *result)
+{
+    ++result->publishes;
+    result->payloadBytes += payload.size();
+    result->wireBytes += publishWireSize(payload.size(), qos);
+}
+
+static void runUnbatched(int samples, int qos, BenchmarkResult *result)
+{
+    for (int i = 0; i < samples; ++i) {
+        publish(sample(i), qos, result);
+    }
+}
+
+static void runBatched(int samples, int rate, int windowms, int maxBytes, int qos, BenchmarkResult *result)
+{
+    Util::BSONSerializer serializer;
+    int count = 0;
+    qint64 openedAt = 0;
+
+    for (int i = 0; i < samples; ++i) {
+        qint64 now = qint64(i) * 1000 / rate;
+        if (count > 0 && now - openedAt >= windowms) {
+            // The batch window expired before this sample
+            serializer.endArray();
+            serializer.appendEndOfDocument();
+            publish(serializer.document(), qos, result);
+            count = 0;
+        }
+
+        if (count == 0) {
+            serializer = Util::BSONSerializer();
+            serializer.reserve(maxBytes);
+            serializer.beginArray("b");
+            openedAt = now;
+        }
+
+        serializer.beginSubdocument(QByteArray::number(count).constData());
+        serializer.appendElements(sample(i));
+        serializer.appendDateTime("t", QDateTime::fromMSecsSinceEpoch(Q_INT64_C(1500000000000) + now));
+        serializer.endSubdocument();
+        ++count;
+
+        if (serializer.size() >= maxBytes) {
+            serializer.endArray();
+            serializer.appendEndOfDocument();
+            publish(serializer.document(), qos, result);
+            count = 0;
+        }
+    }
+
+    if (count > 0) {
+        serializer.endArray();
+        serializer.appendEndOfDocument();
+        publish(serializer.document(), qos, result);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    QStringList arguments = app.arguments();
+    if (arguments.size() > 5) {
+        qWarning() << "Usage: astarte-batching-benchmark [samples] [batchWindowMs] [batchMaxBytes] [qos]";
+        return 1;
+    }
+
+    int samples = arguments.size() > 1 ? qMax(1, arguments.at(1).toInt()) : 10000;
+    int windowms = arguments.size() > 2 ? qMax(0, arguments.at(2).toInt()) : 1000;
+    int maxBytes = arguments.size() > 3 ? qMax(1, arguments.at(3).toInt()) : 4096;
+    int qos = arguments.size() > 4 ? qBound(0, arguments.at(4).toInt(), 2) : 1;
+
+    QTextStream out(stdout);
+    out << "Samples: " << samples << ", batch window " << windowms << " ms, batch max " << maxBytes
+        << " bytes, QoS " << qos << '\n';
+    out << "samples/s\tmode\tpublishes/s\tsamples/publish\tpayload bytes/sample\twire bytes/sample\n";
+
+    for (int r = 0; sampleRates[r]; ++r) {
+        int rate = sampleRates[r];
+        double seconds = double(samples) / rate;
+
+        for (int batched = 0; batched < 2; ++batched) {
+            BenchmarkResult result = { 0, 0, 0 };
+            if (batched) {
+                runBatched(samples, rate, windowms, maxBytes, qos, &result);
+            } else {
+                runUnbatched(samples, qos, &result);
+            }
+
+            out << rate << '\t' << (batched ? "batched" : "unbatched") << '\t'
+                << QString::number(result.publishes / seconds, 'f', 2) << '\t'
+                << QString::number(double(samples) / result.publishes, 'f', 1) << '\t'
+                << QString::number(double(result.payloadBytes) / samples, 'f', 1) << '\t'
+                << QString::number(double(result.wireBytes) / samples, 'f', 1) << '\n';
+        }
+        out.flush();
+    }
+
+    return 0;
+}
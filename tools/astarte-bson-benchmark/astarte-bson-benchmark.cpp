@@ -0,0 +1,313 @@
+/*
+ * Copyright (C) 2017 Ispirata Srl
+ *
+ * This file is part of Astarte.
+ * Astarte is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Astarte is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Astarte.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// Compares the offset-indexed BSONDocument with the reader it replaced, which scanned the document
+// from the start (bson_key_lookup) for every value. Both decode the same serialized Stored
+// datastream CacheMessages field by field, as CacheMessage::fromBinary does, along with the
+// sample document they carry.
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QDateTime>
+#include <QtCore/QDebug>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QList>
+#include <QtCore/QStringList>
+#include <QtCore/QTextStream>
+
+#if defined(__APPLE__)
+  #include "utils/apple_endian.h"
+#else
+  #include <endian.h>
+#endif
+#include <stdint.h>
+#include <string.h>
+
+#include "internal/cachemessage.h"
+#include "utils/bsondocument.h"
+#include "utils/bsonserializer.h"
+
+#define TYPE_DOUBLE 0x01
+#define TYPE_STRING 0x02
+#define TYPE_DOCUMENT 0x03
+#define TYPE_BINARY 0x05
+#define TYPE_BOOLEAN 0x08
+#define TYPE_DATETIME 0x09
+#define TYPE_INT32 0x10
+#define TYPE_INT64 0x12
+
+// The reader BSONDocument used before indexing documents, kept here as it was
+namespace Legacy
+{
+
+static uint32_t read_uint32(const void *u)
+{
+    const unsigned char *b = (const unsigned char *) u;
+    return le32toh(((uint32_t) b[0]) | (((uint32_t) b[1]) << 8) | (((uint32_t) b[2]) << 16) | (((uint32_t) b[3]) << 24));
+}
+
+static uint64_t read_uint64(const void *u)
+{
+    const unsigned char *b = (const unsigned char *) u;
+    return le64toh((uint64_t) b[0] | ((uint64_t) b[1] << 8) | ((uint64_t) b[2] << 16) | ((uint64_t) b[3] << 24) | ((uint64_t) b[4] << 32) | ((uint64_t) b[5] << 40) | ((uint64_t) b[6] << 48) | ((uint64_t) b[7] << 56));
+}
+
+static unsigned int bson_next_item_offset(unsigned int offset, unsigned int keyLen, const void *document)
+{
+    const char *docBytes = (const char *) document;
+    uint8_t elementType = (uint8_t) docBytes[offset];
+
+    /* offset <- type (uint8_t) + key (const char *) + '\0' (char) */
+    offset += 1 + keyLen + 1;
+
+    switch (elementType) {
+        case TYPE_STRING: {
+            uint32_t stringLen = read_uint32(docBytes + offset);
+            offset += stringLen + 4;
+        }
+        break;
+
+        case TYPE_DOCUMENT: {
+            uint32_t docLen = read_uint32(docBytes + offset);
+            offset += docLen;
+        }
+        break;
+
+        case TYPE_BINARY: {
+            uint32_t binLen = read_uint32(docBytes + offset);
+            offset += 4 + 1 + binLen; /* int32 (len) + byte (subtype) + binLen */
+        }
+        break;
+
+        case TYPE_INT32: {
+           offset += sizeof(int32_t);
+        }
+        break;
+
+        case TYPE_DOUBLE:
+        case TYPE_DATETIME:
+        case TYPE_INT64: {
+            offset += sizeof(int64_t);
+        }
+        break;
+
+        case TYPE_BOOLEAN: {
+            offset += 1;
+        }
+        break;
+
+        default: {
+            qWarning() << "BSON parser: unrecognized BSON type: " << elementType;
+            return 0;
+        }
+    }
+
+    return offset;
+}
+
+static const void *bson_key_lookup(const char *key, const void *document, uint8_t *type)
+{
+    const char *docBytes = (const char *) document;
+    uint32_t docLen = read_uint32(document);
+
+    unsigned int offset = 4;
+    while (offset + 1 < docLen) {
+       uint8_t elementType = (uint8_t) docBytes[offset];
+       int keyLen = strnlen(docBytes + offset + 1, docLen - offset);
+
+       if (!strncmp(key, docBytes + offset + 1, docLen - offset)) {
+           if (type) {
+               *type = elementType;
+           }
+           return (void *) (docBytes + offset + 1 + keyLen + 1);
+       }
+
+       unsigned int newOffset = bson_next_item_offset(offset, keyLen, document);
+       if (!newOffset) {
+           return NULL;
+       }
+       offset = newOffset;
+    }
+
+    return NULL;
+}
+
+class BSONDocument
+{
+public:
+    BSONDocument(const QByteArray &document) : m_doc(document) {}
+
+    bool contains(const char *name) const
+    {
+        return bson_key_lookup(name, m_doc.constData(), 0);
+    }
+
+    double doubleValue(const char *name) const
+    {
+        uint8_t type;
+        const void *value = bson_key_lookup(name, m_doc.constData(), &type);
+        if (value && type == TYPE_DOUBLE) {
+            union data64 {
+                uint64_t u64value;
+                double dvalue;
+            } v;
+            v.u64value = read_uint64(value);
+            return v.dvalue;
+        }
+        return 0.0;
+    }
+
+    QByteArray byteArrayValue(const char *name) const
+    {
+        uint8_t type;
+        const char *value = (const char *) bson_key_lookup(name, m_doc.constData(), &type);
+        if (value && type == TYPE_STRING) {
+            return QByteArray(value + 4);
+        } else if (value && type == TYPE_BINARY) {
+            return QByteArray(value + 5, read_uint32(value));
+        }
+        return QByteArray();
+    }
+
+    int32_t int32Value(const char *name) const
+    {
+        uint8_t type;
+        const void *value = bson_key_lookup(name, m_doc.constData(), &type);
+        return value && type == TYPE_INT32 ? (int32_t) read_uint32(value) : 0;
+    }
+
+    int64_t int64Value(const char *name) const
+    {
+        uint8_t type;
+        const void *value = bson_key_lookup(name, m_doc.constData(), &type);
+        if (value && type == TYPE_INT64) {
+            return (int64_t) read_uint64(value);
+        } else if (value && type == TYPE_INT32) {
+            return (int32_t) read_uint32(value);
+        }
+        return 0;
+    }
+
+    QDateTime dateTimeValue(const char *name) const
+    {
+        uint8_t type;
+        const void *value = bson_key_lookup(name, m_doc.constData(), &type);
+        if (value && type == TYPE_DATETIME) {
+            return QDateTime::fromMSecsSinceEpoch((int64_t) read_uint64(value)).toLocalTime();
+        }
+        return QDateTime();
+    }
+
+private:
+    QByteArray m_doc;
+};
+
+}
+
+// Reads what CacheMessage::fromBinary reads, then the sample inside the payload, and folds it all in
+// a checksum, so both readers can be checked against each other
+template <typename Document>
+static double decode(const QByteArray &data)
+{
+    Document doc(data);
+    double checksum = doc.int32Value("y") + doc.int32Value("v") + doc.byteArrayValue("t").size() + doc.int32Value("i");
+    if (doc.contains("a")) {
+        checksum += 1;
+    }
+    checksum += doc.int32Value("r") + doc.int32Value("l") + doc.int32Value("e");
+    checksum += doc.int64Value("x") % 1000 + doc.int64Value("s") % 1000;
+
+    Document sample(doc.byteArrayValue("p"));
+    checksum += sample.doubleValue("v") + sample.dateTimeValue("t").toMSecsSinceEpoch() % 1000;
+    return checksum;
+}
+
+static QByteArray storedSample(int i)
+{
+    Util::BSONSerializer serializer;
+    serializer.appendDoubleValue("v", 20.0 + (i % 100) / 10.0);
+    serializer.appendDateTime("t", QDateTime::fromMSecsSinceEpoch(Q_INT64_C(1500000000000) + i * 1000));
+    serializer.appendEndOfDocument();
+
+    Astarte::CacheMessage message;
+    message.setTarget(QString("/com.example.Sensors/room%1/temperature").arg(i % 16).toLatin1());
+    message.setInterfaceType(AstarteInterface::DataStream);
+    message.setRetention(Stored);
+    message.setReliability(Guaranteed);
+    message.setExpiry(3600);
+    message.setAbsoluteExpiry(Q_INT64_C(1500000000000) + i * 1000 + 3600000);
+    message.setTimestamp(Q_INT64_C(1500000000000) + i * 1000);
+    message.setPayload(serializer.document());
+    return message.serialize();
+}
+
+template <typename Document>
+static double run(const QList<QByteArray> &messages, int rounds, double *checksum)
+{
+    QElapsedTimer timer;
+    timer.start();
+    *checksum = 0;
+    for (int r = 0; r < rounds; ++r) {
+        Q_FOREACH (const QByteArray &message, messages) {
+            *checksum += decode<Document>(message);
+        }
+    }
+    return messages.count() * rounds * 1000.0 / qMax(Q_INT64_C(1), timer.elapsed());
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    QStringList arguments = app.arguments();
+    if (arguments.size() > 3) {
+        qWarning() << "Usage: astarte-bson-benchmark [messages] [rounds]";
+        return 1;
+    }
+
+    int messages = arguments.size() > 1 ? qMax(1, arguments.at(1).toInt()) : 10000;
+    int rounds = arguments.size() > 2 ? qMax(1, arguments.at(2).toInt()) : 50;
+
+    QList<QByteArray> serialized;
+    for (int i = 0; i < messages; ++i) {
+        serialized.append(storedSample(i));
+    }
+
+    QTextStream out(stdout);
+    out << "Stored datastream CacheMessages: " << messages << " of " << serialized.first().size() << " bytes, "
+        << rounds << " rounds\n";
+    out << "reader\tdecodes/s\n";
+
+    double legacyChecksum;
+    double legacyRate = run<Legacy::BSONDocument>(serialized, rounds, &legacyChecksum);
+    out << "key scan\t" << qRound(legacyRate) << '\n';
+    out.flush();
+
+    double indexedChecksum;
+    double indexedRate = run<Util::BSONDocument>(serialized, rounds, &indexedChecksum);
+    out << "indexed\t" << qRound(indexedRate) << '\n';
+    out << "speedup\t" << QString::number(indexedRate / legacyRate, 'f', 2) << "x\n";
+    out.flush();
+
+    if (legacyChecksum != indexedChecksum) {
+        QTextStream(stderr) << "The readers decoded different values\n";
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2017 Ispirata Srl
+ *
+ * This file is part of Astarte.
+ * Astarte is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Astarte is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Astarte.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// Measures what per-mapping payload compression costs in CPU against the bytes it saves, on the
+// kinds of payloads it is meant for, and on short ones with and without a trained dictionary.
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QDateTime>
+#include <QtCore/QDebug>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QStringList>
+#include <QtCore/QTextStream>
+
+#include "utils/bsonserializer.h"
+#include "utils/payloadcompressor.h"
+
+// The same threshold for every case: below it payloads are sent as they are
+#define COMPRESSION_THRESHOLD 128
+
+// A document as the producer serializes it
+static QByteArray stringPayload(const QByteArray &value)
+{
+    Util::BSONSerializer serializer;
+    serializer.appendASCIIString("v", value);
+    serializer.appendDateTime("t", QDateTime::currentDateTime());
+    serializer.appendEndOfDocument();
+    return serializer.document();
+}
+
+static QByteArray binaryPayload(const QByteArray &value)
+{
+    Util::BSONSerializer serializer;
+    serializer.appendBinaryValue("v", value);
+    serializer.appendDateTime("t", QDateTime::currentDateTime());
+    serializer.appendEndOfDocument();
+    return serializer.document();
+}
+
+static QByteArray jsonRecords(int records, int seed)
+{
+    QByteArray json("[");
+    for (int i = 0; i < records; ++i) {
+        json.append(QString("{\"sensor\":\"probe-%1\",\"status\":\"%2\",\"temperature\":%3,\"humidity\":%4}")
+                        .arg(i).arg((i + seed) % 7 ? "ok" : "degraded").arg(20.0 + ((i * 37 + seed) % 100) / 10.0)
+                        .arg(40 + (i * 13 + seed) % 30).toLatin1());
+        json.append(i + 1 < records ? "," : "]");
+    }
+    return json;
+}
+
+static QByteArray sensorFrame(int samples, int seed)
+{
+    // Slowly varying 16 bit samples, as from an ADC
+    QByteArray frame;
+    frame.resize(samples * 2);
+    int value = 2048 + seed;
+    for (int i = 0; i < samples; ++i) {
+        value += (qrand() % 5) - 2;
+        frame[2 * i] = static_cast<char>(value & 0xff);
+        frame[2 * i + 1] = static_cast<char>((value >> 8) & 0xff);
+    }
+    return frame;
+}
+
+static QByteArray randomBytes(int size)
+{
+    QByteArray bytes;
+    bytes.resize(size);
+    for (int i = 0; i < size; ++i) {
+        bytes[i] = static_cast<char>(qrand() & 0xff);
+    }
+    return bytes;
+}
+
+static void runCase(QTextStream &out, const char *name, const QList<QByteArray> &payloads, const Util::PayloadCompressor &compressor,
+                    int iterations)
+{
+    qint64 inputBytes = 0;
+    qint64 outputBytes = 0;
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < iterations; ++i) {
+        const QByteArray &payload = payloads.at(i % payloads.count());
+        inputBytes += payload.count();
+        outputBytes += compressor.compress(payload).count();
+    }
+    qint64 elapsedns = timer.nsecsElapsed();
+
+    out << name << '\t' << inputBytes / iterations << '\t' << outputBytes / iterations << '\t'
+        << QString::number(double(inputBytes) / qMax(Q_INT64_C(1), outputBytes), 'f', 2) << '\t'
+        << QString::number(elapsedns / 1000.0 / iterations, 'f', 2) << '\t'
+        << QString::number((inputBytes - outputBytes) / qMax(1.0, elapsedns / 1000.0), 'f', 2) << '\n';
+    out.flush();
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    QStringList arguments = app.arguments();
+    if (arguments.size() > 2) {
+        qWarning() << "Usage: astarte-compression-benchmark [iterations]";
+        return 1;
+    }
+    int iterations = arguments.size() > 1 ? qMax(1, arguments.at(1).toInt()) : 10000;
+
+    qsrand(42);
+
+    // A few variants of each kind, so a single input does not end up hot in the cache
+    QList<QByteArray> largeJson;
+    QList<QByteArray> frames;
+    QList<QByteArray> random;
+    QList<QByteArray> shortJson;
+    for (int i = 0; i < 16; ++i) {
+        largeJson.append(stringPayload(jsonRecords(48, i)));
+        frames.append(binaryPayload(sensorFrame(2048, i)));
+        random.append(binaryPayload(randomBytes(4096)));
+        shortJson.append(stringPayload(jsonRecords(2, i)));
+    }
+
+    // Trained on payloads of the same mapping, which is what a dictionary is meant to be
+    QByteArray dictionary = jsonRecords(8, 1000);
+
+    Util::PayloadCompressor disabled;
+    Util::PayloadCompressor plain(COMPRESSION_THRESHOLD);
+    Util::PayloadCompressor trained(COMPRESSION_THRESHOLD, dictionary);
+
+    QTextStream out(stdout);
+    out << iterations << " payloads per case, threshold " << COMPRESSION_THRESHOLD << " bytes\n";
+    out << "case\tin bytes\tout bytes\tratio\tus/payload\tbytes saved/us\n";
+
+    runCase(out, "json 4k, disabled", largeJson, disabled, iterations);
+    runCase(out, "json 4k", largeJson, plain, iterations);
+    runCase(out, "sensor frame 4k", frames, plain, iterations);
+    runCase(out, "random 4k", random, plain, iterations);
+    runCase(out, "json 200b", shortJson, plain, iterations);
+    runCase(out, "json 200b, dictionary", shortJson, trained, iterations);
+
+    return 0;
+}
@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2017 Ispirata Srl
+ *
+ * This file is part of Astarte.
+ * Astarte is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Astarte is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Astarte.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// Measures the inbound path from the libmosquitto callback to the value handed to the application,
+// for the buffer and views design against the copying one it replaced, and how much of a core
+// each needs at the target rate.
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QDateTime>
+#include <QtCore/QDebug>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QStringList>
+#include <QtCore/QTextStream>
+
+#include <string.h>
+
+#include "internal/wave.h"
+#include "utils/bsondocument.h"
+#include "utils/bsonserializer.h"
+
+#define DEFAULT_MESSAGES 200000
+#define DEFAULT_RATE 10000
+
+// What libmosquitto hands to on_message
+struct RawMessage {
+    QByteArray topic;
+    QByteArray payload;
+};
+
+// Keeps the compiler from optimizing the work away
+static double s_sink = 0;
+
+static void viewsPath(const RawMessage &raw, int rootLength)
+{
+    // on_message: the single copy, libmosquitto frees the message once it returns
+    int topicLength = raw.topic.length();
+    QByteArray buffer;
+    buffer.resize(topicLength + raw.payload.length());
+    memcpy(buffer.data(), raw.topic.constData(), topicLength);
+    memcpy(buffer.data() + topicLength, raw.payload.constData(), raw.payload.length());
+
+    // Transport::onMQTTMessageReceived and routeWave
+    Wave w = Wave::fromBuffer(buffer, rootLength, topicLength - rootLength, topicLength, buffer.length() - topicLength);
+    const QByteArray target = w.target();
+    int targetIndex = target.indexOf('/', 1);
+    const QByteArray interface = QByteArray::fromRawData(target.constData() + 1, targetIndex - 1);
+    w.removeTargetPrefix(targetIndex);
+
+    // The consumer: decode the value, the path is copied once for the application
+    Util::BSONDocument document(w.payload());
+    QByteArray path(w.target().constData(), w.target().length());
+    s_sink += document.doubleValue("v") + interface.length() + path.length();
+}
+
+static void copyingPath(const RawMessage &raw, int rootLength)
+{
+    // on_message
+    QByteArray topic(raw.topic.constData(), raw.topic.length());
+    QByteArray payload(raw.payload.constData(), raw.payload.length());
+
+    // Transport::onMQTTMessageReceived
+    topic.remove(0, rootLength);
+    Wave w;
+    w.setTarget(topic);
+    w.setPayload(payload);
+
+    // routeWave
+    int targetIndex = w.target().indexOf('/', 1);
+    QByteArray interface = w.target().mid(1, targetIndex - 1);
+    QByteArray path = w.target().right(w.target().length() - targetIndex);
+    w.setTarget(path);
+
+    // The consumer
+    Util::BSONDocument document(w.payload());
+    s_sink += document.doubleValue("v") + interface.length() + QByteArray(w.target()).length();
+}
+
+static void runPath(QTextStream &out, const char *name, void (*path)(const RawMessage &, int), const QList<RawMessage> &messages,
+                    int rootLength, int count, int rate)
+{
+    QElapsedTimer timer;
+    timer.start();
+    for (int i = 0; i < count; ++i) {
+        path(messages.at(i % messages.count()), rootLength);
+    }
+    qint64 elapsedns = qMax(Q_INT64_C(1), timer.nsecsElapsed());
+
+    double perMessageus = elapsedns / 1000.0 / count;
+    out << name << '\t' << qRound64(count * 1000000000.0 / elapsedns) << '\t' << QString::number(perMessageus, 'f', 3) << '\t'
+        << QString::number(perMessageus * rate / 10000.0, 'f', 2) << '\n';
+    out.flush();
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    QStringList arguments = app.arguments();
+    if (arguments.size() > 3) {
+        qWarning() << "Usage: astarte-inbound-benchmark [messages] [rate]";
+        return 1;
+    }
+    int count = arguments.size() > 1 ? qMax(1, arguments.at(1).toInt()) : DEFAULT_MESSAGES;
+    int rate = arguments.size() > 2 ? qMax(1, arguments.at(2).toInt()) : DEFAULT_RATE;
+
+    // Server owned datastreams on a handful of paths, as a busy device gets them
+    const QByteArray root("test/Ab3pDoyHLIu4cMFSDcPyOw");
+    QList<RawMessage> messages;
+    for (int i = 0; i < 64; ++i) {
+        Util::BSONSerializer serializer;
+        serializer.appendDoubleValue("v", i * 0.5);
+        serializer.appendDateTime("t", QDateTime::currentDateTime());
+        serializer.appendEndOfDocument();
+
+        RawMessage raw;
+        raw.topic = root + "/com.example.Actuators/valve" + QByteArray::number(i % 16) + "/setpoint";
+        raw.payload = serializer.document();
+        messages.append(raw);
+    }
+
+    QTextStream out(stdout);
+    out << count << " messages, target rate " << rate << " messages/s\n";
+    out << "path\tmessages/s\tus/message\t% of a core at target rate\n";
+
+    // Warm up both, then measure
+    runPath(out, "warm up", viewsPath, messages, root.length(), qMin(count, 10000), rate);
+    runPath(out, "copying", copyingPath, messages, root.length(), count, rate);
+    runPath(out, "views", viewsPath, messages, root.length(), count, rate);
+
+    return s_sink < 0 ? 1 : 0;
+}
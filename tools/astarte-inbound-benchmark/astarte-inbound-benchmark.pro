@@ -0,0 +1,17 @@
+TARGET = astarte-inbound-benchmark
+
+QT -= gui
+
+INCLUDEPATH += ../../lib ../../json
+
+SOURCES = astarte-inbound-benchmark.cpp
+
+LIBS += -L../../lib/ -lAstarteQt4SDK
+
+macx {
+    INCLUDEPATH += /usr/local/Cellar/mosquitto/1.4.14/include
+    LIBS += -L/usr/local/Cellar/mosquitto/1.4.14/lib -lmosquittopp
+}
+unix:!macx {
+    LIBS += -lmosquittopp
+}
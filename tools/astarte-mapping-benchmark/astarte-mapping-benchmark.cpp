@@ -0,0 +1,127 @@
+/*
+ * Copyright (C) 2017 Ispirata Srl
+ *
+ * This file is part of Astarte.
+ * Astarte is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Astarte is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Astarte.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// Measures how resolving the mapping of an outgoing path scales with the number of mappings of an
+// interface: the compiled PathMatcher AstarteGenericProducer uses now, against the scan it replaced,
+// which split the path and compared it with every mapping through Utils::verifyPathMatch. Only that
+// lookup is timed, it is the part of sendData depending on the mapping count.
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QDebug>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QHash>
+#include <QtCore/QStringList>
+#include <QtCore/QTextStream>
+
+#include "utils/pathmatcher.h"
+#include "utils/utils.h"
+
+// Mapping counts, as in interfaces with many parametric endpoints
+static const int mappingCounts[] = { 10, 25, 50, 100, 200, 400, 0 };
+
+static QByteArray mapping(int i)
+{
+    return QString("/%{room}/sensor%1/%{channel}/value").arg(i).toLatin1();
+}
+
+static QByteArray target(int i)
+{
+    return QString("/room%1/sensor%2/ch%3/value").arg(i % 8).arg(i).arg(i % 4).toLatin1();
+}
+
+// Resolves a path the way sendData did: the first mapping of the hash matching it. The mapping
+// goes first, verifyPathMatch only lets the tokens of its first argument be parameters.
+static QByteArray scan(const QHash<QByteArray, QByteArrayList> &mappingToTokens, const QByteArray &path)
+{
+    QByteArrayList targetTokens = path.mid(1).split('/');
+    for (QHash<QByteArray, QByteArrayList>::const_iterator it = mappingToTokens.constBegin(); it != mappingToTokens.constEnd(); ++it) {
+        if (Utils::verifyPathMatch(it.value(), targetTokens)) {
+            return it.key();
+        }
+    }
+
+    return QByteArray();
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    QStringList arguments = app.arguments();
+    if (arguments.size() > 2) {
+        qWarning() << "Usage: astarte-mapping-benchmark [sends]";
+        return 1;
+    }
+
+    int sends = arguments.size() > 1 ? qMax(1, arguments.at(1).toInt()) : 200000;
+
+    QTextStream out(stdout);
+    out << "Sends per mapping count: " << sends << ", to every mapping in turn\n";
+    out << "mappings\tscan sends/s\tmatcher sends/s\tspeedup\n";
+
+    for (int c = 0; mappingCounts[c]; ++c) {
+        int count = mappingCounts[c];
+
+        QHash<QByteArray, QByteArrayList> mappingToTokens;
+        QList<QByteArray> targets;
+        for (int i = 0; i < count; ++i) {
+            mappingToTokens.insert(mapping(i), mapping(i).mid(1).split('/'));
+            targets.append(target(i));
+        }
+
+        QList<QByteArray> mappings = mappingToTokens.keys();
+        Util::PathMatcher matcher;
+        matcher.compile(mappings);
+
+        // Both must resolve every target to its own mapping
+        for (int i = 0; i < count; ++i) {
+            int index = matcher.match(targets.at(i));
+            if (scan(mappingToTokens, targets.at(i)) != mapping(i) || index < 0 || mappings.at(index) != mapping(i)) {
+                QTextStream(stderr) << "Mismatch resolving " << targets.at(i) << '\n';
+                return 1;
+            }
+        }
+
+        QElapsedTimer timer;
+        int resolved = 0;
+
+        timer.start();
+        for (int i = 0; i < sends; ++i) {
+            resolved += !scan(mappingToTokens, targets.at(i % count)).isEmpty();
+        }
+        double scanRate = sends * 1000.0 / qMax(Q_INT64_C(1), timer.elapsed());
+
+        timer.restart();
+        for (int i = 0; i < sends; ++i) {
+            resolved += matcher.match(targets.at(i % count)) >= 0;
+        }
+        double matcherRate = sends * 1000.0 / qMax(Q_INT64_C(1), timer.elapsed());
+
+        if (resolved != 2 * sends) {
+            QTextStream(stderr) << "Unresolved sends with " << count << " mappings\n";
+            return 1;
+        }
+
+        out << count << '\t' << qRound(scanRate) << '\t' << qRound(matcherRate) << '\t'
+            << QString::number(matcherRate / scanRate, 'f', 1) << "x\n";
+        out.flush();
+    }
+
+    return 0;
+}
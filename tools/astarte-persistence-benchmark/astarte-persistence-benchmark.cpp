@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2017 Ispirata Srl
+ *
+ * This file is part of Astarte.
+ * Astarte is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Astarte is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Astarte.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// Measures what write batching saves on the stored datastream path: every sample is inserted when
+// it is queued and deleted when the broker confirms it, a few samples later. Unbatched, each of
+// those statements commits on its own; batched, they are grouped by TransportDatabaseManager's
+// beginBatch/commitBatch as TransportCache does. The database runs in WAL mode with
+// synchronous=FULL, where each commit syncs the journal exactly once, so fsyncs are counted as
+// commits (checkpoints aside).
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QDateTime>
+#include <QtCore/QDebug>
+#include <QtCore/QDir>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFile>
+#include <QtCore/QStringList>
+#include <QtCore/QTextStream>
+
+#include "internal/cachemessage.h"
+#include "utils/transportdatabasemanager.h"
+
+// Samples waiting for the broker confirmation at any time
+#define IN_FLIGHT_SAMPLES 10
+
+struct BenchmarkResult {
+    double samplesPerSecond;
+    qint64 commits;
+};
+
+static void removeDatabases(const QString &directory)
+{
+    Q_FOREACH (const QString &file, QDir(directory).entryList(QDir::Files)) {
+        QFile::remove(QString("%1/%2").arg(directory, file));
+    }
+    QDir().rmdir(directory);
+}
+
+static Astarte::CacheMessage storedSample(qint64 id, const QByteArray &payload)
+{
+    Astarte::CacheMessage message;
+    message.setTarget("/com.example.Sensors/temperature");
+    message.setInterfaceType(AstarteInterface::DataStream);
+    message.setRetention(Stored);
+    message.setTimestamp(QDateTime::currentMSecsSinceEpoch());
+    message.setPayload(payload);
+    message.setDbId(id);
+    return message;
+}
+
+// Counts a commit for every write when unbatched, and one for every batch holding writes otherwise
+class BatchedWriter
+{
+public:
+    BatchedWriter(int batchSize) : m_batchSize(batchSize), m_pending(0), m_commits(0) {}
+
+    bool write(bool insert, qint64 id, const QByteArray &payload)
+    {
+        if (m_batchSize > 1 && m_pending == 0 && !TransportDatabaseManager::beginBatch()) {
+            return false;
+        }
+
+        bool ok = insert ? TransportDatabaseManager::Transactions::insertCacheMessage(storedSample(id, payload)) >= 0
+                         : TransportDatabaseManager::Transactions::deleteCacheMessage(id);
+        if (!ok) {
+            return false;
+        }
+
+        if (m_batchSize <= 1) {
+            ++m_commits;
+        } else if (++m_pending == m_batchSize) {
+            return flush();
+        }
+
+        return true;
+    }
+
+    bool flush()
+    {
+        if (m_pending == 0) {
+            return true;
+        }
+
+        m_pending = 0;
+        ++m_commits;
+        return TransportDatabaseManager::commitBatch();
+    }
+
+    qint64 commits() const { return m_commits; }
+
+private:
+    int m_batchSize;
+    int m_pending;
+    qint64 m_commits;
+};
+
+static bool runBatchSize(const QString &directory, const QString &migrationsDir, int samples, int payloadSize,
+                         int batchSize, BenchmarkResult *result)
+{
+    QString dbPath = QString("%1/persistence-%2.db").arg(directory).arg(batchSize);
+    if (!TransportDatabaseManager::ensureDatabase(dbPath, migrationsDir)) {
+        return false;
+    }
+
+    const QByteArray payload(payloadSize, 'x');
+    BatchedWriter writer(batchSize);
+    QElapsedTimer timer;
+
+    timer.start();
+    for (int i = 1; i <= samples; ++i) {
+        if (!writer.write(true, i, payload)) {
+            return false;
+        }
+        if (i > IN_FLIGHT_SAMPLES && !writer.write(false, i - IN_FLIGHT_SAMPLES, payload)) {
+            return false;
+        }
+    }
+    for (int i = qMax(1, samples - IN_FLIGHT_SAMPLES + 1); i <= samples; ++i) {
+        if (!writer.write(false, i, payload)) {
+            return false;
+        }
+    }
+    if (!writer.flush()) {
+        return false;
+    }
+    result->samplesPerSecond = samples * 1000.0 / qMax(Q_INT64_C(1), timer.elapsed());
+    result->commits = writer.commits();
+
+    TransportDatabaseManager::closeDatabase();
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    QStringList arguments = app.arguments();
+    if (arguments.size() < 2 || arguments.size() > 5) {
+        qWarning() << "Usage: astarte-persistence-benchmark migrationsDir [samples] [payloadSize] [batchSize]";
+        return 1;
+    }
+
+    QString migrationsDir = arguments.at(1);
+    int samples = arguments.size() > 2 ? qMax(1, arguments.at(2).toInt()) : 5000;
+    int payloadSize = arguments.size() > 3 ? qMax(1, arguments.at(3).toInt()) : 64;
+    int batchSize = arguments.size() > 4 ? qMax(2, arguments.at(4).toInt()) : 100;
+
+    TransportDatabaseManager::setPragma(QLatin1String("journal_mode"), QLatin1String("WAL"));
+    TransportDatabaseManager::setPragma(QLatin1String("synchronous"), QLatin1String("FULL"));
+
+    QTextStream out(stdout);
+    out << "Stored samples: " << samples << " of " << payloadSize << " bytes, " << IN_FLIGHT_SAMPLES << " in flight\n";
+    out << "mode\tsamples/s\tfsyncs/sample\n";
+
+    QString directory = QString("%1/astarte-persistence-benchmark-%2").arg(QDir::tempPath()).arg(QCoreApplication::applicationPid());
+    QDir().mkpath(directory);
+
+    const int batchSizes[2] = { 1, batchSize };
+    for (int i = 0; i < 2; ++i) {
+        BenchmarkResult result;
+        if (!runBatchSize(directory, migrationsDir, samples, payloadSize, batchSizes[i], &result)) {
+            QTextStream(stderr) << "Writing with batches of " << batchSizes[i] << " failed\n";
+            removeDatabases(directory);
+            return 1;
+        }
+
+        QString mode = batchSizes[i] == 1 ? QString("unbatched") : QString("batch of %1").arg(batchSizes[i]);
+        out << mode << '\t' << qRound(result.samplesPerSecond) << '\t'
+            << QString::number(double(result.commits) / samples, 'f', 3) << '\n';
+        out.flush();
+    }
+
+    removeDatabases(directory);
+    return 0;
+}
@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 2017 Ispirata Srl
+ *
+ * This file is part of Astarte.
+ * Astarte is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * Astarte is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Astarte.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+// Compares the two stored messages backends, SQLite and the segmented log, on what Stored datastreams
+// do to them: messages appended in batches and acknowledged in FIFO order, then everything still
+// pending read back in pages at startup, as TransportCache does.
+
+#include <QtCore/QCoreApplication>
+#include <QtCore/QDateTime>
+#include <QtCore/QDebug>
+#include <QtCore/QDir>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFileInfo>
+#include <QtCore/QStringList>
+#include <QtCore/QTextStream>
+
+#include "internal/cachemessage.h"
+#include "utils/transportdatabasemanager.h"
+
+#define REPLAY_PAGE_SIZE 500
+
+struct BenchmarkResult {
+    double insertsPerSecond;
+    double acksPerSecond;
+    qint64 recoveryms;
+    int recovered;
+};
+
+static bool removeDirectory(const QString &path)
+{
+    QDir dir(path);
+    Q_FOREACH (const QFileInfo &info, dir.entryInfoList(QDir::Dirs | QDir::Files | QDir::NoDotAndDotDot)) {
+        if (info.isDir() ? !removeDirectory(info.absoluteFilePath()) : !QFile::remove(info.absoluteFilePath())) {
+            return false;
+        }
+    }
+
+    return dir.rmdir(path);
+}
+
+static Astarte::CacheMessage storedMessage(qint64 id, const QByteArray &payload)
+{
+    Astarte::CacheMessage message;
+    message.setTarget("/com.example.Sensors/temperature");
+    message.setInterfaceType(AstarteInterface::DataStream);
+    message.setRetention(Stored);
+    message.setTimestamp(QDateTime::currentMSecsSinceEpoch());
+    message.setPayload(payload);
+    message.setDbId(id);
+    return message;
+}
+
+static bool runBackend(const QString &directory, const QString &migrationsDir, bool log, int messages, int payloadSize,
+                       int batchSize, BenchmarkResult *result)
+{
+    TransportDatabaseManager::setStoredMessagesLog(log ? QString("%1/storedmessages").arg(directory) : QString(), 4 * 1024 * 1024);
+    QString dbPath = QString("%1/persistence.db").arg(directory);
+    if (!TransportDatabaseManager::ensureDatabase(dbPath, migrationsDir)) {
+        return false;
+    }
+
+    const QByteArray payload(payloadSize, 'x');
+    QElapsedTimer timer;
+
+    timer.start();
+    for (int i = 1; i <= messages; ++i) {
+        if (i % batchSize == 1 || batchSize == 1) {
+            TransportDatabaseManager::beginBatch();
+        }
+        if (TransportDatabaseManager::Transactions::insertCacheMessage(storedMessage(i, payload)) < 0) {
+            return false;
+        }
+        if (i % batchSize == 0) {
+            TransportDatabaseManager::commitBatch();
+        }
+    }
+    TransportDatabaseManager::commitBatch();
+    result->insertsPerSecond = messages * 1000.0 / qMax(Q_INT64_C(1), timer.elapsed());
+
+    // The broker confirms the older half, the rest is what a restart finds pending
+    int acks = messages / 2;
+    timer.restart();
+    for (int i = 1; i <= acks; ++i) {
+        if (i % batchSize == 1 || batchSize == 1) {
+            TransportDatabaseManager::beginBatch();
+        }
+        TransportDatabaseManager::Transactions::deleteCacheMessage(i);
+        if (i % batchSize == 0) {
+            TransportDatabaseManager::commitBatch();
+        }
+    }
+    TransportDatabaseManager::commitBatch();
+    result->acksPerSecond = acks * 1000.0 / qMax(Q_INT64_C(1), timer.elapsed());
+
+    TransportDatabaseManager::closeDatabase();
+
+    // Recovery: open, find the last id, page through whatever is pending
+    timer.restart();
+    if (!TransportDatabaseManager::ensureDatabase(dbPath, migrationsDir)) {
+        return false;
+    }
+    qint64 lastId = TransportDatabaseManager::Transactions::lastCacheMessageId();
+    qint64 cursor = 0;
+    result->recovered = 0;
+    while (true) {
+        QList<Astarte::CacheMessage> page = TransportDatabaseManager::Transactions::cacheMessagesPage(cursor, lastId, REPLAY_PAGE_SIZE);
+        if (page.isEmpty()) {
+            break;
+        }
+        result->recovered += page.count();
+        cursor = page.last().dbId();
+    }
+    result->recoveryms = timer.elapsed();
+
+    TransportDatabaseManager::closeDatabase();
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    QStringList arguments = app.arguments();
+    if (arguments.size() < 2 || arguments.size() > 5) {
+        qWarning() << "Usage: astarte-storage-benchmark migrationsDir [messages] [payloadSize] [batchSize]";
+        return 1;
+    }
+
+    QString migrationsDir = arguments.at(1);
+    int messages = arguments.size() > 2 ? qMax(2, arguments.at(2).toInt()) : 100000;
+    int payloadSize = arguments.size() > 3 ? qMax(1, arguments.at(3).toInt()) : 64;
+    int batchSize = arguments.size() > 4 ? qMax(1, arguments.at(4).toInt()) : 50;
+
+    QTextStream out(stdout);
+    out << "Stored messages: " << messages << " of " << payloadSize << " bytes, " << batchSize << " per batch\n";
+    out << "backend\tinserts/s\tacks/s\trecovery ms\trecovered\n";
+
+    QString baseDir = QString("%1/astarte-storage-benchmark-%2").arg(QDir::tempPath()).arg(QCoreApplication::applicationPid());
+    const char *backends[2] = { "sqlite", "log" };
+    for (int i = 0; i < 2; ++i) {
+        QString directory = QString("%1/%2").arg(baseDir, QLatin1String(backends[i]));
+        QDir().mkpath(directory);
+
+        BenchmarkResult result;
+        if (!runBackend(directory, migrationsDir, i == 1, messages, payloadSize, batchSize, &result)) {
+            QTextStream(stderr) << "The " << backends[i] << " backend failed\n";
+            removeDirectory(baseDir);
+            return 1;
+        }
+
+        out << backends[i] << '\t' << qRound(result.insertsPerSecond) << '\t' << qRound(result.acksPerSecond) << '\t'
+            << result.recoveryms << '\t' << result.recovered << '\n';
+        out.flush();
+    }
+
+    removeDirectory(baseDir);
+    return 0;
+}